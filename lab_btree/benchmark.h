@@ -1,7 +1,8 @@
 /**
  * @file benchmark.h
- * Class for easy runtime benchmarks that can output to simple two column
- * csv files.
+ * Class for easy runtime benchmarks that can output to simple csv files: a
+ * column of n, a column of elapsed times and, optionally, columns of extra
+ * measurements (e.g. memory use) and of hardware performance counters.
  *
  * @author Matt Joras
  * @date Winter 2013
@@ -10,11 +11,19 @@
 #define BENCHMARK_H
 
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <sstream>
+#include <sys/resource.h>
+
+#include "perf_counters.h"
 
 /**
  * Class which contains a collection of benchmark results.
@@ -29,39 +38,147 @@ class Benchmark
      */
     struct BenchmarkResult {
         unsigned int n;
+        unsigned int ops;
         std::chrono::high_resolution_clock::time_point start_time;
         std::chrono::high_resolution_clock::time_point end_time;
-        BenchmarkResult(unsigned int n,
+        std::vector<uint64_t> start_counters;
+        std::vector<uint64_t> end_counters;
+        std::vector<double> metrics;
+        BenchmarkResult(unsigned int n, unsigned int ops,
                         std::chrono::high_resolution_clock::time_point s,
                         std::chrono::high_resolution_clock::time_point e)
-            : n(n), start_time(s), end_time(e)
+            : n(n), ops(ops), start_time(s), end_time(e)
         {
         }
     };
 
     std::vector<BenchmarkResult> results;
     std::string name;
+    std::vector<std::string> metric_names;
+    std::unique_ptr<PerfCounters> counters;
 
   public:
     Benchmark(const std::string& name) : name(name)
     {
     }
 
+    /**
+     * Turns on hardware performance counters (cycles, instructions, L1d,
+     * LLC and dTLB misses, branch misses) for every region measured from now
+     * on; they are written out per operation, i.e. divided by the ops of
+     * each point (n unless add_point was told otherwise). Counters
+     * the kernel does not permit are left out, and if none are permitted the
+     * benchmark reports times only.
+     * @return true if at least one counter is being recorded.
+     */
+    bool enable_perf_counters()
+    {
+        if (counters == nullptr) {
+            counters.reset(new PerfCounters());
+            if (!counters->available()) {
+                std::cerr << "Benchmark " << name
+                          << ": hardware counters unavailable "
+                             "(see /proc/sys/kernel/perf_event_paranoid), "
+                             "reporting times only."
+                          << std::endl;
+            }
+        }
+        return counters->available();
+    }
+
     size_t add_point(unsigned int n)
+    {
+        return add_point(n, n);
+    }
+
+    /**
+     * Adds a point whose measured region runs a different number of
+     * operations than n, e.g. n inserts followed by n finds.
+     * @param n The point's parameter, written out as its n column.
+     * @param ops The number of operations the region runs.
+     * @return The index of the point.
+     */
+    size_t add_point(unsigned int n, unsigned int ops)
     {
         auto min = std::chrono::high_resolution_clock::time_point::min();
-        results.emplace_back(n, min, min);
+        results.emplace_back(n, ops, min, min);
         return results.size() - 1;
     }
 
     void start(size_t idx)
     {
+        if (counters != nullptr) {
+            results[idx].start_counters = counters->read();
+        }
         results[idx].start_time = std::chrono::high_resolution_clock::now();
     }
 
     void end(size_t idx)
     {
         results[idx].end_time = std::chrono::high_resolution_clock::now();
+        if (counters != nullptr) {
+            results[idx].end_counters = counters->read();
+        }
+    }
+
+    /**
+     * Attaches an extra measurement to a point. Every distinct column name
+     * becomes a column of the output, left empty for points that did not
+     * record it.
+     * @param idx The point, as returned by add_point.
+     * @param column The column name, e.g. "bytes/entry".
+     * @param value The measurement.
+     */
+    void record(size_t idx, const std::string& column, double value)
+    {
+        size_t col = 0;
+        while (col < metric_names.size() && metric_names[col] != column) {
+            col++;
+        }
+        if (col == metric_names.size()) {
+            metric_names.push_back(column);
+        }
+        std::vector<double>& metrics = results[idx].metrics;
+        if (metrics.size() <= col) {
+            metrics.resize(col + 1, std::numeric_limits<double>::quiet_NaN());
+        }
+        metrics[col] = value;
+    }
+
+    /**
+     * @return The peak resident set size of the process so far, in KB. On
+     * Linux this is the high water mark since the last reset_peak_rss().
+     */
+    static long peak_rss_kb()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                std::stringstream fields(line.substr(6));
+                long kb = 0;
+                fields >> kb;
+                return kb;
+            }
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+
+    /**
+     * Resets the peak resident set size to the current one, so that the
+     * next peak_rss_kb() reflects only what happens after this call. Only
+     * supported on Linux; elsewhere the peak stays process-wide.
+     */
+    static void reset_peak_rss()
+    {
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5" << std::endl;
     }
 
     void write_to_file(std::string out_dir = "results")
@@ -69,12 +186,40 @@ class Benchmark
         using namespace std::chrono;
         std::string outname = out_dir + "/" + name + ".csv";
         std::ofstream out(outname);
-        out << "n,elapsed_time (ms)" << std::endl;
+        std::vector<std::string> counter_names;
+        if (counters != nullptr) {
+            counter_names = counters->names();
+        }
+
+        out << "n,elapsed_time (ms)";
+        for (auto& metric_name : metric_names) {
+            out << "," << metric_name;
+        }
+        for (auto& counter_name : counter_names) {
+            out << "," << counter_name << "/op";
+        }
+        out << std::endl;
         for (auto& result : results) {
             auto diff = result.end_time - result.start_time;
             out << result.n << ","
-            << duration_cast<milliseconds>(diff).count()
-            << std::endl;
+            << duration_cast<milliseconds>(diff).count();
+            for (size_t i = 0; i < metric_names.size(); i++) {
+                out << ",";
+                if (i < result.metrics.size()
+                    && !std::isnan(result.metrics[i])) {
+                    out << result.metrics[i];
+                }
+            }
+            for (size_t i = 0; i < counter_names.size(); i++) {
+                double delta = 0.0;
+                if (i < result.end_counters.size()
+                    && i < result.start_counters.size()) {
+                    delta = static_cast<double>(result.end_counters[i]
+                                                - result.start_counters[i]);
+                }
+                out << "," << (result.ops == 0 ? 0.0 : delta / result.ops);
+            }
+            out << std::endl;
         }
     }
 };
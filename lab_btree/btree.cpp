@@ -1,5 +1,9 @@
 #include "btree.h"
+#include <cstdio>
 #include <typeinfo>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using std::vector;
 using std::queue;
@@ -27,449 +31,3689 @@ V BTree<K, V>::find(const K& key) const
 }
 
 /**
- * Remove the value associated with a given key.
+ * Finds the value associated with a key, starting from a hint.
+ * @param hint The hint, updated to the path to key.
  * @param key The key to look up.
+ * @return The value (if found), the default V if not.
+ */
+template <class K, class V>
+V BTree<K, V>::find(Hint& hint, const K& key) const
+{
+  const BTreeNode* leaf = seek(hint, key);
+  return leaf == nullptr ? V() : find(leaf, key);
+}
+
+/**
+ * Removes a key and its value from the BTree. If the key is not in the
+ * tree do nothing.
+ * @param key The key to remove.
+ */
+template <class K, class V>
+void BTree<K, V>::remove(const K& key)
+{
+  if (root == nullptr) {
+    return;
+  }
+
+  if (lazy_remove) {
+    remove_lazily(key);
+    return;
+  }
+  remove(root, key);
+  shrink_root();
+}
+
+/**
+ * Removes all keys k with lo <= k <= hi. The leaves before and after the
+ * range are chained to each other once everything between them is freed.
+ * @param lo The smallest key to remove.
+ * @param hi The largest key to remove.
+ * @return The number of pairs removed.
+ */
+template <class K, class V>
+size_t BTree<K, V>::erase_range(const K& lo, const K& hi)
+{
+  if (root == nullptr || hi < lo) {
+    return 0;
+  }
+  BTreeNode* lo_leaf = find_leaf(lo);
+  BTreeNode* hi_leaf = find_leaf(hi);
+  size_t erased = erase_range(root, &lo, &hi);
+  if (erased == 0) {
+    return 0;
+  }
+  structure_version++;
+  if (lo_leaf != hi_leaf) {
+    lo_leaf->next = hi_leaf;
+    rebuild_filter(hi_leaf);
+  }
+  rebuild_filter(lo_leaf);
+
+  /* Fixing one path can take an element from a parent on the other. */
+  bool changed = true;
+  while (changed) {
+    shrink_root();
+    if (root == nullptr) {
+      break;
+    }
+    changed = rebalance_path(lo);
+    changed = rebalance_path(hi) || changed;
+  }
+  return erased;
+}
+
+/**
+ * Moves every pair of another BTree into this one. Disjoint trees of the
+ * same order are joined along a spine; any others are merged pair by pair
+ * and rebuilt.
+ * @param other The BTree to merge in.
+ */
+template <class K, class V>
+void BTree<K, V>::merge(BTree&& other)
+{
+  if (&other == this || other.root == nullptr) {
+    return;
+  }
+  match_settings(other);
+  structure_version++;
+  other.structure_version++;
+  if (root == nullptr && other.order == order) {
+    std::swap(root, other.root);
+    std::swap(tombstone_count, other.tombstone_count);
+    return;
+  }
+
+  /* The edge leaves bound each tree's keys; an empty one (the purges can
+   * leave one behind) just sends the trees down the slow path. */
+  const BTreeNode* first = root;
+  const BTreeNode* last = root;
+  const BTreeNode* other_first = other.root;
+  const BTreeNode* other_last = other.root;
+  while (first != nullptr && !first->is_leaf) {
+    first = first->children.front();
+    last = last->children.back();
+  }
+  while (!other_first->is_leaf) {
+    other_first = other_first->children.front();
+    other_last = other_last->children.back();
+  }
+  bool joinable = first != nullptr && other.order == order
+                  && !first->elements.empty() && !last->elements.empty()
+                  && !other_first->elements.empty()
+                  && !other_last->elements.empty();
+  if (joinable
+      && last->elements.back().key < other_first->elements.front().key) {
+    root = join(root, other.root,
+                shortest_separator(last->elements.back().key,
+                                   other_first->elements.front().key));
+  } else if (joinable
+             && other_last->elements.back().key < first->elements.front().key) {
+    root = join(other.root, root,
+                shortest_separator(other_last->elements.back().key,
+                                   first->elements.front().key));
+  } else {
+    auto collect = [this](const BTreeNode* leaf,
+                          vector<std::pair<K, V>>& out) {
+      for (; leaf != nullptr; leaf = leaf->next) {
+        for (size_t i = 0; i < leaf->elements.size(); i++) {
+          if (!is_tombstone(leaf, i)) {
+            out.push_back(std::make_pair(leaf->elements[i].key,
+                                         leaf->elements[i].value));
+          }
+        }
+      }
+    };
+    vector<std::pair<K, V>> mine;
+    vector<std::pair<K, V>> theirs;
+    collect(first, mine);
+    collect(other_first, theirs);
+    vector<std::pair<K, V>> pairs;
+    pairs.reserve(mine.size() + theirs.size());
+    size_t j = 0;
+    for (size_t i = 0; i < mine.size(); i++) {
+      for (; j < theirs.size() && theirs[j].first < mine[i].first; j++) {
+        pairs.push_back(theirs[j]);
+      }
+      if (j < theirs.size() && theirs[j].first == mine[i].first) {
+        j++;
+      }
+      pairs.push_back(mine[i]);
+    }
+    pairs.insert(pairs.end(), theirs.begin() + j, theirs.end());
+    build_sorted(pairs);
+    other.clear();
+    return;
+  }
+  tombstone_count += other.tombstone_count;
+  other.tombstone_count = 0;
+  other.root = nullptr;
+}
+
+/**
+ * Cuts the BTree in two along the path to a key. Each node on the path
+ * keeps the children left of it and gives a new twin the ones right of
+ * it; the child on the path is cut the same way one level down, and its
+ * two halves go to the node and its twin.
+ * @param key The smallest key to move out.
+ * @return A BTree holding the pairs whose keys are not less than key.
+ */
+template <class K, class V>
+BTree<K, V> BTree<K, V>::split_at(const K& key)
+{
+  BTree ret(order);
+  ret.leaf_filters = leaf_filters;
+  ret.key_pages = key_pages;
+  ret.subtree_counts = subtree_counts;
+  ret.aggregate_combine = aggregate_combine;
+  ret.aggregate_identity = aggregate_identity;
+  ret.lazy_remove = lazy_remove;
+  ret.purge_ratio = purge_ratio;
+  if (root == nullptr) {
+    return ret;
+  }
+  if (tombstone_count > 0) {
+    purge();
+  }
+  structure_version++;
+
+  vector<BTreeNode*> path;
+  vector<BTreeNode*> twins;
+  vector<size_t> indices;
+  BTreeNode* node = root;
+  while (!node->is_leaf) {
+    size_t idx = child_index(node, key);
+    BTreeNode* twin = new BTreeNode(false, inner_order);
+    twin->keys.assign(node->keys.begin() + idx, node->keys.end());
+    node->keys.erase(node->keys.begin() + idx, node->keys.end());
+    /* twin->children[0] is the right half of children[idx], filled in
+     * once that is cut. */
+    twin->children.push_back(nullptr);
+    twin->children.insert(twin->children.end(),
+                          node->children.begin() + idx + 1,
+                          node->children.end());
+    node->children.erase(node->children.begin() + idx + 1,
+                         node->children.end());
+    for (size_t i = 1; i < twin->children.size(); i++) {
+      twin->children[i]->parent = twin;
+    }
+    if (subtree_counts) {
+      twin->counts.push_back(0);
+      twin->counts.insert(twin->counts.end(), node->counts.begin() + idx + 1,
+                          node->counts.end());
+      node->counts.erase(node->counts.begin() + idx + 1, node->counts.end());
+    }
+    if (aggregate_combine) {
+      twin->aggregates.push_back(aggregate_identity);
+      twin->aggregates.insert(twin->aggregates.end(),
+                              node->aggregates.begin() + idx + 1,
+                              node->aggregates.end());
+      node->aggregates.erase(node->aggregates.begin() + idx + 1,
+                             node->aggregates.end());
+    }
+    path.push_back(node);
+    twins.push_back(twin);
+    indices.push_back(idx);
+    node = node->children[idx];
+  }
+
+  /* No tombstones are left, but a leaf that revived one still has its
+   * (all clear) bits, which the cut below would leave behind. */
+  purge_leaf(node);
+  size_t idx = node_search(node, key);
+  BTreeNode* twin = new BTreeNode(true, order);
+  twin->elements.assign(node->elements.begin() + idx, node->elements.end());
+  node->elements.erase(node->elements.begin() + idx, node->elements.end());
+  twin->next = node->next;
+  node->next = nullptr;
+  rebuild_filter(node);
+  rebuild_filter(twin);
+  refresh_key_page(node);
+  refresh_key_page(twin);
+
+  /* Hang each half under its parent's half, bottom up, so the counts and
+   * aggregates read from children that are already cut. */
+  for (size_t i = path.size(); i > 0; i--) {
+    BTreeNode* parent = path[i - 1];
+    BTreeNode* parent_twin = twins[i - 1];
+    parent_twin->children[0] = twin;
+    twin->parent = parent_twin;
+    if (subtree_counts) {
+      parent->counts[indices[i - 1]] = subtree_size(node);
+      parent_twin->counts[0] = subtree_size(twin);
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(parent, indices[i - 1]);
+      refresh_aggregate(parent_twin, 0);
+    }
+    refresh_key_page(parent);
+    refresh_key_page(parent_twin);
+    node = parent;
+    twin = parent_twin;
+  }
+  ret.root = twin;
+
+  rebalance_spine(key);
+  ret.rebalance_spine(key);
+  return ret;
+}
+
+/**
+ * Switches between eager and lazy removal.
+ * @param enabled Whether remove() should leave tombstones.
+ * @param purge_ratio The tombstone ratio past which remove() runs
+ * compaction slices, or 0 to only purge when asked.
+ */
+template <class K, class V>
+void BTree<K, V>::set_lazy_remove(bool enabled, double purge_ratio)
+{
+  lazy_remove = enabled;
+  this->purge_ratio = purge_ratio;
+  if (!enabled) {
+    purge();
+  }
+  purge_threshold = static_cast<size_t>(purge_ratio * size());
+}
+
+/**
+ * Erases every tombstone, then borrows and merges wherever that left a
+ * node underfull, one pass over the tree.
+ * @return The number of tombstones erased.
+ */
+template <class K, class V>
+size_t BTree<K, V>::purge()
+{
+  size_t purged = tombstone_count;
+  if (root != nullptr && purged > 0) {
+    purge(root);
+    shrink_root();
+    structure_version++;
+  }
+  purge_threshold = static_cast<size_t>(purge_ratio * size());
+  return purged;
+}
+
+/**
+ * Runs compaction until the budget is spent or the pass ends. Each group is
+ * found again from the root by the cursor key, so a slice resumes correctly
+ * even if the tree was restructured since the last one. The cursor then
+ * moves to the separator just right of the group, which always grows, so
+ * each level is walked once.
+ * @param fill The fraction of a node's capacity to fill nodes to.
+ * @param budget Roughly the most nodes to visit in this slice.
+ * @return true if this slice finished a pass.
+ */
+template <class K, class V>
+bool BTree<K, V>::compact(double fill, size_t budget)
+{
+  size_t visited = 0;
+  while (root != nullptr) {
+    size_t height = 0;
+    for (BTreeNode* node = root; !node->is_leaf; node = node->children[0]) {
+      height++;
+    }
+    if (compact_level >= height) {
+      break;
+    }
+
+    vector<std::pair<BTreeNode*, size_t>> path;
+    vector<K> hi;
+    BTreeNode* group = root;
+    for (size_t depth = height - compact_level - 1; depth > 0; depth--) {
+      size_t idx = compact_cursor.empty()
+                       ? 0
+                       : child_index(group, compact_cursor.front());
+      if (idx < group->keys.size()) {
+        hi.assign(1, group->keys[idx]);
+      }
+      path.push_back(std::make_pair(group, idx));
+      group = group->children[idx];
+    }
+
+    /* The leaf before the group hangs off the deepest ancestor that did
+     * not take its leftmost child. */
+    BTreeNode* prev = nullptr;
+    if (compact_level == 0) {
+      for (auto step = path.rbegin(); step != path.rend(); ++step) {
+        if (step->second > 0) {
+          prev = step->first->children[step->second - 1];
+          while (!prev->is_leaf) {
+            prev = prev->children.back();
+          }
+          break;
+        }
+      }
+    }
+
+    /* Purging the group's leaves or repacking it can leave nodes on the
+     * path underfull; fixing them bottom up never undoes a lower fix. */
+    visited += group->children.size();
+    bool purged = compact_level == 0 && tombstone_count > 0;
+    if (repack_children(group, prev, fill) || purged) {
+      rebalance_children(group);
+      for (auto step = path.rbegin(); step != path.rend(); ++step) {
+        rebalance_children(step->first);
+      }
+      shrink_root();
+    }
+
+    if (hi.empty()) {
+      compact_level++;
+      compact_cursor.clear();
+    } else {
+      compact_cursor.swap(hi);
+    }
+    if (visited >= budget) {
+      return false;
+    }
+  }
+  compact_level = 0;
+  compact_cursor.clear();
+  return true;
+}
+
+/**
+ * Checks the subtrees at a wide enough level on several threads, then the
+ * few levels above them and the order of the keys across subtrees on the
+ * calling thread.
+ * @param order The order the BTree should satisfy.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ * @return true if it satisfies the conditions, false otherwise.
+ */
+template <class K, class V>
+bool BTree<K, V>::is_valid_parallel(unsigned int order,
+                                    unsigned int threads) const
+{
+  if (root == nullptr) {
+    return true;
+  }
+  threads = thread_count(threads);
+  size_t depth;
+  vector<BTreeNode*> nodes = frontier(root, 4 * threads, depth);
+  vector<SubtreeCheck> checks(nodes.size());
+  parallel_for(nodes.size(), threads, [&](size_t i) {
+    SubtreeCheck& check = checks[i];
+    const BTreeNode* next = i + 1 < nodes.size() ? nodes[i + 1] : nullptr;
+    while (next != nullptr && !next->is_leaf) {
+      next = next->children.front();
+    }
+    check.size = 0;
+    check.valid = is_valid(nodes[i], check.data, order)
+                  && std::is_sorted(check.data.begin(), check.data.end())
+                  && leaves_linked(nodes[i], next)
+                  && (!subtree_counts || counts_valid(nodes[i], check.size));
+  });
+
+  size_t next = 0;
+  size_t size = 0;
+  vector<DataPair> outline;
+  return is_valid_above(root, depth, order, checks, next, outline, size)
+         && std::is_sorted(outline.begin(), outline.end());
+}
+
+/**
+ * Clears the BTree, freeing the subtrees at a wide enough level on several
+ * threads and the few nodes above them on the calling thread.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ */
+template <class K, class V>
+void BTree<K, V>::clear_parallel(unsigned int threads)
+{
+  if (root == nullptr) {
+    return;
+  }
+  threads = thread_count(threads);
+  size_t depth;
+  vector<BTreeNode*> nodes = frontier(root, 4 * threads, depth);
+  parallel_for(nodes.size(), threads, [&](size_t i) { clear(nodes[i]); });
+  clear_above(root, depth);
+  root = nullptr;
+  structure_version++;
+  tombstone_count = 0;
+}
+
+/**
+ * Detaches the BTree's nodes and frees them on a new thread.
+ * @return The thread freeing the nodes.
+ */
+template <class K, class V>
+std::thread BTree<K, V>::clear_in_background()
+{
+  BTreeNode* old_root = root;
+  root = nullptr;
+  structure_version++;
+  tombstone_count = 0;
+  return std::thread([old_root]() {
+    if (old_root != nullptr) {
+      clear(old_root);
+    }
+  });
+}
+
+/**
+ * Replaces the value associated with a key already in the BTree.
+ * @param key The key to look up.
+ * @param value The new value for key.
+ * @return true if key was present (and updated), false otherwise.
+ */
+template <class K, class V>
+bool BTree<K, V>::update(const K& key, const V& value)
+{
+  BTreeNode* leaf = root;
+  if (leaf == nullptr) {
+    return false;
+  }
+  vector<std::pair<BTreeNode*, size_t>> path;
+  while (!leaf->is_leaf) {
+    size_t child = child_index(leaf, key);
+    if (aggregate_combine) {
+      path.push_back(std::make_pair(leaf, child));
+    }
+    leaf = leaf->children[child];
+  }
+  size_t idx = node_search(leaf, key);
+  if (idx < leaf->elements.size() && leaf->elements[idx] == key
+      && !is_tombstone(leaf, idx)) {
+    leaf->elements[idx].value = value;
+    for (auto step = path.rbegin(); step != path.rend(); ++step) {
+      refresh_aggregate(step->first, step->second);
+    }
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Visits, in ascending key order, up to count pairs whose keys are not
+ * less than lo.
+ * @param lo The smallest key to visit.
+ * @param count The maximum number of pairs to visit.
+ * @param visit Callable invoked as visit(key, value) for each pair.
+ * @return The number of pairs visited.
+ */
+template <class K, class V>
+template <class F>
+size_t BTree<K, V>::scan(const K& lo, size_t count, F visit) const
+{
+  const BTreeNode* leaf = find_leaf(lo);
+  if (leaf == nullptr) {
+    return 0;
+  }
+
+  size_t visited = 0;
+  size_t idx = node_search(leaf, lo);
+  while (leaf != nullptr && visited < count) {
+    for (; visited < count && idx < leaf->elements.size(); idx++) {
+      if (is_tombstone(leaf, idx)) {
+        continue;
+      }
+      const DataPair& pair = leaf->elements[idx];
+      visit(pair.key, pair.value);
+      visited++;
+    }
+    leaf = leaf->next;
+    idx = 0;
+  }
+  return visited;
+}
+
+/**
+ * Walks the leaves from lo, matching each run of up to 64 elements in one
+ * go, and collects the matches into a batch, which is handed to emit
+ * whenever it fills.
+ * @param lo The smallest key to include.
+ * @param hi The largest key to include.
+ * @param op How values are compared against bound.
+ * @param bound The value to compare against.
+ * @param emit Callable invoked as emit(keys, values, count).
+ * @param batch The most matches per call to emit.
+ * @return The number of matches.
+ */
+template <class K, class V>
+template <class F>
+size_t BTree<K, V>::scan_where(const K& lo, const K& hi, ValueCompare op,
+                               const V& bound, F emit, size_t batch) const
+{
+  ValueFilter<V> filter(op, bound);
+  batch = std::max<size_t>(batch, 1);
+  vector<K> keys;
+  vector<V> values;
+  keys.reserve(batch);
+  values.reserve(batch);
+  size_t matched = 0;
+  auto flush = [&]() {
+    if (!keys.empty()) {
+      emit(keys.data(), values.data(), keys.size());
+      matched += keys.size();
+      keys.clear();
+      values.clear();
+    }
+  };
+
+  const BTreeNode* leaf = hi < lo ? nullptr : find_leaf(lo);
+  size_t idx = leaf == nullptr ? 0 : node_search(leaf, lo);
+  for (; leaf != nullptr; leaf = leaf->next, idx = 0) {
+    const vector<DataPair>& elements = leaf->elements;
+    size_t end = elements.size();
+    bool last = end > 0 && hi < elements.back().key;
+    if (last) {
+      end = std::upper_bound(elements.begin() + idx, elements.end(), hi,
+                             [](const K& key, const DataPair& pair) {
+                               return key < pair.key;
+                             })
+            - elements.begin();
+    }
+    for (size_t run = idx; run < end; run += 64) {
+      uint64_t mask =
+          filter.match_mask(&elements[run], std::min<size_t>(64, end - run));
+      for (; mask != 0; mask &= mask - 1) {
+        size_t i = run + __builtin_ctzll(mask);
+        if (is_tombstone(leaf, i)) {
+          continue;
+        }
+        keys.push_back(elements[i].key);
+        values.push_back(elements[i].value);
+        if (keys.size() == batch) {
+          flush();
+        }
+      }
+    }
+    if (last) {
+      break;
+    }
+  }
+  flush();
+  return matched;
+}
+
+/**
+ * Cuts the range into chunks and visits them on the shared pool.
+ * @param lo The smallest key to visit.
+ * @param hi The largest key to visit.
+ * @param visit Callable invoked as visit(key, value) for each pair.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ */
+template <class K, class V>
+template <class F>
+void BTree<K, V>::parallel_scan(const K& lo, const K& hi, F visit,
+                                unsigned int threads) const
+{
+  if (root == nullptr || hi < lo) {
+    return;
+  }
+  threads = thread_count(threads);
+  vector<K> cuts = range_cuts(lo, hi, 4 * threads);
+  parallel_for(cuts.size() + 1, threads, [&](size_t i) {
+    scan_chunk(i == 0 ? lo : cuts[i - 1], i < cuts.size() ? &cuts[i] : nullptr,
+               hi, visit);
+  });
+}
+
+/**
+ * Folds each chunk of the range on the shared pool, then folds the chunks'
+ * results in key order on the calling thread.
+ * @param lo The smallest key to include.
+ * @param hi The largest key to include.
+ * @param map Callable invoked as map(key, value), returning an R.
+ * @param combine Callable invoked as combine(a, b) on two Rs.
+ * @param identity The result of no pairs.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ * @return The combined result.
+ */
+template <class K, class V>
+template <class R, class M, class C>
+R BTree<K, V>::parallel_reduce(const K& lo, const K& hi, M map, C combine,
+                               const R& identity, unsigned int threads) const
+{
+  if (root == nullptr || hi < lo) {
+    return identity;
+  }
+  threads = thread_count(threads);
+  vector<K> cuts = range_cuts(lo, hi, 4 * threads);
+  /* Each chunk folds into its own cache line. A vector<R> would not do:
+   * chunks would share lines, and vector<bool> even packs them into the
+   * same words, making neighbouring chunks' writes a data race. */
+  struct alignas(64) Partial {
+    R value;
+  };
+  vector<Partial> results(cuts.size() + 1, Partial{identity});
+  parallel_for(results.size(), threads, [&](size_t i) {
+    R& result = results[i].value;
+    auto fold = [&](const K& key, const V& value) {
+      result = combine(result, map(key, value));
+    };
+    scan_chunk(i == 0 ? lo : cuts[i - 1], i < cuts.size() ? &cuts[i] : nullptr,
+               hi, fold);
+  });
+  R total = identity;
+  for (const Partial& result : results) {
+    total = combine(total, result.value);
+  }
+  return total;
+}
+
+/**
+ * Walks down the nodes that overlap the range, a level at a time. Within
+ * an overlapping node the children that overlap it run from the one lo
+ * routes to through the one hi routes to, and the separators between them
+ * start new chunks; the cuts of the level above stay, since they separate
+ * the nodes of this one.
+ * @param lo The smallest key of the range.
+ * @param hi The largest key of the range.
+ * @param width The number of chunks wanted.
+ * @return The separators that start every chunk but the first.
+ */
+template <class K, class V>
+vector<K> BTree<K, V>::range_cuts(const K& lo, const K& hi,
+                                  size_t width) const
+{
+  vector<const BTreeNode*> level(1, root);
+  vector<K> cuts;
+  while (cuts.size() + 1 < width && !level.front()->is_leaf) {
+    vector<const BTreeNode*> below;
+    vector<K> below_cuts;
+    for (size_t n = 0; n < level.size(); n++) {
+      if (n > 0) {
+        below_cuts.push_back(cuts[n - 1]);
+      }
+      const BTreeNode* node = level[n];
+      size_t first = child_index(node, lo);
+      size_t last = child_index(node, hi);
+      for (size_t i = first; i <= last; i++) {
+        if (i > first) {
+          below_cuts.push_back(node->keys[i - 1]);
+        }
+        below.push_back(node->children[i]);
+      }
+    }
+    level.swap(below);
+    cuts.swap(below_cuts);
+  }
+  return cuts;
+}
+
+/**
+ * Visits one chunk of a range, starting at the leaf from routes to and
+ * following the leaf chain.
+ * @param from The smallest key to visit.
+ * @param to The key to stop before, or nullptr.
+ * @param hi The largest key to visit when to is nullptr.
+ * @param visit Callable invoked as visit(key, value) for each pair.
+ */
+template <class K, class V>
+template <class F>
+void BTree<K, V>::scan_chunk(const K& from, const K* to, const K& hi,
+                             F& visit) const
+{
+  const BTreeNode* leaf = find_leaf(from);
+  size_t idx = node_search(leaf, from);
+  for (; leaf != nullptr; leaf = leaf->next, idx = 0) {
+    for (; idx < leaf->elements.size(); idx++) {
+      const DataPair& pair = leaf->elements[idx];
+      if (to != nullptr ? !(pair.key < *to) : hi < pair.key) {
+        return;
+      }
+      if (!is_tombstone(leaf, idx)) {
+        visit(pair.key, pair.value);
+      }
+    }
+  }
+}
+
+/**
+ * Builds an immutable, pointer free copy of the BTree's current contents by
+ * walking the leaf chain.
+ * @return The frozen copy.
+ */
+template <class K, class V>
+FrozenBTree<K, V> BTree<K, V>::freeze() const
+{
+  vector<K> keys;
+  vector<V> values;
+  const BTreeNode* leaf = root;
+  while (leaf != nullptr && !leaf->is_leaf) {
+    leaf = leaf->children.front();
+  }
+  for (; leaf != nullptr; leaf = leaf->next) {
+    for (size_t i = 0; i < leaf->elements.size(); i++) {
+      if (!is_tombstone(leaf, i)) {
+        keys.push_back(leaf->elements[i].key);
+        values.push_back(leaf->elements[i].value);
+      }
+    }
+  }
+  return FrozenBTree<K, V>(keys, values);
+}
+
+/**
+ * Replaces the contents of the BTree with the given pairs, building it
+ * bottom up.
+ * @param pairs The key / value pairs, in any order.
+ */
+template <class K, class V>
+void BTree<K, V>::bulk_load(vector<std::pair<K, V>> pairs)
+{
+  auto by_key = [](const std::pair<K, V>& lhs, const std::pair<K, V>& rhs) {
+    return lhs.first < rhs.first;
+  };
+  if (!std::is_sorted(pairs.begin(), pairs.end(), by_key)) {
+    std::stable_sort(pairs.begin(), pairs.end(), by_key);
+  }
+  auto same_key = [](const std::pair<K, V>& lhs, const std::pair<K, V>& rhs) {
+    return lhs.first == rhs.first;
+  };
+  pairs.erase(std::unique(pairs.begin(), pairs.end(), same_key), pairs.end());
+  build_sorted(pairs);
+}
+
+/**
+ * Replaces the contents of the BTree with the given pairs, building it
+ * bottom up on several threads. Chunk t of the input is
+ * [bounds[t], bounds[t + 1]); once sorted, each chunk is deduplicated in
+ * place, and unique pair u then lives in the chunk whose offset range
+ * holds it, so leaves read straight out of the chunks without another
+ * pass to close the gaps.
+ * @param pairs The key / value pairs, in any order.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ */
+template <class K, class V>
+void BTree<K, V>::bulk_load_parallel(vector<std::pair<K, V>> pairs,
+                                     unsigned int threads)
+{
+  /* Below a few thousand pairs a thread costs more than it saves. */
+  size_t chunks = std::min<size_t>(thread_count(threads),
+                                   pairs.size() / 4096);
+  if (chunks < 2) {
+    bulk_load(std::move(pairs));
+    return;
+  }
+
+  auto by_key = [](const std::pair<K, V>& lhs, const std::pair<K, V>& rhs) {
+    return lhs.first < rhs.first;
+  };
+  vector<size_t> bounds;
+  for (size_t t = 0; t <= chunks; t++) {
+    bounds.push_back(t * pairs.size() / chunks);
+  }
+  auto chunk_begin = [&](size_t t) { return pairs.begin() + bounds[t]; };
+
+  vector<char> sorted(chunks);
+  run_parallel(chunks, [&](size_t t) {
+    sorted[t] = std::is_sorted(chunk_begin(t), chunk_begin(t + 1), by_key)
+                && (t == 0 || !by_key(pairs[bounds[t]], pairs[bounds[t] - 1]));
+  });
+  if (std::count(sorted.begin(), sorted.end(), 0) > 0) {
+    run_parallel(chunks, [&](size_t t) {
+      std::stable_sort(chunk_begin(t), chunk_begin(t + 1), by_key);
+    });
+    /* inplace_merge is stable, so the first of equal keys stays first. */
+    for (size_t width = 1; width < chunks; width *= 2) {
+      run_parallel((chunks + 2 * width - 1) / (2 * width), [&](size_t m) {
+        size_t lo = 2 * m * width;
+        size_t mid = std::min(lo + width, chunks);
+        size_t hi = std::min(lo + 2 * width, chunks);
+        if (mid < hi) {
+          std::inplace_merge(chunk_begin(lo), chunk_begin(mid), chunk_begin(hi),
+                             by_key);
+        }
+      });
+    }
+  }
+
+  /* A pair is kept unless it repeats the key before it, which may be the
+   * last key of the previous chunk. */
+  vector<size_t> offsets(chunks + 1, 0);
+  run_parallel(chunks, [&](size_t t) {
+    size_t kept = bounds[t];
+    for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+      if (i == 0 || by_key(pairs[i - 1], pairs[i])) {
+        if (kept != i) {
+          pairs[kept] = pairs[i];
+        }
+        kept++;
+      }
+    }
+    offsets[t + 1] = kept - bounds[t];
+  });
+  for (size_t t = 0; t < chunks; t++) {
+    offsets[t + 1] += offsets[t];
+  }
+  size_t total = offsets.back();
+
+  clear();
+  size_t leaf_count = (total + order - 2) / (order - 1);
+  vector<BTreeNode*> leaves(leaf_count);
+  run_parallel(chunks, [&](size_t t) {
+    size_t first = leaf_count * t / chunks;
+    size_t last = leaf_count * (t + 1) / chunks;
+    if (first == last) {
+      return;
+    }
+    size_t u = total * first / leaf_count;
+    size_t chunk = std::upper_bound(offsets.begin(), offsets.end(), u)
+                   - offsets.begin() - 1;
+    for (size_t i = first; i < last; i++) {
+      size_t end = total * (i + 1) / leaf_count;
+      BTreeNode* leaf = new BTreeNode(true, order);
+      for (; u < end; u++) {
+        while (u >= offsets[chunk + 1]) {
+          chunk++;
+        }
+        const std::pair<K, V>& pair = pairs[bounds[chunk] + u - offsets[chunk]];
+        leaf->elements.push_back(DataPair(pair.first, pair.second));
+      }
+      rebuild_filter(leaf);
+      refresh_key_page(leaf);
+      leaves[i] = leaf;
+    }
+  });
+  for (size_t i = 1; i < leaf_count; i++) {
+    leaves[i - 1]->next = leaves[i];
+  }
+
+  root = build_levels(leaves);
+  for (vector<BTreeNode*> level(1, root); !level.front()->is_leaf;) {
+    vector<BTreeNode*> below;
+    for (auto node : level) {
+      refresh_key_page(node);
+      below.insert(below.end(), node->children.begin(), node->children.end());
+    }
+    level.swap(below);
+  }
+}
+
+/**
+ * Inserts a batch of pairs, merging each leaf's run of new keys in one pass.
+ * @param first The first pair of the batch.
+ * @param last One past the last pair of the batch.
+ */
+template <class K, class V>
+template <class Iter>
+void BTree<K, V>::insert_batch(Iter first, Iter last)
+{
+  vector<DataPair> batch;
+  for (; first != last; ++first) {
+    batch.push_back(DataPair(first->first, first->second));
+  }
+  auto by_key = [](const DataPair& lhs, const DataPair& rhs) {
+    return lhs.key < rhs.key;
+  };
+  if (!std::is_sorted(batch.begin(), batch.end(), by_key)) {
+    std::stable_sort(batch.begin(), batch.end(), by_key);
+  }
+  auto same_key = [](const DataPair& lhs, const DataPair& rhs) {
+    return lhs.key == rhs.key;
+  };
+  batch.erase(std::unique(batch.begin(), batch.end(), same_key), batch.end());
+  if (batch.empty()) {
+    return;
+  }
+
+  if (root == nullptr) {
+    root = new BTreeNode(true, order);
+  }
+  insert_batch(root, batch.begin(), batch.end());
+
+  /* A large enough batch grows the tree by several levels at once. */
+  while (node_size(root) >= node_order(root)) {
+    BTreeNode* new_root = new BTreeNode(false, inner_order);
+    new_root->children.push_back(root);
+    if (subtree_counts) {
+      new_root->counts.push_back(subtree_size(root));
+    }
+    if (aggregate_combine) {
+      new_root->aggregates.push_back(summarize(root));
+    }
+    split_child_many(new_root, 0);
+    root = new_root;
+    counters.root_grows++;
+  }
+}
+
+/**
+ * Writes the BTree's pairs and settings to a snapshot file.
+ * @param path The file to write.
+ */
+template <class K, class V>
+void BTree<K, V>::save(const std::string& path) const
+{
+  const BTreeNode* first = root;
+  while (first != nullptr && !first->is_leaf) {
+    first = first->children.front();
+  }
+  uint64_t count = 0;
+  for (const BTreeNode* leaf = first; leaf != nullptr; leaf = leaf->next) {
+    count += live_size(leaf);
+  }
+
+  std::string temp_path = path + ".tmp";
+  try {
+    SnapshotWriter out(temp_path);
+    out.write("BTSNAPSH", 8);
+    out.write_int<uint32_t>(SNAPSHOT_VERSION);
+    out.write_int<uint32_t>(SnapshotCodec<K>::id());
+    out.write_int<uint32_t>(SnapshotCodec<V>::id());
+    out.write_int<uint32_t>(order);
+    out.write_int<uint32_t>((leaf_filters ? 1 : 0) | (key_pages ? 2 : 0)
+                            | (subtree_counts ? 4 : 0));
+    out.write_int<uint64_t>(count);
+    for (const BTreeNode* leaf = first; leaf != nullptr; leaf = leaf->next) {
+      for (size_t i = 0; i < leaf->elements.size(); i++) {
+        if (!is_tombstone(leaf, i)) {
+          SnapshotCodec<K>::write(out, leaf->elements[i].key);
+          SnapshotCodec<V>::write(out, leaf->elements[i].value);
+        }
+      }
+    }
+    out.finish();
+  } catch (...) {
+    std::remove(temp_path.c_str());
+    throw;
+  }
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    throw std::runtime_error("cannot replace " + path);
+  }
+}
+
+/**
+ * Replaces the contents and settings of the BTree with those of a snapshot
+ * written by save().
+ * @param path The file to read.
+ */
+template <class K, class V>
+void BTree<K, V>::load(const std::string& path)
+{
+  SnapshotReader in(path);
+  char magic[8];
+  in.read(magic, sizeof(magic));
+  if (std::string(magic, sizeof(magic)) != "BTSNAPSH"
+      || in.read_int<uint32_t>() != SNAPSHOT_VERSION) {
+    in.fail("is not a BTree snapshot of a supported version");
+  }
+  if (in.read_int<uint32_t>() != SnapshotCodec<K>::id()
+      || in.read_int<uint32_t>() != SnapshotCodec<V>::id()) {
+    in.fail("holds other key or value types");
+  }
+  unsigned int loaded_order = in.read_int<uint32_t>();
+  uint32_t flags = in.read_int<uint32_t>();
+  uint64_t count = in.read_int<uint64_t>();
+  if (loaded_order < 3) {
+    in.fail("has an invalid order");
+  }
+
+  vector<std::pair<K, V>> pairs;
+  std::pair<K, V> pair;
+  for (uint64_t i = 0; i < count; i++) {
+    SnapshotCodec<K>::read(in, pair.first);
+    SnapshotCodec<V>::read(in, pair.second);
+    if (!pairs.empty() && !(pairs.back().first < pair.first)) {
+      in.fail("is not sorted");
+    }
+    pairs.push_back(pair);
+  }
+  in.finish();
+
+  order = loaded_order;
+  inner_order = inner_order_for(order);
+  leaf_filters = (flags & 1) != 0 && LeafFilterHashable<K>::value;
+  key_pages = (flags & 2) != 0;
+  subtree_counts = (flags & 4) != 0;
+  build_sorted(pairs);
+}
+
+/**
+ * Replaces the tree with one built bottom up from pairs. Pairs are spread
+ * evenly over as few leaves as will hold them, so every leaf but the
+ * root is at least half full.
+ * @param pairs The key / value pairs, sorted by key with no duplicates.
+ */
+template <class K, class V>
+void BTree<K, V>::build_sorted(const vector<std::pair<K, V>>& pairs)
+{
+  clear();
+  if (pairs.empty()) {
+    return;
+  }
+
+  size_t per_leaf = order - 1;
+  size_t leaf_count = (pairs.size() + per_leaf - 1) / per_leaf;
+  vector<BTreeNode*> leaves;
+  leaves.reserve(leaf_count);
+  size_t begin = 0;
+  for (size_t i = 0; i < leaf_count; i++) {
+    size_t end = begin + (pairs.size() - begin) / (leaf_count - i);
+    BTreeNode* leaf = new BTreeNode(true, order);
+    for (size_t j = begin; j < end; j++) {
+      leaf->elements.push_back(DataPair(pairs[j].first, pairs[j].second));
+    }
+    if (!leaves.empty()) {
+      leaves.back()->next = leaf;
+    }
+    leaves.push_back(leaf);
+    begin = end;
+  }
+
+  root = build_levels(leaves);
+  rebuild_filters(root);
+  refresh_key_pages(root);
+}
+
+/**
+ * Forks tasks onto the shared pool and joins them.
+ * @param count The number of tasks.
+ * @param task Callable invoked as task(i).
+ */
+template <class K, class V>
+template <class F>
+void BTree<K, V>::run_parallel(size_t count, F task)
+{
+  ThreadPool::TaskGroup group(ThreadPool::shared());
+  for (size_t i = 1; i < count; i++) {
+    group.run([&task, i] { task(i); });
+  }
+  if (count > 0) {
+    task(0);
+  }
+  group.wait();
+}
+
+/**
+ * Splits items into runs of about count / threads items for the shared
+ * pool to hand out.
+ * @param count The number of items.
+ * @param threads The number of runs to split the items into.
+ * @param body Callable invoked as body(i).
+ */
+template <class K, class V>
+template <class F>
+void BTree<K, V>::parallel_for(size_t count, unsigned int threads, F body)
+{
+  size_t grain = (count + threads - 1) / std::max(threads, 1U);
+  ThreadPool::shared().parallel_for(0, count, grain, body);
+}
+
+template <class K, class V>
+unsigned int BTree<K, V>::thread_count(unsigned int threads)
+{
+  if (threads == 0) {
+    threads = ThreadPool::shared().size() + 1;
+  }
+  return threads;
+}
+
+/**
+ * Walks down a subtree a level at a time until a level is wide enough.
+ * The tree is balanced, so every node of a level is at the same depth.
+ * @param subroot A pointer to the root of the subtree.
+ * @param width The number of nodes wanted.
+ * @param depth Set to the depth of the level below subroot.
+ * @return The nodes of the level, in key order.
+ */
+template <class K, class V>
+vector<typename BTree<K, V>::BTreeNode*> BTree<K, V>::frontier(
+    BTreeNode* subroot, size_t width, size_t& depth)
+{
+  vector<BTreeNode*> level(1, subroot);
+  depth = 0;
+  while (level.size() < width && !level.front()->is_leaf) {
+    vector<BTreeNode*> below;
+    for (auto node : level) {
+      below.insert(below.end(), node->children.begin(), node->children.end());
+    }
+    level.swap(below);
+    depth++;
+  }
+  return level;
+}
+
+/**
+ * Builds the inner levels above a row of linked leaves. Each level spreads
+ * the nodes below it evenly over as few parents as will hold them; the
+ * separator in front of each node is carried up with it so that parents
+ * can take it over when the node ends up first in a later parent.
+ * @param level The leaves, in key order.
+ * @return The root of the tree.
+ */
+template <class K, class V>
+typename BTree<K, V>::BTreeNode* BTree<K, V>::build_levels(
+    vector<BTreeNode*> level)
+{
+  vector<K> separators;
+  separators.reserve(level.size());
+  separators.push_back(level.front()->elements.front().key);
+  for (size_t i = 1; i < level.size(); i++) {
+    separators.push_back(shortest_separator(level[i - 1]->elements.back().key,
+                                            level[i]->elements.front().key));
+  }
+
+  while (level.size() > 1) {
+    size_t parent_count = (level.size() + inner_order - 1) / inner_order;
+    vector<BTreeNode*> parents;
+    vector<K> parent_separators;
+    parents.reserve(parent_count);
+    parent_separators.reserve(parent_count);
+    size_t begin = 0;
+    for (size_t i = 0; i < parent_count; i++) {
+      size_t end = begin + (level.size() - begin) / (parent_count - i);
+      BTreeNode* parent = new BTreeNode(false, inner_order);
+      for (size_t j = begin; j < end; j++) {
+        if (j > begin) {
+          parent->keys.push_back(separators[j]);
+        }
+        parent->children.push_back(level[j]);
+        level[j]->parent = parent;
+        if (subtree_counts) {
+          parent->counts.push_back(subtree_size(level[j]));
+        }
+        if (aggregate_combine) {
+          parent->aggregates.push_back(summarize(level[j]));
+        }
+      }
+      parents.push_back(parent);
+      parent_separators.push_back(separators[begin]);
+      begin = end;
+    }
+    level.swap(parents);
+    separators.swap(parent_separators);
+  }
+  return level.front();
+}
+
+/**
+ * Measures the heap memory held by the BTree by walking every node.
+ * @return A breakdown of the memory in use.
+ */
+template <class K, class V>
+typename BTree<K, V>::MemoryUsage BTree<K, V>::memory_usage() const
+{
+  MemoryUsage usage;
+  if (root != nullptr) {
+    memory_usage(root, usage);
+  }
+  return usage;
+}
+
+template <class K, class V>
+const size_t BTree<K, V>::TreeStats::FILL_BUCKETS;
+
+/**
+ * Summarizes the shape of the BTree: height, nodes per level, fill factors
+ * of leaves and inner nodes, and the structural change counters.
+ * @return The statistics.
+ */
+template <class K, class V>
+typename BTree<K, V>::TreeStats BTree<K, V>::stats() const
+{
+  TreeStats ret;
+  ret.counters = counters;
+  if (root == nullptr) {
+    return ret;
+  }
+
+  size_t leaf_keys = 0;
+  size_t inner_keys = 0;
+  stats(root, 0, ret, leaf_keys, inner_keys);
+
+  ret.height = ret.nodes_per_level.size();
+  ret.entry_count = leaf_keys - tombstone_count;
+  ret.tombstone_count = tombstone_count;
+  if (ret.leaf_count > 0) {
+    ret.avg_leaf_keys = static_cast<double>(leaf_keys) / ret.leaf_count;
+    ret.avg_leaf_fill = ret.avg_leaf_keys / (order - 1);
+  }
+  if (ret.inner_count > 0) {
+    ret.avg_inner_keys = static_cast<double>(inner_keys) / ret.inner_count;
+    ret.avg_inner_fill = ret.avg_inner_keys / (inner_order - 1);
+  }
+  return ret;
+}
+
+/**
+ * Zeroes the structural change counters reported by stats().
+ */
+template <class K, class V>
+void BTree<K, V>::reset_counters()
+{
+  counters = StructureCounters();
+}
+
+/**
+ * Turns the per-leaf Bloom filters on or off.
+ * @param enabled Whether leaves should carry filters.
+ * @return false if filters were asked for but K has no std::hash.
+ */
+template <class K, class V>
+bool BTree<K, V>::set_leaf_filters(bool enabled)
+{
+  leaf_filters = enabled && LeafFilterHashable<K>::value;
+  if (root != nullptr) {
+    rebuild_filters(root);
+  }
+  return leaf_filters == enabled;
+}
+
+/**
+ * Turns per-node key pages on or off.
+ * @param enabled Whether nodes should carry key pages.
+ */
+template <class K, class V>
+void BTree<K, V>::set_key_pages(bool enabled)
+{
+  key_pages = enabled;
+  if (root != nullptr) {
+    refresh_key_pages(root);
+  }
+}
+
+/**
+ * Turns subtree counts on or off.
+ * @param enabled Whether inner nodes should carry subtree counts.
+ */
+template <class K, class V>
+void BTree<K, V>::set_subtree_counts(bool enabled)
+{
+  subtree_counts = enabled;
+  if (root != nullptr) {
+    rebuild_counts(root);
+  }
+}
+
+/**
+ * @return The number of pairs in the BTree.
+ */
+template <class K, class V>
+size_t BTree<K, V>::size() const
+{
+  if (root == nullptr) {
+    return 0;
+  }
+  if (subtree_counts) {
+    return subtree_size(root);
+  }
+  size_t ret = 0;
+  const BTreeNode* leaf = root;
+  while (!leaf->is_leaf) {
+    leaf = leaf->children.front();
+  }
+  for (; leaf != nullptr; leaf = leaf->next) {
+    ret += live_size(leaf);
+  }
+  return ret;
+}
+
+/**
+ * @param key A key, which need not be in the BTree.
+ * @return The number of keys in the BTree less than key.
+ */
+template <class K, class V>
+size_t BTree<K, V>::rank(const K& key) const
+{
+  return rank(key, false);
+}
+
+/**
+ * Finds a pair by its position in key order. Descends by subtree counts if
+ * they are on, otherwise walks the leaves.
+ * @param idx The number of smaller keys the pair has.
+ * @return The pair with the idx-th smallest key (counting from 0), or a
+ * default pair if idx >= size().
+ */
+template <class K, class V>
+std::pair<K, V> BTree<K, V>::select(size_t idx) const
+{
+  const BTreeNode* subroot = root;
+  if (subroot == nullptr) {
+    return std::pair<K, V>();
+  }
+  while (!subroot->is_leaf) {
+    size_t child = 0;
+    if (subtree_counts) {
+      while (child + 1 < subroot->children.size()
+             && idx >= subroot->counts[child]) {
+        idx -= subroot->counts[child];
+        child++;
+      }
+    }
+    subroot = subroot->children[child];
+  }
+  for (; subroot != nullptr; subroot = subroot->next) {
+    for (size_t i = 0; i < subroot->elements.size(); i++) {
+      if (is_tombstone(subroot, i)) {
+        continue;
+      }
+      if (idx == 0) {
+        const DataPair& found = subroot->elements[i];
+        return std::pair<K, V>(found.key, found.value);
+      }
+      idx--;
+    }
+  }
+  return std::pair<K, V>();
+}
+
+/**
+ * @param lo The smallest key to count.
+ * @param hi The largest key to count.
+ * @return The number of keys k in the BTree with lo <= k <= hi.
+ */
+template <class K, class V>
+size_t BTree<K, V>::count(const K& lo, const K& hi) const
+{
+  if (hi < lo) {
+    return 0;
+  }
+  return rank(hi, true) - rank(lo, false);
+}
+
+/**
+ * Sets the aggregate and computes it for every node.
+ * @param combine An associative function combining two aggregates.
+ * @param identity The aggregate of no values.
+ */
+template <class K, class V>
+void BTree<K, V>::set_aggregate(std::function<V(const V&, const V&)> combine,
+                                const V& identity)
+{
+  aggregate_combine = combine;
+  aggregate_identity = identity;
+  if (root != nullptr) {
+    rebuild_aggregates(root);
+  }
+}
+
+/**
+ * Drops the aggregate and the per node aggregates.
+ */
+template <class K, class V>
+void BTree<K, V>::clear_aggregate()
+{
+  aggregate_combine = nullptr;
+  aggregate_identity = V();
+  if (root != nullptr) {
+    rebuild_aggregates(root);
+  }
+}
+
+/**
+ * @param lo The smallest key to include.
+ * @param hi The largest key to include.
+ * @return The aggregate of the values of all keys k with lo <= k <= hi.
+ */
+template <class K, class V>
+V BTree<K, V>::aggregate(const K& lo, const K& hi) const
+{
+  if (!aggregate_combine) {
+    throw std::logic_error("BTree::aggregate: no aggregate is set");
+  }
+  if (root == nullptr || hi < lo) {
+    return aggregate_identity;
+  }
+  return aggregate(root, &lo, &hi);
+}
+
+/**
+ * Print Btree from root.
+ */
+template <class K, class V>
+void BTree<K, V>::print()
+{
+  if (root != nullptr)
+    print(root);
+}
+
+/**
+ * Private recursive version of the find function.
+ * @param subroot A reference of a pointer to the current BTreeNode.
+ * @param key The key we are looking up.
+ * @return The value (if found), the default V if not.
+ */
+template <class K, class V>
+V BTree<K, V>::find(const BTreeNode* subroot, const K& key) const
+{
+  if (!subroot->is_leaf) {
+    return find(subroot->children[child_index(subroot, key)], key);
+  }
+
+  if (!filter_may_contain(subroot, key)) {
+    return V();
+  }
+
+  size_t idx = node_search(subroot, key);
+  if (idx < subroot->elements.size()) {
+    const DataPair& found = subroot->elements[idx];
+    if (found.key == key && !is_tombstone(subroot, idx))
+    {
+      return found.value;
+    }
+  }
+  return V();
+}
+
+
+/**
+ * Finds the leaf for a key from a hint. Each step of the path bounds its
+ * node by the separators around the child taken from its parent, so a key
+ * within a step's bounds is under that step's node.
+ * @param hint The hint, updated to the path to key.
+ * @param key The key we are looking up.
+ * @return The leaf, or nullptr if the tree is empty.
+ */
+template <class K, class V>
+typename BTree<K, V>::BTreeNode* BTree<K, V>::seek(Hint& hint,
+                                                   const K& key) const
+{
+  if (hint.tree != this || hint.version != structure_version) {
+    hint.tree = this;
+    hint.version = structure_version;
+    hint.path.clear();
+  }
+  while (!hint.path.empty()) {
+    const typename Hint::Step& step = hint.path.back();
+    if ((step.lo == nullptr || !(key < *step.lo))
+        && (step.hi == nullptr || key < *step.hi)) {
+      break;
+    }
+    hint.path.pop_back();
+  }
+  if (hint.path.empty()) {
+    if (root == nullptr) {
+      return nullptr;
+    }
+    typename Hint::Step step = { root, nullptr, nullptr, 0 };
+    hint.path.push_back(step);
+  }
+
+  while (!hint.path.back().node->is_leaf) {
+    typename Hint::Step& parent = hint.path.back();
+    size_t idx = child_index(parent.node, key);
+    parent.child = idx;
+    typename Hint::Step step = {
+        parent.node->children[idx],
+        idx > 0 ? &parent.node->keys[idx - 1] : parent.lo,
+        idx < parent.node->keys.size() ? &parent.node->keys[idx] : parent.hi,
+        0 };
+    hint.path.push_back(step);
+  }
+  return hint.path.back().node;
+}
+
+/**
+ * Descends from the root to the leaf that holds, or would hold, a key.
+ * @param key The key we are looking up.
+ * @return The leaf, or nullptr if the tree is empty.
+ */
+template <class K, class V>
+typename BTree<K, V>::BTreeNode* BTree<K, V>::find_leaf(const K& key) const
+{
+  BTreeNode* subroot = root;
+  while (subroot != nullptr && !subroot->is_leaf) {
+    subroot = subroot->children[child_index(subroot, key)];
+  }
+  return subroot;
+}
+
+
+/**
+ * Inserts a key and value into the BTree. If the key is already in the
+ * tree do nothing.
+ * @param key The key to insert.
+ * @param value The value to insert.
+ */
+template <class K, class V>
+void BTree<K, V>::insert(const K& key, const V& value)
+{
+  /* 트리가 비어 있다면 root node를 생성한다.*/
+  if (root == nullptr) {
+      root = new BTreeNode(true, order);
+      root->parent = nullptr;
+      rebuild_filter(root);
+  }
+
+  /* Keys past the current maximum, as in sequential ingest, belong in the
+   * rightmost leaf. While it has room they are appended there directly,
+   * without searching any node on the way down. */
+  BTreeNode* last = root;
+  while (!last->is_leaf) {
+    last = last->children.back();
+  }
+  bool past_end = last->elements.empty() ? last == root
+                                         : last->elements.back().key < key;
+  if (past_end && last->elements.size() + 1 < order) {
+    append(last, DataPair(key, value));
+    return;
+  }
+
+  insert(root, DataPair(key, value), past_end);
+  
+  /* root의 elements의 크기가 order보다 크면 새로운 root를 만들고 높이를 증가시킨다. */
+  if (node_size(root) >= node_order(root)) {
+      BTreeNode* new_root = new BTreeNode(false, inner_order);
+      new_root->children.push_back(root);
+      if (subtree_counts) {
+        new_root->counts.push_back(subtree_size(root));
+      }
+      if (aggregate_combine) {
+        new_root->aggregates.push_back(summarize(root));
+      }
+      split_child(new_root, 0, past_end);
+      root = new_root;
+      counters.root_grows++;
+  }
+}
+
+
+/**
+ * Inserts a key and value, starting from a hint. Only an insert that fits
+ * in the hinted leaf is done in place; the hint's path then names the
+ * ancestors whose counts and aggregates change.
+ * @param hint The hint, updated to the path to key.
+ * @param key The key to insert.
+ * @param value The value to insert.
+ */
+template <class K, class V>
+void BTree<K, V>::insert(Hint& hint, const K& key, const V& value)
+{
+  BTreeNode* leaf = seek(hint, key);
+  if (leaf == nullptr || leaf->elements.size() + 1 >= order) {
+    insert(key, value);
+    return;
+  }
+
+  if (!leaf_insert(leaf, DataPair(key, value))) {
+    return;
+  }
+  for (size_t i = hint.path.size() - 1; i-- > 0;) {
+    const typename Hint::Step& step = hint.path[i];
+    if (subtree_counts) {
+      step.node->counts[step.child]++;
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(step.node, step.child);
+    }
+  }
+}
+
+/**
+ * Appends a pair past the end of the rightmost leaf, which must have room
+ * for it. The pair lands at the end of every subtree on the right spine,
+ * so their counts grow by one and their aggregates combine it in last.
+ * @param last The rightmost leaf.
+ * @param pair The pair, whose key is greater than every key in the tree.
+ */
+template <class K, class V>
+void BTree<K, V>::append(BTreeNode* last, const DataPair& pair)
+{
+  counters.appends++;
+  last->elements.push_back(pair);
+  if (!last->tombstones.empty()) {
+    last->tombstones.push_back(false);
+  }
+  filter_add(last, pair.key);
+  refresh_key_page(last);
+  if (!subtree_counts && !aggregate_combine) {
+    return;
+  }
+  for (BTreeNode* node = root; node != last; node = node->children.back()) {
+    if (subtree_counts) {
+      node->counts.back()++;
+    }
+    if (aggregate_combine) {
+      node->aggregates.back() = aggregate_combine(node->aggregates.back(),
+                                                  pair.value);
+    }
+  }
+}
+
+
+template <class K, class V>
+void BTree<K, V>::split_child(BTreeNode* parent, size_t child_idx,
+                              bool past_end /* = false */)
+{
+  /**
+    * A full leaf is cut in two and keeps all of its pairs. The parent gets
+    * the shortest key that separates the halves, which for strings is
+    * usually much shorter than the keys themselves:
+    *
+    *                  |carol|                    |b|carol|
+    *                 /       \                   /  |    \
+    * |abe|amy|bob|bud|       |...   =>   |abe|amy| |bob|bud| |...
+    *
+    * A full inner node moves its median separator up instead, since
+    * separators route but hold no data:
+    *
+    *      |m|                  |d|m|
+    *     /   \                /  |  \
+    * |b|d|g|  ...     =>   |b|  |g|  ...
+    *
+    * A split caused by a key past the end of the tree is a sign of
+    * ascending inserts, which never come back to the left half. Such a
+    * split leaves the left node (nearly) full and starts the right one
+    * with just the last pair, which the following inserts then fill up.
+    * Inner nodes keep one separator and two children on the right, since
+    * rebalancing relies on every inner node but the root having two children.
+    */
+  counters.splits++;
+  structure_version++;
+
+  BTreeNode* child = parent->children[child_idx];
+  BTreeNode* new_child = new BTreeNode(child->is_leaf, node_order(child));
+
+  if (child->is_leaf) {
+    size_t mid_elem_idx = past_end ? child->elements.size() - 1
+                                   : child->elements.size() / 2;
+    auto mid_elem_itr = child->elements.begin() + mid_elem_idx;
+
+    new_child->elements.assign(mid_elem_itr, child->elements.end());
+    child->elements.erase(mid_elem_itr, child->elements.end());
+    parent->keys.insert(parent->keys.begin() + child_idx,
+                        shortest_separator(child->elements.back().key,
+                                           new_child->elements.front().key));
+
+    new_child->next = child->next;
+    child->next = new_child;
+    rebuild_filter(child);
+    rebuild_filter(new_child);
+  } else {
+    size_t mid_elem_idx = past_end ? child->keys.size() - 2
+                                   : (child->keys.size() - 1) / 2;
+    auto mid_elem_itr = child->keys.begin() + mid_elem_idx;
+    auto mid_child_itr = child->children.begin() + mid_elem_idx + 1;
+
+    parent->keys.insert(parent->keys.begin() + child_idx, *mid_elem_itr);
+    new_child->keys.assign(mid_elem_itr + 1, child->keys.end());
+    new_child->children.assign(mid_child_itr, child->children.end());
+    child->keys.erase(mid_elem_itr, child->keys.end());
+    child->children.erase(mid_child_itr, child->children.end());
+    for (auto grand_child : new_child->children) {
+      grand_child->parent = new_child;
+    }
+    if (subtree_counts) {
+      new_child->counts.assign(child->counts.begin() + mid_elem_idx + 1,
+                               child->counts.end());
+      child->counts.erase(child->counts.begin() + mid_elem_idx + 1,
+                          child->counts.end());
+    }
+    if (aggregate_combine) {
+      new_child->aggregates.assign(
+          child->aggregates.begin() + mid_elem_idx + 1,
+          child->aggregates.end());
+      child->aggregates.erase(child->aggregates.begin() + mid_elem_idx + 1,
+                              child->aggregates.end());
+    }
+  }
+
+  parent->children.insert(parent->children.begin() + child_idx + 1, new_child);
+  if (subtree_counts) {
+    size_t moved = subtree_size(new_child);
+    parent->counts[child_idx] -= moved;
+    parent->counts.insert(parent->counts.begin() + child_idx + 1, moved);
+  }
+  if (aggregate_combine) {
+    parent->aggregates.insert(parent->aggregates.begin() + child_idx + 1,
+                              summarize(new_child));
+    refresh_aggregate(parent, child_idx);
+  }
+  child->parent = parent;
+  new_child->parent = parent;
+
+  refresh_key_page(parent);
+  refresh_key_page(child);
+  refresh_key_page(new_child);
+}
+
+
+/**
+ * Cuts an overfull child into evenly filled pieces: the child keeps the
+ * first and new siblings take the others.
+ * @param parent The parent whose child we are trying to split.
+ * @param child_idx The index of the child in its parent's children vector.
+ */
+template <class K, class V>
+void BTree<K, V>::split_child_many(BTreeNode* parent, size_t child_idx)
+{
+  BTreeNode* child = parent->children[child_idx];
+  size_t size = node_size(child);
+  size_t child_order = node_order(child);
+  /* Leaves hold up to order - 1 pairs each. Inner nodes also give up one
+   * separator per extra piece, so k pieces hold up to k * inner_order - 1. */
+  size_t pieces = child->is_leaf ? (size + child_order - 2) / (child_order - 1)
+                                 : (size + child_order) / child_order;
+  if (pieces < 2) {
+    return;
+  }
+  counters.splits += pieces - 1;
+  structure_version++;
+
+  size_t left = child->is_leaf ? size : size - (pieces - 1);
+  vector<size_t> lengths;
+  for (size_t i = 0; i < pieces; i++) {
+    lengths.push_back(left / (pieces - i));
+    left -= lengths.back();
+  }
+
+  vector<BTreeNode*> nodes(1, child);
+  vector<K> separators;
+  size_t begin = lengths.front();
+  for (size_t i = 1; i < pieces; i++) {
+    BTreeNode* node = new BTreeNode(child->is_leaf, child_order);
+    if (child->is_leaf) {
+      node->elements.assign(child->elements.begin() + begin,
+                            child->elements.begin() + begin + lengths[i]);
+    } else {
+      separators.push_back(child->keys[begin]);
+      begin++;
+      node->keys.assign(child->keys.begin() + begin,
+                        child->keys.begin() + begin + lengths[i]);
+      /* keys[j] lies between children[j] and children[j + 1], so the
+       * piece's children start at the same index as its keys. */
+      size_t child_begin = begin;
+      size_t child_end = begin + lengths[i] + 1;
+      node->children.assign(child->children.begin() + child_begin,
+                            child->children.begin() + child_end);
+      for (auto grand_child : node->children) {
+        grand_child->parent = node;
+      }
+      if (subtree_counts) {
+        node->counts.assign(child->counts.begin() + child_begin,
+                            child->counts.begin() + child_end);
+      }
+      if (aggregate_combine) {
+        node->aggregates.assign(child->aggregates.begin() + child_begin,
+                                child->aggregates.begin() + child_end);
+      }
+    }
+    node->parent = parent;
+    nodes.push_back(node);
+    begin += lengths[i];
+  }
+
+  /* The child keeps the first piece, in buffers of the usual capacity. */
+  size_t first_length = lengths.front();
+  if (child->is_leaf) {
+    vector<DataPair> elements;
+    elements.reserve(child_order + 1);
+    elements.assign(child->elements.begin(),
+                    child->elements.begin() + first_length);
+    child->elements.swap(elements);
+  } else {
+    vector<K> keys;
+    keys.reserve(child_order + 1);
+    keys.assign(child->keys.begin(), child->keys.begin() + first_length);
+    child->keys.swap(keys);
+    vector<BTreeNode*> children;
+    children.reserve(child_order + 2);
+    children.assign(child->children.begin(),
+                    child->children.begin() + first_length + 1);
+    child->children.swap(children);
+    if (subtree_counts) {
+      child->counts.erase(child->counts.begin() + first_length + 1,
+                          child->counts.end());
+    }
+    if (aggregate_combine) {
+      child->aggregates.erase(child->aggregates.begin() + first_length + 1,
+                              child->aggregates.end());
+    }
+  }
+
+  if (child->is_leaf) {
+    for (size_t i = 1; i < nodes.size(); i++) {
+      separators.push_back(
+          shortest_separator(nodes[i - 1]->elements.back().key,
+                             nodes[i]->elements.front().key));
+      nodes[i]->next = nodes[i - 1]->next;
+      nodes[i - 1]->next = nodes[i];
+    }
+    for (auto node : nodes) {
+      rebuild_filter(node);
+    }
+  }
+
+  parent->keys.insert(parent->keys.begin() + child_idx, separators.begin(),
+                      separators.end());
+  parent->children.insert(parent->children.begin() + child_idx + 1,
+                          nodes.begin() + 1, nodes.end());
+  if (subtree_counts) {
+    vector<size_t> counts;
+    for (auto node : nodes) {
+      counts.push_back(subtree_size(node));
+    }
+    parent->counts[child_idx] = counts.front();
+    parent->counts.insert(parent->counts.begin() + child_idx + 1,
+                          counts.begin() + 1, counts.end());
+  }
+  if (aggregate_combine) {
+    vector<V> aggregates;
+    for (auto node : nodes) {
+      aggregates.push_back(summarize(node));
+    }
+    parent->aggregates[child_idx] = aggregates.front();
+    parent->aggregates.insert(parent->aggregates.begin() + child_idx + 1,
+                              aggregates.begin() + 1, aggregates.end());
+  }
+  child->parent = parent;
+
+  refresh_key_page(parent);
+  for (auto node : nodes) {
+    refresh_key_page(node);
+  }
+}
+
+
+/**
+ * Merges a sorted run of pairs into a subtree. A leaf inserts a short run
+ * in place and merges a longer one with its own pairs in one pass. An inner
+ * node hands each child the part of the run up to the separator after it,
+ * left to right; each part's child is looked up afresh, since the pieces an
+ * earlier child split into shift the children after it.
+ * @param subroot A pointer to the current BTreeNode.
+ * @param first The first pair of the run.
+ * @param last One past the last pair of the run.
+ * @return The number of pairs inserted.
+ */
+template <class K, class V>
+size_t BTree<K, V>::insert_batch(BTreeNode* subroot,
+                                 typename vector<DataPair>::iterator first,
+                                 typename vector<DataPair>::iterator last)
+{
+  size_t inserted = 0;
+  if (subroot->is_leaf) {
+    purge_leaf(subroot);
+    auto& elements = subroot->elements;
+    if (last - first <= 8) {
+      size_t idx = 0;
+      for (; first != last; ++first) {
+        idx = std::lower_bound(elements.begin() + idx, elements.end(),
+                               first->key) - elements.begin();
+        if (idx == elements.size() || first->key < elements[idx].key) {
+          elements.insert(elements.begin() + idx, *first);
+          filter_add(subroot, first->key);
+          inserted++;
+        }
+      }
+    } else {
+      vector<DataPair> merged;
+      merged.reserve(elements.size() + (last - first));
+      auto elem = elements.begin();
+      while (first != last) {
+        if (elem == elements.end() || first->key < elem->key) {
+          merged.push_back(*first);
+          inserted++;
+          ++first;
+        } else {
+          if (!(elem->key < first->key)) {
+            ++first;
+          }
+          merged.push_back(*elem);
+          ++elem;
+        }
+      }
+      merged.insert(merged.end(), elem, elements.end());
+      if (merged.size() < order) {
+        elements.assign(merged.begin(), merged.end());
+      } else {
+        elements.swap(merged);
+      }
+      rebuild_filter(subroot);
+    }
+    refresh_key_page(subroot);
+    return inserted;
+  }
+
+  while (first != last) {
+    size_t idx = child_index(subroot, first->key);
+    auto end = idx < subroot->keys.size()
+                   ? std::lower_bound(first, last, subroot->keys[idx])
+                   : last;
+    size_t added = insert_batch(subroot->children[idx], first, end);
+    if (subtree_counts) {
+      subroot->counts[idx] += added;
+    }
+    if (added > 0 && aggregate_combine) {
+      refresh_aggregate(subroot, idx);
+    }
+    if (node_size(subroot->children[idx])
+        >= node_order(subroot->children[idx])) {
+      split_child_many(subroot, idx);
+    }
+    inserted += added;
+    first = end;
+  }
+  return inserted;
+}
+
+
+/**
+ * Private recursive version of the insert function.
+ * @param subroot A reference of a pointer to the current BTreeNode.
+ * @param pair The DataPair to be inserted.
+ * @return true if the pair was inserted, false if its key was present.
+ * Note: Original solution used std::lower_bound, but making the students
+ * write an equivalent seemed more instructive.
+ */
+template <class K, class V>
+bool BTree<K, V>::insert(BTreeNode* subroot, const DataPair& pair,
+                         bool past_end /* = false */)
+{
+  if (subroot->is_leaf) {
+    return leaf_insert(subroot, pair);
+  } 
+  else {
+    size_t child_idx = child_index(subroot, pair.key);
+    BTreeNode* child = subroot->children[child_idx];
+    bool inserted = insert(child, pair, past_end);
+    if (inserted && subtree_counts) {
+      subroot->counts[child_idx]++;
+    }
+    if (inserted && aggregate_combine) {
+      refresh_aggregate(subroot, child_idx);
+    }
+    if(node_size(child) >= node_order(child)) split_child(subroot, child_idx, past_end);
+    return inserted;
+  }
+}
+
+
+/**
+ * Private recursive version of the remove function. Every child it descends
+ * into is left with at least min_size() elements or separators; fixing up
+ * the node itself is the caller's job.
+ * @param subroot A pointer to the current BTreeNode.
+ * @param key The key to remove.
+ * @return true if the key was found and removed.
+ */
+template <class K, class V>
+bool BTree<K, V>::remove(BTreeNode* subroot, const K& key)
+{
+  if (subroot->is_leaf) {
+    purge_leaf(subroot);
+    size_t idx = node_search(subroot, key);
+    if (idx < subroot->elements.size() && subroot->elements[idx] == key) {
+      subroot->elements.erase(subroot->elements.begin() + idx);
+      refresh_key_page(subroot);
+      return true;
+    }
+    return false;
+  }
+
+  /* Separators equal to a removed key may stay: they still route. */
+  size_t idx = child_index(subroot, key);
+  bool removed = remove(subroot->children[idx], key);
+  if (removed && subtree_counts) {
+    subroot->counts[idx]--;
+  }
+  if (removed && aggregate_combine) {
+    refresh_aggregate(subroot, idx);
+  }
+
+  if (node_size(subroot->children[idx]) < min_size(subroot->children[idx])) {
+    rebalance_child(subroot, idx);
+  }
+  return removed;
+}
+
+
+/**
+ * Private recursive version of the erase_range function. The children
+ * strictly between the ones holding lo and hi are freed whole, along with
+ * all but one of the separators around them.
+ * @param subroot A pointer to the current node.
+ * @param lo The smallest key to remove, or nullptr for no bound.
+ * @param hi The largest key to remove, or nullptr for no bound.
+ * @return The number of pairs removed.
+ */
+template <class K, class V>
+size_t BTree<K, V>::erase_range(BTreeNode* subroot, const K* lo, const K* hi)
+{
+  if (subroot->is_leaf) {
+    purge_leaf(subroot);
+    auto& elements = subroot->elements;
+    size_t begin = lo == nullptr ? 0 : node_search(subroot, *lo);
+    size_t end = elements.size();
+    if (hi != nullptr) {
+      end = node_search(subroot, *hi);
+      if (end < elements.size() && elements[end] == *hi) {
+        end++;
+      }
+    }
+    if (begin >= end) {
+      return 0;
+    }
+    elements.erase(elements.begin() + begin, elements.begin() + end);
+    refresh_key_page(subroot);
+    return end - begin;
+  }
+
+  size_t first = lo == nullptr ? 0 : child_index(subroot, *lo);
+  size_t last = hi == nullptr ? subroot->children.size() - 1
+                              : child_index(subroot, *hi);
+  if (first == last) {
+    size_t erased = erase_range(subroot->children[first], lo, hi);
+    if (subtree_counts) {
+      subroot->counts[first] -= erased;
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(subroot, first);
+    }
+    return erased;
+  }
+
+  /* Children past an open bound lie wholly inside the range, like the ones
+   * between the two bounds, and are freed with them. */
+  size_t erased = 0;
+  if (lo != nullptr) {
+    erased += erase_range(subroot->children[first], lo, nullptr);
+  }
+  if (hi != nullptr) {
+    erased += erase_range(subroot->children[last], nullptr, hi);
+  }
+  size_t doomed_begin = lo == nullptr ? 0 : first + 1;
+  size_t doomed_end = hi == nullptr ? subroot->children.size() : last;
+  for (size_t i = doomed_begin; i < doomed_end; i++) {
+    erased += erase_subtree(subroot->children[i]);
+  }
+
+  /* Between two kept children the separator in front of the right one
+   * still divides them; otherwise the separators of the freed children
+   * go with them. */
+  size_t sep_begin = lo == nullptr ? 0 : first;
+  size_t sep_end = hi == nullptr ? subroot->keys.size()
+                   : lo == nullptr ? last : last - 1;
+  subroot->keys.erase(subroot->keys.begin() + sep_begin,
+                      subroot->keys.begin() + sep_end);
+  subroot->children.erase(subroot->children.begin() + doomed_begin,
+                          subroot->children.begin() + doomed_end);
+  if (subtree_counts) {
+    subroot->counts.erase(subroot->counts.begin() + doomed_begin,
+                          subroot->counts.begin() + doomed_end);
+  }
+  if (aggregate_combine) {
+    subroot->aggregates.erase(subroot->aggregates.begin() + doomed_begin,
+                              subroot->aggregates.begin() + doomed_end);
+  }
+  refresh_key_page(subroot);
+
+  /* What is left of the boundary children now sits at the front (open lo),
+   * at first, or at first and first + 1. */
+  size_t kept_begin = lo == nullptr ? 0 : first;
+  size_t kept_count = (lo != nullptr) + (hi != nullptr);
+  for (size_t i = kept_begin; i < kept_begin + kept_count; i++) {
+    if (subtree_counts) {
+      subroot->counts[i] = subtree_size(subroot->children[i]);
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(subroot, i);
+    }
+  }
+  return erased;
+}
+
+/**
+ * Frees a subtree, counting its pairs on the way.
+ * @param subroot A pointer to the root of the subtree.
+ * @return The number of pairs it held.
+ */
+template <class K, class V>
+size_t BTree<K, V>::erase_subtree(BTreeNode* subroot)
+{
+  size_t erased = 0;
+  if (subroot->is_leaf) {
+    erased = live_size(subroot);
+    tombstone_count -= subroot->elements.size() - erased;
+  } else {
+    for (auto child : subroot->children) {
+      erased += erase_subtree(child);
+    }
+  }
+  delete subroot;
+  return erased;
+}
+
+/**
+ * Fixes the children on the path to a key top down. A merge takes an
+ * element from the parent, so a node fixed earlier can end up one short;
+ * callers repeat until nothing changes.
+ * @param key The key whose path to fix.
+ * @return true if anything was borrowed or merged.
+ */
+template <class K, class V>
+bool BTree<K, V>::rebalance_path(const K& key)
+{
+  bool changed = false;
+  BTreeNode* node = root;
+  while (!node->is_leaf) {
+    size_t idx = child_index(node, key);
+    while (node->children.size() > 1
+           && node_size(node->children[idx])
+                  < min_size(node->children[idx])) {
+      rebalance_child(node, idx);
+      changed = true;
+      idx = child_index(node, key);
+    }
+    node = node->children[idx];
+  }
+  return changed;
+}
+
+/**
+ * Brings another tree's filters, key pages, counts and aggregates in line
+ * with this tree's settings, rebuilding only what differs.
+ * @param other The BTree whose nodes to bring in line.
+ */
+template <class K, class V>
+void BTree<K, V>::match_settings(BTree& other) const
+{
+  if (other.leaf_filters != leaf_filters) {
+    other.set_leaf_filters(leaf_filters);
+  }
+  if (other.key_pages != key_pages) {
+    other.set_key_pages(key_pages);
+  }
+  if (other.subtree_counts != subtree_counts) {
+    other.set_subtree_counts(subtree_counts);
+  }
+  if (aggregate_combine && !other.aggregate_combine) {
+    other.set_aggregate(aggregate_combine, aggregate_identity);
+  } else if (!aggregate_combine && other.aggregate_combine) {
+    other.clear_aggregate();
+  }
+}
+
+/**
+ * Joins two disjoint trees and makes the result this tree's root. The new
+ * child can be too small for a non-root node, so it borrows from or merges
+ * with its sibling; its new parent can be one too large, so it is split,
+ * and its ancestors in turn.
+ * @param left The root of the tree holding the smaller keys.
+ * @param right The root of the tree holding the larger keys.
+ * @param separator A key between the two trees' keys.
+ * @return The root of the joined tree.
+ */
+template <class K, class V>
+typename BTree<K, V>::BTreeNode* BTree<K, V>::join(BTreeNode* left,
+                                                   BTreeNode* right,
+                                                   const K& separator)
+{
+  size_t left_height = 0;
+  size_t right_height = 0;
+  BTreeNode* left_last = left;
+  BTreeNode* right_first = right;
+  while (!left_last->is_leaf) {
+    left_last = left_last->children.back();
+    left_height++;
+  }
+  while (!right_first->is_leaf) {
+    right_first = right_first->children.front();
+    right_height++;
+  }
+  left_last->next = right_first;
+
+  if (left_height == right_height) {
+    BTreeNode* new_root = new BTreeNode(false, inner_order);
+    new_root->keys.push_back(separator);
+    new_root->children.push_back(left);
+    new_root->children.push_back(right);
+    for (auto child : new_root->children) {
+      child->parent = new_root;
+      if (subtree_counts) {
+        new_root->counts.push_back(subtree_size(child));
+      }
+      if (aggregate_combine) {
+        new_root->aggregates.push_back(summarize(child));
+      }
+    }
+    refresh_key_page(new_root);
+    counters.root_grows++;
+    root = new_root;
+    rebalance_children(new_root);
+    shrink_root();
+    return root;
+  }
+
+  /* Walk the taller tree's facing spine down to one level above the
+   * shorter tree's root. */
+  bool left_taller = left_height > right_height;
+  BTreeNode* taller = left_taller ? left : right;
+  BTreeNode* shorter = left_taller ? right : left;
+  size_t steps = left_taller ? left_height - right_height - 1
+                             : right_height - left_height - 1;
+  BTreeNode* parent = taller;
+  for (size_t i = 0; i < steps; i++) {
+    parent = left_taller ? parent->children.back()
+                         : parent->children.front();
+  }
+
+  size_t idx = left_taller ? parent->children.size() : 0;
+  size_t sep_idx = left_taller ? parent->keys.size() : 0;
+  parent->keys.insert(parent->keys.begin() + sep_idx, separator);
+  parent->children.insert(parent->children.begin() + idx, shorter);
+  shorter->parent = parent;
+  if (subtree_counts) {
+    parent->counts.insert(parent->counts.begin() + idx,
+                          subtree_size(shorter));
+  }
+  if (aggregate_combine) {
+    parent->aggregates.insert(parent->aggregates.begin() + idx,
+                              summarize(shorter));
+  }
+  refresh_key_page(parent);
+
+  /* The ancestors' counts and aggregates for the spine child grow by the
+   * shorter tree. */
+  for (BTreeNode* node = parent; node->parent != nullptr;
+       node = node->parent) {
+    BTreeNode* above = node->parent;
+    size_t spine = left_taller ? above->children.size() - 1 : 0;
+    if (subtree_counts) {
+      above->counts[spine] = subtree_size(node);
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(above, spine);
+    }
+  }
+
+  root = taller;
+  rebalance_children(parent);
+  split_upward(parent);
+  return root;
+}
+
+/**
+ * Splits over full nodes from a node up to the root.
+ * @param node The node to start at.
+ */
+template <class K, class V>
+void BTree<K, V>::split_upward(BTreeNode* node)
+{
+  while (node_size(node) >= node_order(node)) {
+    BTreeNode* parent = node->parent;
+    if (parent == nullptr) {
+      parent = new BTreeNode(false, inner_order);
+      parent->children.push_back(node);
+      if (subtree_counts) {
+        parent->counts.push_back(subtree_size(node));
+      }
+      if (aggregate_combine) {
+        parent->aggregates.push_back(summarize(node));
+      }
+      node->parent = parent;
+      root = parent;
+      counters.root_grows++;
+    }
+    size_t idx = std::find(parent->children.begin(), parent->children.end(),
+                           node)
+                 - parent->children.begin();
+    split_child(parent, idx);
+    node = parent;
+  }
+}
+
+/**
+ * Fixes the path to a key after it was cut or had a tree hung off it.
+ * @param key The key whose path to fix.
+ */
+template <class K, class V>
+void BTree<K, V>::rebalance_spine(const K& key)
+{
+  bool changed = true;
+  while (changed) {
+    shrink_root();
+    if (root == nullptr) {
+      break;
+    }
+    changed = rebalance_path(key);
+  }
+}
+
+/**
+ * An empty root either means the tree is empty or that its last two
+ * children were merged, in which case the tree loses a level.
+ */
+template <class K, class V>
+void BTree<K, V>::shrink_root()
+{
+  while (root != nullptr && node_size(root) == 0) {
+    structure_version++;
+    BTreeNode* old_root = root;
+    root = root->is_leaf ? nullptr : root->children.front();
+    if (root != nullptr) {
+      root->parent = nullptr;
+      counters.root_shrinks++;
+    }
+    delete old_root;
+  }
+}
+
+/** The most nodes, roughly, one remove() visits to reclaim tombstones. */
+const size_t PURGE_SLICE_NODES = 16;
+
+/**
+ * Marks a key's pair dead without moving anything, and takes it out of the
+ * subtree counts and aggregates on its path. Past the purge threshold it
+ * also runs a compact() slice that only repacks groups too sparse for the
+ * minimum fill, so the cost of reclaiming tombstones is spread over many
+ * removes.
+ * @param key The key to remove.
+ * @return true if key was present and live.
+ */
+template <class K, class V>
+bool BTree<K, V>::remove_lazily(const K& key)
+{
+  BTreeNode* leaf = root;
+  vector<std::pair<BTreeNode*, size_t>> path;
+  while (!leaf->is_leaf) {
+    size_t child = child_index(leaf, key);
+    if (subtree_counts || aggregate_combine) {
+      path.push_back(std::make_pair(leaf, child));
+    }
+    leaf = leaf->children[child];
+  }
+  size_t idx = node_search(leaf, key);
+  if (idx == leaf->elements.size() || !(leaf->elements[idx] == key)
+      || is_tombstone(leaf, idx)) {
+    return false;
+  }
+  if (leaf->tombstones.empty()) {
+    leaf->tombstones.resize(leaf->elements.size());
+  }
+  leaf->tombstones[idx] = true;
+  tombstone_count++;
+  for (auto step = path.rbegin(); step != path.rend(); ++step) {
+    if (subtree_counts) {
+      step->first->counts[step->second]--;
+    }
+    if (aggregate_combine) {
+      refresh_aggregate(step->first, step->second);
+    }
+  }
+  if (purge_ratio > 0 && tombstone_count > purge_threshold
+      && compact(0.0, PURGE_SLICE_NODES)) {
+    purge_threshold = static_cast<size_t>(purge_ratio * size());
+  }
+  return true;
+}
+
+/**
+ * An inner node of inner order i holds up to i - 1 keys and i child
+ * pointers; i is the largest order for which they fit where order - 1
+ * DataPairs and order child pointers do.
+ */
+template <class K, class V>
+unsigned int BTree<K, V>::inner_order_for(unsigned int order)
+{
+  size_t bytes = (order - 1) * sizeof(DataPair) + order * sizeof(BTreeNode*);
+  size_t fits = (bytes + sizeof(K)) / (sizeof(K) + sizeof(BTreeNode*));
+  return static_cast<unsigned int>(std::max<size_t>(fits, order));
+}
+
+template <class K, class V>
+size_t BTree<K, V>::node_size(const BTreeNode* node)
+{
+  return node->is_leaf ? node->elements.size() : node->keys.size();
+}
+
+template <class K, class V>
+size_t BTree<K, V>::node_order(const BTreeNode* node) const
+{
+  return node->is_leaf ? order : inner_order;
+}
+
+template <class K, class V>
+size_t BTree<K, V>::min_size(const BTreeNode* node) const
+{
+  return (node_order(node) - 1) / 2;
+}
+
+template <class K, class V>
+bool BTree<K, V>::is_tombstone(const BTreeNode* leaf, size_t idx) const
+{
+  return !leaf->tombstones.empty() && leaf->tombstones[idx];
+}
+
+template <class K, class V>
+size_t BTree<K, V>::live_size(const BTreeNode* leaf) const
+{
+  return leaf->elements.size()
+         - std::count(leaf->tombstones.begin(), leaf->tombstones.end(), true);
+}
+
+/**
+ * Erases a leaf's tombstones and drops its tombstone bits.
+ * @param leaf A leaf.
+ */
+template <class K, class V>
+void BTree<K, V>::purge_leaf(BTreeNode* leaf)
+{
+  if (leaf->tombstones.empty()) {
+    return;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < leaf->elements.size(); i++) {
+    if (!leaf->tombstones[i]) {
+      leaf->elements[kept++] = leaf->elements[i];
+    }
+  }
+  tombstone_count -= leaf->elements.size() - kept;
+  leaf->elements.erase(leaf->elements.begin() + kept, leaf->elements.end());
+  vector<bool>().swap(leaf->tombstones);
+  refresh_key_page(leaf);
+}
+
+/**
+ * Inserts a pair into a leaf, reviving its tombstone if it has one.
+ * @param leaf A leaf.
+ * @param pair The pair to insert.
+ * @return true if the key was not live before.
+ */
+template <class K, class V>
+bool BTree<K, V>::leaf_insert(BTreeNode* leaf, const DataPair& pair)
+{
+  size_t idx = node_search(leaf, pair.key);
+  //이미 데이터가 존재한다면 insert 안함
+  if (idx < leaf->elements.size() && leaf->elements[idx] == pair) {
+    if (!is_tombstone(leaf, idx)) {
+      return false;
+    }
+    leaf->elements[idx].value = pair.value;
+    leaf->tombstones[idx] = false;
+    tombstone_count--;
+    return true;
+  }
+  if (leaf->elements.size() + 1 >= order && !leaf->tombstones.empty()) {
+    purge_leaf(leaf);
+    idx = node_search(leaf, pair.key);
+  }
+  leaf->elements.insert(leaf->elements.begin() + idx, pair);
+  if (!leaf->tombstones.empty()) {
+    leaf->tombstones.insert(leaf->tombstones.begin() + idx, false);
+  }
+  filter_add(leaf, pair.key);
+  refresh_key_page(leaf);
+  return true;
+}
+
+/**
+ * Purges the leaves under a node, then fixes up its children.
+ * @param subroot A pointer to the current node.
+ */
+template <class K, class V>
+void BTree<K, V>::purge(BTreeNode* subroot)
+{
+  if (subroot->is_leaf) {
+    purge_leaf(subroot);
+    return;
+  }
+  for (auto child : subroot->children) {
+    purge(child);
+  }
+  rebalance_children(subroot);
+}
+
+/**
+ * Fixes a node's children left to right; each fix either grows an
+ * underfull child by one or merges it away, so a child far below the
+ * minimum is revisited until it is done. A child left with a single,
+ * underfull child of its own could not fix it; once it has been merged
+ * or has borrowed it has siblings for that child, so the nodes a fix
+ * touched are fixed in turn.
+ * @param parent A pointer to an inner node.
+ */
+template <class K, class V>
+void BTree<K, V>::rebalance_children(BTreeNode* parent)
+{
+  size_t i = 0;
+  while (i < parent->children.size()) {
+    if (parent->children.size() > 1
+        && node_size(parent->children[i]) < min_size(parent->children[i])) {
+      rebalance_child(parent, i);
+      if (i > 0) {
+        i--;
+      }
+      if (!parent->children[i]->is_leaf) {
+        size_t end = std::min(i + 2, parent->children.size());
+        for (size_t j = i; j < end; j++) {
+          rebalance_children(parent->children[j]);
+        }
+      }
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+ * Repacks a node's children. Leaves pool their pairs; inner nodes pool
+ * their children, with parent's separators between them. The pool is
+ * then cut into evenly sized pieces, each between the minimum fill and
+ * the target.
+ * @param parent The node whose children to repack.
+ * @param prev The leaf before parent's first child, for leaves.
+ * @param fill The fraction of the children's order - 1 to fill the new
+ * nodes to.
+ * @return true if the children were replaced.
+ */
+template <class K, class V>
+bool BTree<K, V>::repack_children(BTreeNode* parent, BTreeNode* prev,
+                                  double fill)
+{
+  vector<BTreeNode*>& old_children = parent->children;
+  bool leaves = old_children.front()->is_leaf;
+  size_t child_order = node_order(old_children.front());
+  size_t least_size = min_size(old_children.front());
+  size_t target = static_cast<size_t>(fill * (child_order - 1));
+  target = std::min<size_t>(std::max(target, std::max<size_t>(least_size, 1)),
+                            child_order - 1);
+
+  vector<DataPair> elements;
+  vector<K> keys;
+  vector<BTreeNode*> grand_children;
+  vector<size_t> counts;
+  vector<V> aggregates;
+  for (size_t i = 0; i < old_children.size(); i++) {
+    BTreeNode* child = old_children[i];
+    if (leaves) {
+      purge_leaf(child);
+    } else if (i > 0) {
+      keys.push_back(parent->keys[i - 1]);
+    }
+    elements.insert(elements.end(), child->elements.begin(),
+                    child->elements.end());
+    keys.insert(keys.end(), child->keys.begin(), child->keys.end());
+    grand_children.insert(grand_children.end(), child->children.begin(),
+                          child->children.end());
+    counts.insert(counts.end(), child->counts.begin(), child->counts.end());
+    aggregates.insert(aggregates.end(), child->aggregates.begin(),
+                      child->aggregates.end());
+  }
+
+  /* Leaves are sized in pairs, inner nodes in children. */
+  size_t units = leaves ? elements.size() : grand_children.size();
+  size_t most = leaves ? target : target + 1;
+  size_t least = leaves ? least_size : least_size + 1;
+  size_t pieces = std::min((units + most - 1) / most, units / least);
+  pieces = std::max<size_t>(pieces, 1);
+  if (pieces >= old_children.size()) {
+    return false;
+  }
+  structure_version++;
+  counters.merges += old_children.size() - pieces;
+
+  BTreeNode* next = old_children.back()->next;
+  vector<BTreeNode*> nodes;
+  vector<K> separators;
+  size_t left = units;
+  size_t begin = 0;
+  for (size_t i = 0; i < pieces; i++) {
+    size_t length = left / (pieces - i);
+    left -= length;
+    BTreeNode* node = new BTreeNode(leaves, child_order);
+    node->parent = parent;
+    if (leaves) {
+      node->elements.assign(elements.begin() + begin,
+                            elements.begin() + begin + length);
+      if (!nodes.empty()) {
+        separators.push_back(
+            shortest_separator(nodes.back()->elements.back().key,
+                               node->elements.front().key));
+        nodes.back()->next = node;
+      }
+      rebuild_filter(node);
+    } else {
+      /* keys[j] lies between grand_children[j] and [j + 1]; the one after
+       * a piece's last child moves up into parent. */
+      node->keys.assign(keys.begin() + begin,
+                        keys.begin() + begin + length - 1);
+      if (i + 1 < pieces) {
+        separators.push_back(keys[begin + length - 1]);
+      }
+      node->children.assign(grand_children.begin() + begin,
+                            grand_children.begin() + begin + length);
+      for (auto grand_child : node->children) {
+        grand_child->parent = node;
+      }
+      if (subtree_counts) {
+        node->counts.assign(counts.begin() + begin,
+                            counts.begin() + begin + length);
+      }
+      if (aggregate_combine) {
+        node->aggregates.assign(aggregates.begin() + begin,
+                                aggregates.begin() + begin + length);
+      }
+    }
+    refresh_key_page(node);
+    nodes.push_back(node);
+    begin += length;
+  }
+  if (leaves) {
+    nodes.back()->next = next;
+    if (prev != nullptr) {
+      prev->next = nodes.front();
+    }
+  }
+
+  for (auto child : old_children) {
+    delete child;
+  }
+  old_children.assign(nodes.begin(), nodes.end());
+  parent->keys.assign(separators.begin(), separators.end());
+  if (subtree_counts) {
+    parent->counts.clear();
+    for (auto node : nodes) {
+      parent->counts.push_back(subtree_size(node));
+    }
+  }
+  if (aggregate_combine) {
+    parent->aggregates.clear();
+    for (auto node : nodes) {
+      parent->aggregates.push_back(summarize(node));
+    }
+  }
+  refresh_key_page(parent);
+  return true;
+}
+
+/**
+ * Restores the minimum size of parent->children[idx] after a removal,
+ * either by borrowing an element through the parent from a sibling that
+ * can spare one, or by merging with a sibling.
+ * @param parent The parent of the underfull child.
+ * @param idx The index of the underfull child in parent->children.
+ */
+template <class K, class V>
+void BTree<K, V>::rebalance_child(BTreeNode* parent, size_t idx)
+{
+  size_t least = min_size(parent->children[idx]);
+  if (parent->children[idx]->is_leaf) {
+    for (size_t i = idx > 0 ? idx - 1 : idx;
+         i <= idx + 1 && i < parent->children.size(); i++) {
+      purge_leaf(parent->children[i]);
+    }
+  }
+
+  if (idx > 0 && node_size(parent->children[idx - 1]) > least) {
+    borrow_from_left(parent, idx);
+  } else if (idx + 1 < parent->children.size()
+             && node_size(parent->children[idx + 1]) > least) {
+    borrow_from_right(parent, idx);
+  } else if (idx > 0) {
+    merge_children(parent, idx - 1);
+  } else {
+    merge_children(parent, idx);
+  }
+}
+
+
+/**
+ * Moves the last element of children[idx - 1] to the front of
+ * children[idx]. Between leaves the pair moves directly and the separator
+ * in parent is recomputed; between inner nodes the last separator of the
+ * sibling rotates up into parent and parent's separator down into the child.
+ * <pre>
+ *       |8|              |5|
+ *      /   \     =>     /   \
+ * |3|5|     |9|      |3|     |5|9|   (leaves)
+ * </pre>
+ * @param parent The parent of both children.
+ * @param idx The index of the child receiving the element.
+ */
+template <class K, class V>
+void BTree<K, V>::borrow_from_left(BTreeNode* parent, size_t idx)
+{
+  counters.borrows++;
+  structure_version++;
+
+  BTreeNode* child = parent->children[idx];
+  BTreeNode* left_sibling = parent->children[idx - 1];
+
+  if (child->is_leaf) {
+    child->elements.insert(child->elements.begin(),
+                           left_sibling->elements.back());
+    left_sibling->elements.pop_back();
+    parent->keys[idx - 1] = shortest_separator(
+        left_sibling->elements.back().key, child->elements.front().key);
+    filter_add(child, child->elements.front().key);
+    if (subtree_counts) {
+      parent->counts[idx - 1]--;
+      parent->counts[idx]++;
+    }
+  } else {
+    child->keys.insert(child->keys.begin(), parent->keys[idx - 1]);
+    parent->keys[idx - 1] = left_sibling->keys.back();
+    left_sibling->keys.pop_back();
+
+    BTreeNode* moved = left_sibling->children.back();
+    left_sibling->children.pop_back();
+    child->children.insert(child->children.begin(), moved);
+    moved->parent = child;
+    if (subtree_counts) {
+      size_t moved_count = left_sibling->counts.back();
+      left_sibling->counts.pop_back();
+      child->counts.insert(child->counts.begin(), moved_count);
+      parent->counts[idx - 1] -= moved_count;
+      parent->counts[idx] += moved_count;
+    }
+    if (aggregate_combine) {
+      child->aggregates.insert(child->aggregates.begin(),
+                               left_sibling->aggregates.back());
+      left_sibling->aggregates.pop_back();
+    }
+  }
+  if (aggregate_combine) {
+    refresh_aggregate(parent, idx - 1);
+    refresh_aggregate(parent, idx);
+  }
+  refresh_key_page(parent);
+  refresh_key_page(child);
+  refresh_key_page(left_sibling);
+}
+
+
+/**
+ * Moves the first element of children[idx + 1] to the back of
+ * children[idx], directly between leaves or by rotating it through the
+ * separator in parent between inner nodes.
+ * @param parent The parent of both children.
+ * @param idx The index of the child receiving the element.
+ */
+template <class K, class V>
+void BTree<K, V>::borrow_from_right(BTreeNode* parent, size_t idx)
+{
+  counters.borrows++;
+  structure_version++;
+
+  BTreeNode* child = parent->children[idx];
+  BTreeNode* right_sibling = parent->children[idx + 1];
+
+  if (child->is_leaf) {
+    child->elements.push_back(right_sibling->elements.front());
+    right_sibling->elements.erase(right_sibling->elements.begin());
+    parent->keys[idx] = shortest_separator(
+        child->elements.back().key, right_sibling->elements.front().key);
+    filter_add(child, child->elements.back().key);
+    if (subtree_counts) {
+      parent->counts[idx + 1]--;
+      parent->counts[idx]++;
+    }
+  } else {
+    child->keys.push_back(parent->keys[idx]);
+    parent->keys[idx] = right_sibling->keys.front();
+    right_sibling->keys.erase(right_sibling->keys.begin());
+
+    BTreeNode* moved = right_sibling->children.front();
+    right_sibling->children.erase(right_sibling->children.begin());
+    child->children.push_back(moved);
+    moved->parent = child;
+    if (subtree_counts) {
+      size_t moved_count = right_sibling->counts.front();
+      right_sibling->counts.erase(right_sibling->counts.begin());
+      child->counts.push_back(moved_count);
+      parent->counts[idx + 1] -= moved_count;
+      parent->counts[idx] += moved_count;
+    }
+    if (aggregate_combine) {
+      child->aggregates.push_back(right_sibling->aggregates.front());
+      right_sibling->aggregates.erase(right_sibling->aggregates.begin());
+    }
+  }
+  if (aggregate_combine) {
+    refresh_aggregate(parent, idx);
+    refresh_aggregate(parent, idx + 1);
+  }
+  refresh_key_page(parent);
+  refresh_key_page(child);
+  refresh_key_page(right_sibling);
+}
+
+
+/**
+ * Merges children[idx + 1] into children[idx], then frees
+ * children[idx + 1]. Inner nodes also take in the separator between them,
+ * which leaves do not need.
+ * <pre>
+ *      |4|8|                |8|
+ *     /  |  \     =>      /   \
+ * |2|  |6|   |9|     |2|4|6|   |9|   (inner nodes)
+ *
+ *      |4|8|                |8|
+ *     /  |  \     =>      /   \
+ * |2|  |5|   |9|     |2|5|     |9|   (leaves)
+ * </pre>
+ * @param parent The parent of both children.
+ * @param idx The index of the left child of the pair.
+ */
+template <class K, class V>
+void BTree<K, V>::merge_children(BTreeNode* parent, size_t idx)
+{
+  counters.merges++;
+  structure_version++;
+
+  BTreeNode* left = parent->children[idx];
+  BTreeNode* right = parent->children[idx + 1];
+
+  if (left->is_leaf) {
+    left->elements.insert(left->elements.end(), right->elements.begin(),
+                          right->elements.end());
+  } else {
+    left->keys.push_back(parent->keys[idx]);
+    left->keys.insert(left->keys.end(), right->keys.begin(),
+                      right->keys.end());
+  }
+  for (auto grand_child : right->children) {
+    grand_child->parent = left;
+    left->children.push_back(grand_child);
+  }
+  if (left->is_leaf) {
+    left->next = right->next;
+  }
+  if (subtree_counts) {
+    left->counts.insert(left->counts.end(), right->counts.begin(),
+                        right->counts.end());
+    parent->counts[idx] += parent->counts[idx + 1];
+    parent->counts.erase(parent->counts.begin() + idx + 1);
+  }
+
+  if (aggregate_combine) {
+    left->aggregates.insert(left->aggregates.end(),
+                            right->aggregates.begin(),
+                            right->aggregates.end());
+    parent->aggregates.erase(parent->aggregates.begin() + idx + 1);
+  }
+
+  parent->keys.erase(parent->keys.begin() + idx);
+  parent->children.erase(parent->children.begin() + idx + 1);
+  delete right;
+  if (aggregate_combine) {
+    refresh_aggregate(parent, idx);
+  }
+
+  if (left->is_leaf) {
+    rebuild_filter(left);
+  }
+  refresh_key_page(parent);
+  refresh_key_page(left);
+}
+
+
+/**
+ * Estimates the bookkeeping cost of one heap block beyond the bytes asked
+ * for: the malloc chunk header plus rounding. Uses the allocator's own
+ * answer where glibc provides one.
+ * @param block The start of the block, or nullptr for no block.
+ * @param requested The number of bytes requested for the block.
+ * @return The overhead in bytes.
+ */
+inline size_t allocation_overhead(const void* block, size_t requested)
+{
+  if (block == nullptr || requested == 0) {
+    return 0;
+  }
+#ifdef __GLIBC__
+  return malloc_usable_size(const_cast<void*>(block)) - requested
+         + sizeof(size_t);
+#else
+  return (requested + sizeof(size_t) + 15) / 16 * 16 - requested;
+#endif
+}
+
+/**
+ * Heap bytes owned by a key or value beyond its own sizeof. Plain values own
+ * none.
+ */
+template <class T>
+size_t heap_bytes(const T&)
+{
+  return 0;
+}
+
+/**
+ * Allocator overhead of the heap memory owned by a key or value.
+ */
+template <class T>
+size_t heap_overhead(const T&)
+{
+  return 0;
+}
+
+/**
+ * A std::string owns a heap buffer unless it fits in its small string
+ * buffer, i.e. unless its characters live inside the object itself.
+ */
+inline bool string_on_heap(const std::string& str)
+{
+  const char* self = reinterpret_cast<const char*>(&str);
+  return str.data() < self || str.data() >= self + sizeof(str);
+}
+
+inline size_t heap_bytes(const std::string& str)
+{
+  return string_on_heap(str) ? str.capacity() + 1 : 0;
+}
+
+inline size_t heap_overhead(const std::string& str)
+{
+  return string_on_heap(str)
+             ? allocation_overhead(str.data(), str.capacity() + 1) : 0;
+}
+
+/**
+ * Private recursive version of the memory_usage function.
+ * @param subroot A pointer to the current node being measured.
+ * @param usage The totals to add the subtree's memory to.
+ */
+template <class K, class V>
+void BTree<K, V>::memory_usage(const BTreeNode* subroot,
+                               MemoryUsage& usage) const
+{
+  const auto& elements = subroot->elements;
+  const auto& keys = subroot->keys;
+  const auto& children = subroot->children;
+
+  usage.node_count++;
+  if (subroot->is_leaf) {
+    usage.entry_count += live_size(subroot);
+  }
+  usage.node_bytes += sizeof(BTreeNode);
+  usage.allocator_overhead_bytes += allocation_overhead(subroot,
+                                                        sizeof(BTreeNode));
+
+  usage.payload_bytes += elements.size() * sizeof(DataPair);
+  usage.unused_capacity_bytes += (elements.capacity() - elements.size())
+                                 * sizeof(DataPair);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      elements.data(), elements.capacity() * sizeof(DataPair));
+  for (auto& elem : elements) {
+    usage.payload_bytes += heap_bytes(elem.key) + heap_bytes(elem.value);
+    usage.allocator_overhead_bytes += heap_overhead(elem.key)
+                                      + heap_overhead(elem.value);
+  }
+
+  usage.separator_bytes += keys.size() * sizeof(K);
+  usage.unused_capacity_bytes += (keys.capacity() - keys.size()) * sizeof(K);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      keys.data(), keys.capacity() * sizeof(K));
+  for (auto& key : keys) {
+    usage.separator_bytes += heap_bytes(key);
+    usage.allocator_overhead_bytes += heap_overhead(key);
+  }
+
+  usage.filter_bytes += subroot->filter.size() * sizeof(uint64_t);
+  usage.unused_capacity_bytes += (subroot->filter.capacity()
+                                  - subroot->filter.size()) * sizeof(uint64_t);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      subroot->filter.data(), subroot->filter.capacity() * sizeof(uint64_t));
+
+  usage.key_page_bytes += subroot->key_page.bytes();
+
+  usage.count_bytes += subroot->counts.capacity() * sizeof(size_t);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      subroot->counts.data(), subroot->counts.capacity() * sizeof(size_t));
+
+  usage.aggregate_bytes += subroot->aggregates.capacity() * sizeof(V);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      subroot->aggregates.data(), subroot->aggregates.capacity() * sizeof(V));
+  for (const auto& value : subroot->aggregates) {
+    usage.aggregate_bytes += heap_bytes(value);
+    usage.allocator_overhead_bytes += heap_overhead(value);
+  }
+
+  usage.tombstone_bytes += (subroot->tombstones.capacity() + 7) / 8;
+
+  usage.child_pointer_bytes += children.size() * sizeof(BTreeNode*);
+  usage.unused_capacity_bytes += (children.capacity() - children.size())
+                                 * sizeof(BTreeNode*);
+  usage.allocator_overhead_bytes += allocation_overhead(
+      children.data(), children.capacity() * sizeof(BTreeNode*));
+
+  for (auto child : children) {
+    memory_usage(child, usage);
+  }
+}
+
+
+/**
+ * Private recursive version of the stats function. Fills in the per level
+ * node counts and the raw sums the averages are computed from.
+ * @param subroot A pointer to the current node.
+ * @param level The depth of subroot, 0 for the root.
+ * @param stats The statistics being collected.
+ * @param leaf_keys The running total of keys held in leaves.
+ * @param inner_keys The running total of keys held in inner nodes.
  */
 template <class K, class V>
-void BTree<K, V>::remove(K& key)
+void BTree<K, V>::stats(const BTreeNode* subroot, size_t level,
+                        TreeStats& stats, size_t& leaf_keys,
+                        size_t& inner_keys) const
 {
-  vector<size_t> before_idxes;
-    if(root != nullptr)
-    {
-      remove(root, key, before_idxes);
+  if (stats.nodes_per_level.size() <= level) {
+    stats.nodes_per_level.resize(level + 1, 0);
+  }
+  stats.nodes_per_level[level]++;
+
+  size_t size = node_size(subroot);
+  size_t bucket = size * TreeStats::FILL_BUCKETS / (node_order(subroot) - 1);
+  if (bucket >= TreeStats::FILL_BUCKETS) {
+    bucket = TreeStats::FILL_BUCKETS - 1;
+  }
+
+  if (subroot->is_leaf) {
+    stats.leaf_count++;
+    stats.leaf_fill_histogram[bucket]++;
+    leaf_keys += size;
+  } else {
+    stats.inner_count++;
+    stats.inner_fill_histogram[bucket]++;
+    inner_keys += size;
+    for (auto child : subroot->children) {
+      this->stats(child, level + 1, stats, leaf_keys, inner_keys);
     }
+  }
 }
 
+
 /**
- * Print Btree from root.
+ * Hashes a key for the leaf Bloom filters. std::hash is often the identity
+ * for integers, so its result is run through the murmur3 finalizer to
+ * spread neighbouring keys over the filter.
+ * @param key The key to hash.
+ * @return A 64 bit hash of key.
  */
-template <class K, class V>
-void BTree<K, V>::print()
+template <class K>
+uint64_t filter_hash(const K& key, std::true_type)
 {
-  print(root);
+  uint64_t hash = std::hash<K>()(key);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
 }
 
 /**
- * Private recursive version of the find function.
- * @param subroot A reference of a pointer to the current BTreeNode.
- * @param key The key we are looking up.
- * @return The value (if found), the default V if not.
+ * Stands in for filter_hash for keys without a std::hash. Leaves of such
+ * keys never get filters, so it is never called.
  */
-template <class K, class V>
-V BTree<K, V>::find(const BTreeNode* subroot, const K& key) const
+template <class K>
+uint64_t filter_hash(const K&, std::false_type)
 {
-  size_t first_larger_idx = insertion_idx(subroot->elements, key);
+  return 0;
+}
 
-  if (!subroot->elements.empty() && first_larger_idx < subroot->elements.size()) {
-    DataPair found = subroot->elements[first_larger_idx];
-    if (found.key == key)
-    {
-      return found.value;
-    }
+/** Number of filter bits set (and probed) per key. */
+const unsigned int FILTER_PROBES = 3;
+
+/**
+ * Recomputes a node's Bloom filter from its elements, or drops it if the
+ * node is not a leaf or filters are off. Filters get about eight bits per
+ * key slot, rounded up to a power of two number of 64 bit words.
+ * @param node The node whose filter is rebuilt.
+ */
+template <class K, class V>
+void BTree<K, V>::rebuild_filter(BTreeNode* node)
+{
+  if (!leaf_filters || !node->is_leaf) {
+    node->filter.clear();
+    node->filter.shrink_to_fit();
+    return;
   }
 
-  if (!subroot->is_leaf)
-  {
-    return find(subroot->children[first_larger_idx], key);
+  size_t words = 1;
+  while (words * 64 < order * 8) {
+    words *= 2;
   }
-  else
-  {
-    return V();
+  node->filter.assign(words, 0);
+  for (auto& elem : node->elements) {
+    filter_add(node, elem.key);
   }
 }
 
+/**
+ * Recursively rebuilds the filters of every node in a subtree.
+ * @param subroot A pointer to the root of the subtree.
+ */
+template <class K, class V>
+void BTree<K, V>::rebuild_filters(BTreeNode* subroot)
+{
+  rebuild_filter(subroot);
+  for (auto child : subroot->children) {
+    rebuild_filters(child);
+  }
+}
 
 /**
- * Inserts a key and value into the BTree. If the key is already in the
- * tree do nothing.
- * @param key The key to insert.
- * @param value The value to insert.
+ * Adds a key to a leaf's Bloom filter, if it has one. Probe positions come
+ * from double hashing the two halves of one 64 bit hash.
+ * @param node The leaf.
+ * @param key The key being added to the leaf.
  */
 template <class K, class V>
-void BTree<K, V>::insert(const K& key, const V& value)
+void BTree<K, V>::filter_add(BTreeNode* node, const K& key)
 {
-  /* 트리가 비어 있다면 root node를 생성한다.*/
-  if (root == nullptr) {
-      root = new BTreeNode(true, order);
-      root->parent = nullptr;
+  if (node->filter.empty()) {
+    return;
   }
+  uint64_t hash = filter_hash(key, LeafFilterHashable<K>());
+  uint64_t step = (hash >> 32) | 1;
+  uint64_t mask = node->filter.size() * 64 - 1;
+  for (unsigned int i = 0; i < FILTER_PROBES; i++) {
+    uint64_t bit = (hash + i * step) & mask;
+    node->filter[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+}
 
-  insert(root, DataPair(key, value));
-  
-  /* root의 elements의 크기가 order보다 크면 새로운 root를 만들고 높이를 증가시킨다. */
-  if (root->elements.size() >= order) {
-      BTreeNode* new_root = new BTreeNode(false, order);
-      new_root->children.push_back(root);
-      split_child(new_root, 0);
-      root = new_root;
+/**
+ * Checks a leaf's Bloom filter.
+ * @param node The leaf.
+ * @param key The key we are looking up.
+ * @return false if key is definitely not in the leaf, true if it may be
+ * (or if the leaf has no filter).
+ */
+template <class K, class V>
+bool BTree<K, V>::filter_may_contain(const BTreeNode* node,
+                                     const K& key) const
+{
+  if (node->filter.empty()) {
+    return true;
   }
+  uint64_t hash = filter_hash(key, LeafFilterHashable<K>());
+  uint64_t step = (hash >> 32) | 1;
+  uint64_t mask = node->filter.size() * 64 - 1;
+  for (unsigned int i = 0; i < FILTER_PROBES; i++) {
+    uint64_t bit = (hash + i * step) & mask;
+    if ((node->filter[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
 }
 
 
+/**
+ * Finds where a key is, or would go, within one node, using the node's key
+ * page when it has one.
+ * @param node The node to search.
+ * @param key The key we are looking up.
+ * @return The index of the first element whose key is not less than key.
+ */
 template <class K, class V>
-void BTree<K, V>::split_child(BTreeNode* parent, size_t child_idx)
+size_t BTree<K, V>::node_search(const BTreeNode* node, const K& key) const
 {
-  /** 
-    * 다음의 element가 order와 같을 때 child를 split한다.
-    *       |32|
-    *     /      \
-    * |5|8|12|   |44|
-    *
-    *
-    * 왼쪽에 새로운 노드를 생성한다.
-    *      | |32|
-    *     /      \
-    * |5|8|12|   |44|
-    *
-    * 생성된 왼쪽 노드에 split해야하는 child노드의 key기준으로 가운데 element를 가져온다.
-    * parent's elements. At this point the median is still in the child.
-    *      |8|32|
-    *     /      \
-    * |5|8|12|   |44|
-    *
-    * elements를 두개로 copy하여 parent와 children을 이어준다.
-    *      |8|32|
-    *     /  |   \
-    * |5|  |12|   |44|
-    *
-    */
-  BTreeNode* child = parent->children[child_idx];
-  BTreeNode* old_child = child;
-  BTreeNode* new_child = new BTreeNode(child->is_leaf, order);
+  if (node->key_page.active()) {
+    return node->key_page.lower_bound(key);
+  }
+  return node->is_leaf ? insertion_idx(node->elements, key)
+                       : insertion_idx(node->keys, key);
+}
 
-  /**
-    * 1. element가 짝수인 경우
-    * |5|8|12|
-    * 중간 element : (3-1)/2 = 1 (전체에 1을 뺀 가운데 값)
-    * 중간 자식 포인터 : 4/2 = 2 (자식의 수의 절반)
-    * 
-    * 2. element가 홀수인 경우
-    * |8|32|
-    * 중간 element : (2-1)/2 = 0 (전체에 1을 뺸 가운데 값)
-    * 중간 자식 포인터 :  2/2 = 1 (전체에 절반)
-  */
-  int mid_elem_idx = (child->elements.size() - 1) / 2;
-  int mid_child_idx = child->children.size() / 2;
-
-  auto child_itr = parent->children.begin() + child_idx + 1;
-  auto elem_itr = parent->elements.begin() + child_idx;
-  auto mid_elem_itr = child->elements.begin() + mid_elem_idx;
-  auto mid_child_itr = child->children.begin() + mid_child_idx;
-  
-  parent->elements.insert(elem_itr, child->elements[mid_elem_idx]);
-  parent->children.insert(child_itr, new_child);
+/**
+ * Picks the child of an inner node to descend into for a key. Keys equal to
+ * a separator belong to the subtree on its right.
+ * @param node The inner node.
+ * @param key The key we are looking up.
+ * @return The index of the first separator greater than key.
+ */
+template <class K, class V>
+size_t BTree<K, V>::child_index(const BTreeNode* node, const K& key) const
+{
+  if (node->key_page.active()) {
+    return node->key_page.upper_bound(key);
+  }
+  size_t idx = insertion_idx(node->keys, key);
+  if (idx < node->keys.size() && node->keys[idx] == key) {
+    idx++;
+  }
+  return idx;
+}
 
-  new_child->elements.assign(mid_elem_itr + 1, child->elements.end());
-  new_child->children.assign(mid_child_itr, child->children.end());
-  new_child->parent = parent;
-  for(auto grand_child : new_child->children)
-  {
-    grand_child->parent = new_child;
+/**
+ * Rebuilds a node's key page after its elements or keys changed, or drops it
+ * if key pages are off.
+ * @param node The node whose elements or keys changed.
+ */
+template <class K, class V>
+void BTree<K, V>::refresh_key_page(BTreeNode* node)
+{
+  if (!KeyPage<K>::supported) {
+    return;
+  }
+  if (key_pages && node->is_leaf) {
+    node->key_page.build(node->elements);
+  } else if (key_pages) {
+    node->key_page.build(node->keys);
+  } else if (node->key_page.active()) {
+    node->key_page.clear();
   }
+}
 
-  old_child->elements.assign(child->elements.begin(), mid_elem_itr);
-  old_child->children.assign(child->children.begin(), mid_child_itr);
-  old_child->parent = parent;
-  for(auto grand_child : old_child->children)
-  {
-    grand_child->parent = old_child;
+/**
+ * Recursively refreshes the key pages of every node in a subtree.
+ * @param subroot A pointer to the root of the subtree.
+ */
+template <class K, class V>
+void BTree<K, V>::refresh_key_pages(BTreeNode* subroot)
+{
+  refresh_key_page(subroot);
+  for (auto child : subroot->children) {
+    refresh_key_pages(child);
   }
 }
 
 
 /**
- * Private recursive version of the insert function.
- * @param subroot A reference of a pointer to the current BTreeNode.
- * @param pair The DataPair to be inserted.
- * Note: Original solution used std::lower_bound, but making the students
- * write an equivalent seemed more instructive.
+ * Copies the subtrees at a wide enough level on several threads, each
+ * chaining its own leaves, then copies the few nodes above them and
+ * chains the subtrees' leaves to each other.
+ * @param subroot A pointer to the root of the subtree to copy.
+ * @param threads The number of threads to use.
+ * @return The copy, with its leaves chained.
  */
 template <class K, class V>
-void BTree<K, V>::insert(BTreeNode* subroot, const DataPair& pair)
+typename BTree<K, V>::BTreeNode* BTree<K, V>::copy_parallel(
+    const BTreeNode* subroot, unsigned int threads)
 {
-  int node_insert_idx = insertion_idx(subroot->elements, pair);
- 
-  //element가 비어있거나, elements의 크기보다 인덱스가 작으며,
-  if (!subroot->elements.empty() && node_insert_idx < subroot->elements.size()) {
-    //이미 데이터가 존재한다면 insert 안함
-    if (subroot->elements[node_insert_idx] == pair) return;
+  if (subroot == nullptr) {
+    return nullptr;
   }
-  if (subroot->is_leaf) {
-    subroot->elements.insert(subroot->elements.begin() + node_insert_idx, pair);
-  } 
-  else {
-    BTreeNode* child = subroot->children[node_insert_idx];
-    insert(child, pair);
-    if(child->elements.size() >= order) split_child(subroot, node_insert_idx);
+  size_t depth;
+  vector<BTreeNode*> nodes =
+      frontier(const_cast<BTreeNode*>(subroot), 4 * threads, depth);
+  vector<BTreeNode*> copies(nodes.size());
+  vector<BTreeNode*> last_leaves(nodes.size());
+  parallel_for(nodes.size(), threads, [&](size_t i) {
+    copies[i] = copy(nodes[i]);
+    last_leaves[i] = nullptr;
+    link_leaves(copies[i], last_leaves[i]);
+  });
+  for (size_t i = 1; i < copies.size(); i++) {
+    BTreeNode* first = copies[i];
+    while (!first->is_leaf) {
+      first = first->children.front();
+    }
+    last_leaves[i - 1]->next = first;
   }
+  size_t next = 0;
+  return copy_above(subroot, depth, copies, next);
 }
 
+/**
+ * Copies the top of a subtree onto copies of the subtrees below it.
+ * @param subroot A pointer to the root of the subtree.
+ * @param depth The depth, below subroot, of the nodes already copied.
+ * @param copies The copies of the nodes at that depth.
+ * @param next The index of the next copy to take; updated.
+ * @return The copy of subroot.
+ */
+template <class K, class V>
+typename BTree<K, V>::BTreeNode* BTree<K, V>::copy_above(
+    const BTreeNode* subroot, size_t depth, const vector<BTreeNode*>& copies,
+    size_t& next)
+{
+  if (depth == 0) {
+    return copies[next++];
+  }
+  BTreeNode* new_node = new BTreeNode(*subroot);
+  for (auto& child : subroot->children) {
+    new_node->children.push_back(copy_above(child, depth - 1, copies, next));
+    new_node->children.back()->parent = new_node;
+  }
+  return new_node;
+}
 
 /**
- * Removes a key and value into the BTree. If the key is not in the
- * tree do nothing.
- * @param subroot A reference of a pointer to the current BTreeNode.
- * @param key The key to remove.
- * @param before_idxes Path to node including the key.
+ * Frees the top of a subtree whose lower part is already freed.
+ * @param subroot A pointer to the root of the subtree.
+ * @param depth The depth, below subroot, of the nodes to leave.
  */
 template <class K, class V>
-void BTree<K, V>::remove(BTreeNode* subroot, K& key, vector<size_t> before_idxes)
+void BTree<K, V>::clear_above(BTreeNode* subroot, size_t depth)
 {
-  size_t first_larger_idx = insertion_idx(subroot->elements, key);
+  if (depth == 0) {
+    return;
+  }
+  for (auto child : subroot->children) {
+    clear_above(child, depth - 1);
+  }
+  delete subroot;
+}
 
-  if (!subroot->elements.empty() && first_larger_idx < subroot->elements.size()) {
-    DataPair found = subroot->elements[first_larger_idx];
-    if (found.key == key)
-    {
-      if(subroot->is_leaf)
-      {
-        remove_from_leaf(subroot, first_larger_idx, before_idxes);
-      }
-      else
-      {
-        remove_from_inner(subroot, first_larger_idx, before_idxes);
-      }
+/**
+ * Chains the leaves of a subtree in key order, e.g. after copying it.
+ * @param subroot A pointer to the root of the subtree.
+ * @param prev The last leaf linked so far, or nullptr; updated to the last
+ * leaf of the subtree.
+ */
+template <class K, class V>
+void BTree<K, V>::link_leaves(BTreeNode* subroot, BTreeNode*& prev)
+{
+  if (!subroot->is_leaf) {
+    for (auto child : subroot->children) {
+      link_leaves(child, prev);
     }
+    return;
   }
-
-  before_idxes.push_back(first_larger_idx);
-
-  if (!subroot->is_leaf)
-  {
-    remove(subroot->children[first_larger_idx], key, before_idxes);
+  if (prev != nullptr) {
+    prev->next = subroot;
   }
+  subroot->next = nullptr;
+  prev = subroot;
 }
 
-
 /**
- * Removes leaf node.
- * @param subroot A reference of a pointer to the current BTreeNode.
- * @param idx The key index form the node;
- * @param before_idxes Path to node including the key.
+ * Checks the top of the tree against the checks of the subtrees below it.
+ * @param subroot A pointer to the root of the subtree.
+ * @param depth The depth, below subroot, of the checked nodes.
+ * @param order The order the BTree should satisfy.
+ * @param checks The checks of the nodes at that depth, in order.
+ * @param next The index of the next check to use; updated.
+ * @param outline The separators and subtree bounds; appended to.
+ * @param size Set to the number of pairs under subroot.
+ * @return true if the nodes above the depth are valid and so are the
+ * checked subtrees, false otherwise.
  */
 template <class K, class V>
-void BTree<K,V>::remove_from_leaf(BTreeNode* subroot, size_t idx, std::vector<size_t> before_idxes)
+bool BTree<K, V>::is_valid_above(const BTreeNode* subroot, size_t depth,
+                                 unsigned int order,
+                                 const vector<SubtreeCheck>& checks,
+                                 size_t& next, vector<DataPair>& outline,
+                                 size_t& size) const
 {
-  bool is_borrow_from_other;
-
-  if(subroot->elements.size() > (order-1)/2)
-  {
-    subroot->elements.erase(subroot->elements.begin() + idx);
+  if (depth == 0) {
+    const SubtreeCheck& check = checks[next++];
+    if (!check.data.empty()) {
+      outline.push_back(check.data.front());
+      outline.push_back(check.data.back());
+    }
+    size = check.size;
+    return check.valid;
   }
-  else
-  {
-    is_borrow_from_other = borrow_from_sibilings(subroot->parent, idx, before_idxes.back());
-    if(!is_borrow_from_other && subroot->parent->elements.size() > (order-1)/2)
-    {
-      is_borrow_from_other = borrow_from_parent(subroot->parent, idx, before_idxes.back());
+  if (subroot->keys.size() >= inner_order_for(order)
+      || subroot->children.size() != subroot->keys.size() + 1
+      || (subtree_counts
+          && subroot->counts.size() != subroot->children.size())) {
+    return false;
+  }
+  size = 0;
+  for (size_t i = 0; i < subroot->children.size(); i++) {
+    if (i > 0) {
+      outline.push_back(DataPair(subroot->keys[i - 1], V()));
     }
-    if(!is_borrow_from_other)
-    {
-      remove_and_reconstruct(subroot->parent, idx, before_idxes);
+    size_t child_size;
+    if (!is_valid_above(subroot->children[i], depth - 1, order, checks, next,
+                        outline, child_size)
+        || (subtree_counts && subroot->counts[i] != child_size)) {
+      return false;
     }
+    size += child_size;
   }
+  return true;
 }
 
-
 /**
- * balances the tree by borrowing from sibilings.
- * @param parent A reference of a pointer to the current BTreeNode's parent.
- * @param idx The key index form the node;
- * @param before_idxes Path to node including the key.
+ * Checks that following next from the leftmost leaf visits exactly the
+ * leaves of the tree, in order.
+ * @return true if the leaf chain is intact, false otherwise.
  */
 template <class K, class V>
-bool BTree<K,V>::borrow_from_sibilings(BTreeNode* parent, size_t idx, size_t before_idx)
+bool BTree<K, V>::leaves_linked() const
 {
-  BTreeNode* left_sibiling;
-  BTreeNode* right_sibiling;
+  return leaves_linked(root, nullptr);
+}
 
-  if(before_idx != 0)
-  {
-    left_sibiling = parent->children[before_idx-1];
-    if(left_sibiling->elements.size() > (order-1)/2)
-    {
-      //1. 자식에게 부모의 것 부여. 2. 남는 자식이 부모에게 부여. 3. 남는자식요소 삭제
-      parent->children[before_idx]->elements[idx] = parent->elements[before_idx-1];
-      parent->elements[before_idx-1] = left_sibiling->elements.back();
-      left_sibiling->elements.pop_back();
-      return true;
+/**
+ * Checks one subtree's stretch of the leaf chain.
+ * @param subroot A pointer to the root of the subtree.
+ * @param next The leaf that should follow the subtree's last leaf.
+ * @return true if the subtree's leaf chain is intact, false otherwise.
+ */
+template <class K, class V>
+bool BTree<K, V>::leaves_linked(const BTreeNode* subroot,
+                                const BTreeNode* next) const
+{
+  vector<const BTreeNode*> leaves;
+  vector<const BTreeNode*> stack(1, subroot);
+  while (!stack.empty()) {
+    const BTreeNode* node = stack.back();
+    stack.pop_back();
+    if (node->is_leaf) {
+      leaves.push_back(node);
     }
+    stack.insert(stack.end(), node->children.rbegin(), node->children.rend());
   }
-  else if(before_idx != parent->elements.size())
-  {
-    right_sibiling = parent->children[before_idx+1];
-    if(right_sibiling->elements.size() > (order-1)/2)
-    {
-      parent->children[before_idx]->elements[idx] = parent->elements[before_idx+1];
-      parent->elements[before_idx+1] = left_sibiling->elements.back();
-      right_sibiling->elements.pop_back();
-      return true;
+
+  const BTreeNode* leaf = leaves.front();
+  for (size_t i = 1; i < leaves.size(); i++) {
+    if (leaf->next != leaves[i]) {
+      return false;
     }
+    leaf = leaf->next;
   }
-  return false;
+  return leaf->next == next;
 }
 
 
 /**
- * balances the tree by borrowing from parent.
- * @param parent A reference of a pointer to the current BTreeNode's parent.
- * @param idx The key index form the node;
- * @param before_idxes Path to node including the key.
+ * @param node A node.
+ * @return The number of pairs under node, from its own counts.
  */
 template <class K, class V>
-bool BTree<K,V>::borrow_from_parent(BTreeNode* parent, size_t idx, size_t before_idx)
+size_t BTree<K, V>::subtree_size(const BTreeNode* node) const
 {
-  BTreeNode* left_sibiling;
-  BTreeNode* right_sibiling;
-
-  if(before_idx != 0)
-  {
-    left_sibiling = parent->children[before_idx-1];
-    left_sibiling->elements.push_back(parent->elements[before_idx-1]);
-    parent->elements.erase(parent->elements.begin() + (before_idx-1));
-    parent->children.erase(parent->children.begin() + (before_idx));  
-    return true;
+  if (node->is_leaf) {
+    return live_size(node);
   }
-  else
-  {
-    right_sibiling = parent->children[before_idx+1];
-    right_sibiling->elements.insert(right_sibiling->elements.begin(), parent->elements[before_idx]);
-    parent->elements.erase(parent->elements.begin() + before_idx);
-    parent->children.erase(parent->children.begin() + before_idx);
-
-    return true;
+  size_t size = 0;
+  for (auto count : node->counts) {
+    size += count;
   }
-  return false;
+  return size;
 }
 
-
 /**
- * Removes inner node.
- * @param parent A reference of a pointer to the current BTreeNode's parent.
- * @param idx The key index form the node;
- * @param before_idxes Path to node including the key.
+ * Recursively recomputes, or drops if subtree counts are off, the counts of
+ * every node in a subtree.
+ * @param subroot A pointer to the root of the subtree.
+ * @return The number of pairs in the subtree.
  */
 template <class K, class V>
-void BTree<K,V>::remove_from_inner(BTreeNode* subroot, size_t idx, std::vector<size_t> before_idxes)
+size_t BTree<K, V>::rebuild_counts(BTreeNode* subroot)
 {
-  BTreeNode* left_max_node = subroot->children[idx];
-  BTreeNode* right_min_node = subroot->children[idx+1];
-
-  before_idxes.push_back(idx+1);
-
-  while(!left_max_node->is_leaf)
-  {
-    left_max_node = left_max_node->children.back();
+  if (subroot->is_leaf) {
+    return live_size(subroot);
   }
-  if(left_max_node->elements.size() > (order-1)/2)
-  {
-    subroot->elements[idx] = left_max_node->elements.back();
-    left_max_node->elements.pop_back();
-    return;
+  size_t size = 0;
+  subroot->counts.clear();
+  for (auto child : subroot->children) {
+    size_t count = rebuild_counts(child);
+    if (subtree_counts) {
+      subroot->counts.push_back(count);
+    }
+    size += count;
   }
+  if (!subtree_counts) {
+    subroot->counts.shrink_to_fit();
+  }
+  return size;
+}
 
-  while(!right_min_node->is_leaf)
-  {
-    right_min_node = right_min_node->children.front();
-    before_idxes.push_back(0);
+/**
+ * Checks the counts of every node in a subtree against its contents.
+ * @param subroot A pointer to the root of the subtree.
+ * @param size Set to the number of pairs in the subtree.
+ * @return true if all counts are right, false otherwise.
+ */
+template <class K, class V>
+bool BTree<K, V>::counts_valid(const BTreeNode* subroot, size_t& size) const
+{
+  size = 0;
+  if (subroot->is_leaf) {
+    size = live_size(subroot);
+    return subroot->counts.empty();
   }
-  if(right_min_node->elements.size() > (order-1)/2)
-  {
-    subroot->elements[idx] = right_min_node->elements.front();
-    right_min_node->elements.erase(right_min_node->elements.begin());
-    return;
+  if (subroot->counts.size() != subroot->children.size()) {
+    return false;
   }
-
-  else
-  {
-    subroot->elements[idx] = right_min_node->elements.front();
-    remove_from_leaf(right_min_node, 0, before_idxes);
+  for (size_t i = 0; i < subroot->children.size(); i++) {
+    size_t child_size;
+    if (!counts_valid(subroot->children[i], child_size)
+        || child_size != subroot->counts[i]) {
+      return false;
+    }
+    size += child_size;
   }
+  return true;
 }
 
-
 /**
- * Removes node and balances the tree by reconstruct(merging and split node).
- * @param parent A reference of a pointer to the current BTreeNode's parent.
- * @param idx The key index form the node;
- * @param before_idxes Path to node including the key.
+ * Counts the keys below (or up to) a key, summing the counts of the
+ * children left of the search path if subtree counts are on, and walking
+ * the leaves left of it otherwise.
+ * @param key A key.
+ * @param inclusive Whether to count keys equal to key as well.
+ * @return The number of keys less than (or equal to) key.
  */
 template <class K, class V>
-void BTree<K,V>::remove_and_reconstruct(BTreeNode* parent, size_t idx, std::vector<size_t> before_idxes)
+size_t BTree<K, V>::rank(const K& key, bool inclusive) const
 {
-  size_t before_idx = before_idxes.back();
-  BTreeNode* current_node = parent->children[before_idx];
-  BTreeNode* merged_node;
-
-  if(current_node->is_leaf)
-  {
-    if(before_idx != 0)
-    {
-      auto cur_begin_iter = current_node->elements.begin();
-      auto cur_idx_iter = current_node->elements.begin() + idx;
-      auto cur_end_iter = current_node->elements.end();
-      auto left_sibiling = parent->children[before_idx-1];
-
-      left_sibiling->elements.push_back(parent->elements[before_idx-1]);
-      left_sibiling->elements.insert(left_sibiling->elements.end(), cur_begin_iter, cur_idx_iter);
-      left_sibiling->elements.insert(left_sibiling->elements.end(), cur_idx_iter+1, cur_end_iter);
-
-      parent->elements.erase(parent->elements.begin() + before_idx-1);
-      parent->children.erase(parent->children.begin() + before_idx);
+  const BTreeNode* subroot = root;
+  if (subroot == nullptr) {
+    return 0;
+  }
 
-      merged_node = left_sibiling;
+  size_t ret = 0;
+  while (!subroot->is_leaf) {
+    size_t idx = child_index(subroot, key);
+    if (subtree_counts) {
+      for (size_t i = 0; i < idx; i++) {
+        ret += subroot->counts[i];
+      }
     }
-    else
-    {
-      auto cur_begin_iter = current_node->elements.begin();
-      auto cur_idx_iter = current_node->elements.begin() + idx;
-      auto cur_end_iter = current_node->elements.end();
-      auto right_sibiling = parent->children[before_idx+1];
-
-      right_sibiling->elements.insert(right_sibiling->elements.begin(), parent->elements[before_idx]);
-      right_sibiling->elements.insert(right_sibiling->elements.begin(), cur_idx_iter+1, cur_end_iter);
-      right_sibiling->elements.insert(right_sibiling->elements.begin(), cur_begin_iter, cur_idx_iter);
+    subroot = subroot->children[idx];
+  }
+  if (!subtree_counts) {
+    const BTreeNode* leaf = root;
+    while (!leaf->is_leaf) {
+      leaf = leaf->children.front();
+    }
+    for (; leaf != subroot; leaf = leaf->next) {
+      ret += live_size(leaf);
+    }
+  }
 
-      parent->elements.erase(parent->elements.begin() + before_idx);
-      parent->children.erase(parent->children.begin() + before_idx);    
+  size_t idx = node_search(subroot, key);
+  if (inclusive && idx < subroot->elements.size()
+      && subroot->elements[idx] == key) {
+    idx++;
+  }
+  for (size_t i = 0; i < idx; i++) {
+    ret += !is_tombstone(subroot, i);
+  }
+  return ret;
+}
 
-      merged_node = right_sibiling;
+/**
+ * @param node A node.
+ * @return The aggregate of all values under node, from its own elements or
+ * aggregates.
+ */
+template <class K, class V>
+V BTree<K, V>::summarize(const BTreeNode* node) const
+{
+  V ret = aggregate_identity;
+  if (node->is_leaf) {
+    for (size_t i = 0; i < node->elements.size(); i++) {
+      if (!is_tombstone(node, i)) {
+        ret = aggregate_combine(ret, node->elements[i].value);
+      }
+    }
+  } else {
+    for (const auto& value : node->aggregates) {
+      ret = aggregate_combine(ret, value);
     }
-    before_idxes.pop_back();
-    before_idx = before_idxes.back();
+  }
+  return ret;
+}
 
-    size_t parent_insert_idx;
-    if(before_idx != 0)
-    {
-      parent_insert_idx = before_idx-1;
-      merged_node->parent = parent->parent->children[parent_insert_idx];
-      merged_node->parent->elements.push_back(parent->parent->elements[before_idx-1]);
-      merged_node->parent->children.push_back(merged_node);
+/**
+ * Recomputes parent->aggregates[idx] from parent->children[idx].
+ */
+template <class K, class V>
+void BTree<K, V>::refresh_aggregate(BTreeNode* parent, size_t idx)
+{
+  parent->aggregates[idx] = summarize(parent->children[idx]);
+}
 
-      parent->parent->elements.erase(parent->parent->elements.begin()+before_idx-1);
-      parent->parent->children.erase(parent->parent->children.begin()+before_idx);
+/**
+ * Recursively recomputes, or drops if no aggregate is set, the aggregates
+ * of every node in a subtree.
+ * @param subroot A pointer to the root of the subtree.
+ */
+template <class K, class V>
+void BTree<K, V>::rebuild_aggregates(BTreeNode* subroot)
+{
+  if (subroot->is_leaf) {
+    return;
+  }
+  subroot->aggregates.clear();
+  for (auto child : subroot->children) {
+    rebuild_aggregates(child);
+    if (aggregate_combine) {
+      subroot->aggregates.push_back(summarize(child));
     }
-    else
-    {
-      parent_insert_idx = before_idx+1;
-      merged_node->parent = parent->parent->children[parent_insert_idx];
-      merged_node->parent->elements.insert(merged_node->parent->elements.begin(), parent->parent->elements[before_idx]);
-      merged_node->parent->children.insert(merged_node->parent->children.begin(), merged_node);
+  }
+  if (!aggregate_combine) {
+    subroot->aggregates.shrink_to_fit();
+  }
+}
 
-      parent->parent->elements.erase(parent->parent->elements.begin()+before_idx);
-      parent->parent->children.erase(parent->parent->children.begin()+before_idx);
-    }
-    if(merged_node->parent->elements.size() >= order)
-    {
-      split_child(merged_node->parent->parent, parent_insert_idx);
-    }
-    if(root->elements.size() == 0)
-    {
-      root = merged_node->parent;
+/**
+ * Combines the values in range under a node. The children strictly between
+ * the ones holding lo and hi lie wholly inside the range and contribute
+ * their stored aggregates; only the two boundary children are descended
+ * into, each with one bound left to check.
+ * @param subroot A pointer to the current node.
+ * @param lo The smallest key to include, or nullptr for no bound.
+ * @param hi The largest key to include, or nullptr for no bound.
+ * @return The aggregate of the values in range under subroot.
+ */
+template <class K, class V>
+V BTree<K, V>::aggregate(const BTreeNode* subroot, const K* lo,
+                         const K* hi) const
+{
+  if (lo == nullptr && hi == nullptr) {
+    return summarize(subroot);
+  }
+  if (subroot->is_leaf) {
+    V ret = aggregate_identity;
+    size_t idx = lo == nullptr ? 0 : node_search(subroot, *lo);
+    for (; idx < subroot->elements.size(); idx++) {
+      const DataPair& elem = subroot->elements[idx];
+      if (hi != nullptr && *hi < elem.key) {
+        break;
+      }
+      if (!is_tombstone(subroot, idx)) {
+        ret = aggregate_combine(ret, elem.value);
+      }
     }
+    return ret;
   }
-}
 
+  size_t first = lo == nullptr ? 0 : child_index(subroot, *lo);
+  size_t last = hi == nullptr ? subroot->children.size() - 1
+                              : child_index(subroot, *hi);
+  if (first == last) {
+    return aggregate(subroot->children[first], lo, hi);
+  }
+  V ret = aggregate(subroot->children[first], lo, nullptr);
+  for (size_t i = first + 1; i < last; i++) {
+    ret = aggregate_combine(ret, subroot->aggregates[i]);
+  }
+  return aggregate_combine(ret, aggregate(subroot->children[last], nullptr,
+                                          hi));
+}
 
 /**
  * prints tree from root
@@ -486,7 +3730,11 @@ void BTree<K, V>::print(BTreeNode* root)
   for(auto it : root->elements)
   {
     std::cout << "["<< it.key << "|" << it.value << "]";
-   }
+  }
+  for(auto& key : root->keys)
+  {
+    std::cout << "["<< key << "]";
+  }
   std::cout << "\n";
 
   queue<vector<BTreeNode*>> q;
@@ -496,7 +3744,7 @@ void BTree<K, V>::print(BTreeNode* root)
     q.push(root->children);
     last_child_of_generation = root->children.back();
   }
-  do
+  while(!q.empty())
   {
     children = q.front();
     q.pop();
@@ -519,7 +3767,6 @@ void BTree<K, V>::print(BTreeNode* root)
       }
     }
   }
-  while(!q.empty());
 }
 
 
@@ -532,7 +3779,14 @@ void BTree<K, V>::print_node(BTreeNode* node)
 {
   for(auto it : node->elements)
     {
-      std::cout << "(" << node->parent->elements.front().key << ")" << "["<< it.key << "|" << it.value << "]";
+      std::cout << "(" << node->parent->keys.front() << ")" << "["<< it.key;
+      std::cout << "|" << it.value;
+      std::cout << "]";
+    }
+  for(auto& key : node->keys)
+    {
+      std::cout << "(" << node->parent->keys.front() << ")" << "["<< key;
+      std::cout << "]";
     }
     std::cout << " ";
 }
@@ -13,13 +13,42 @@
 
 #include <vector>
 #include <queue>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "frozen_btree.h"
+#include "key_page.h"
+#include "snapshot.h"
+#include "thread_pool.h"
+#include "value_filter.h"
+
+/**
+ * Whether std::hash<K> can hash a K, which leaf Bloom filters need. Key
+ * types without one still work in a BTree, just without filters.
+ */
+template <class K, class Enable = void>
+struct LeafFilterHashable : std::false_type {
+};
+
+template <class K>
+struct LeafFilterHashable<
+    K, decltype(void(std::hash<K>()(std::declval<const K&>())))>
+    : std::true_type {
+};
 
 /**
  * BTree class. Provides interfaces for inserting and finding elements in
- * B-tree.
+ * B-tree. The tree is laid out as a B+ tree: every key / value pair lives in
+ * a leaf, leaves are chained left to right, and inner nodes only hold
+ * separator keys for routing. A separator need not be a key in the tree;
+ * keys equal to separators[i] are found in children[i + 1].
  *
  * @author Matt Joras
  * @date Winter 2013
@@ -147,32 +176,63 @@ class BTree
         };
 
         /**
-         * A class for the basic node structure of the BTree. A node contains
-         * two vectors, one with DataPairs representing the data, and one of
-         * BTreeNode*s, representing the node's children.
+         * A class for the basic node structure of the BTree. A leaf holds
+         * its data as DataPairs in elements and points to the next leaf in
+         * key order; an inner node holds its separators, bare keys with no
+         * value, in keys and its children in children, and leaves elements
+         * empty (as leaves do keys and children). When leaf filters
+         * are enabled, leaves also carry a Bloom filter over their keys; when
+         * key pages are enabled, nodes carry a compact copy of their keys
+         * that in-node searches use instead of the elements; when subtree
+         * counts are enabled, counts[i] of an inner node is the number of
+         * pairs under children[i]; when an aggregate is set, aggregates[i]
+         * of an inner node combines the values under children[i]. A leaf
+         * holding lazily removed pairs has tombstones[i] set for each of
+         * them. tombstones is either empty or exactly as long as elements;
+         * it stays, all clear, after its last tombstone is revived.
          */
         struct BTreeNode {
             bool is_leaf;
             BTreeNode* parent;
+            BTreeNode* next;
             std::vector<DataPair> elements;
+            std::vector<K> keys;
             std::vector<BTreeNode*> children;
+            std::vector<uint64_t> filter;
+            KeyPage<K> key_page;
+            std::vector<size_t> counts;
+            std::vector<V> aggregates;
+            std::vector<bool> tombstones;
 
             /**
              * Constructs a BTreeNode. The vectors will reserve to avoid
-             * reallocations.
+             * reallocations; only the ones of the node's kind get room.
+             * @param is_leaf Whether the node is a leaf.
+             * @param order The node's order: the tree's order for a leaf,
+             * its inner order otherwise.
              */
-            BTreeNode(bool is_leaf, unsigned int order) : is_leaf(is_leaf)
+            BTreeNode(bool is_leaf, unsigned int order)
+                : is_leaf(is_leaf), parent(nullptr), next(nullptr)
             {
-                elements.reserve(order + 1);
-                children.reserve(order + 2);
+                if (is_leaf) {
+                    elements.reserve(order + 1);
+                } else {
+                    keys.reserve(order + 1);
+                    children.reserve(order + 2);
+                }
             }
 
             /**
              * Constructs a BTreeNode based on another. Only copies over
-             * the elements and is_leaf information.
+             * the elements, keys and is_leaf information (and the filter and
+             * key page derived from them), not the links to other nodes.
              */
             BTreeNode(const BTreeNode& other)
-                : is_leaf(other.is_leaf), elements(other.elements)
+                : is_leaf(other.is_leaf), parent(nullptr), next(nullptr),
+                  elements(other.elements), keys(other.keys),
+                  filter(other.filter),
+                  key_page(other.key_page), counts(other.counts),
+                  aggregates(other.aggregates), tombstones(other.tombstones)
             {
             }
 
@@ -194,15 +254,19 @@ class BTree
                                                 const BTreeNode& n)
             {
                 std::string node_str;
-                node_str.reserve(2 * (4 * n.elements.size() + 1));
+                std::vector<K> keys = n.keys;
                 for (auto& elem : n.elements) {
+                    keys.push_back(elem.key);
+                }
+                node_str.reserve(2 * (4 * keys.size() + 1));
+                for (auto& key : keys) {
                     std::stringstream temp;
-                    temp << elem.key;
+                    temp << key;
                     node_str += "| ";
                     node_str += temp.str();
                     node_str += " ";
                 }
-                if (!n.elements.empty()) {
+                if (!keys.empty()) {
                     node_str += "|";
                 }
                 node_str += "\n";
@@ -223,15 +287,221 @@ class BTree
             ~BTreeNode()
             {
                 elements.clear();
+                keys.clear();
                 children.clear();
 
                 elements.shrink_to_fit();
+                keys.shrink_to_fit();
                 children.shrink_to_fit();
             }
         };
 
+        /**
+         * A breakdown of the heap memory held by a BTree, in bytes.
+         */
+        struct MemoryUsage {
+            /** Number of nodes and of key / value pairs in the tree. */
+            size_t node_count;
+            size_t entry_count;
+            /** The BTreeNode objects themselves. */
+            size_t node_bytes;
+            /** Leaf element slots in use, plus heap memory owned by the keys
+             * and values (e.g. the buffers of long strings). */
+            size_t payload_bytes;
+            /** Inner node key slots in use, plus heap memory owned by the
+             * separator keys. */
+            size_t separator_bytes;
+            /** Child pointer slots in use. */
+            size_t child_pointer_bytes;
+            /** Leaf Bloom filters. */
+            size_t filter_bytes;
+            /** Key pages, including their unused capacity. */
+            size_t key_page_bytes;
+            /** Subtree counts, including their unused capacity. */
+            size_t count_bytes;
+            /** Subtree aggregates, including their unused capacity. */
+            size_t aggregate_bytes;
+            /** Tombstone bits, including their unused capacity. */
+            size_t tombstone_bytes;
+            /** Element, key and child slots reserved but not in use. */
+            size_t unused_capacity_bytes;
+            /** Malloc headers and rounding of every block above. */
+            size_t allocator_overhead_bytes;
+
+            MemoryUsage()
+                : node_count(0), entry_count(0), node_bytes(0),
+                  payload_bytes(0), separator_bytes(0),
+                  child_pointer_bytes(0), filter_bytes(0),
+                  key_page_bytes(0), count_bytes(0), aggregate_bytes(0),
+                  tombstone_bytes(0),
+                  unused_capacity_bytes(0), allocator_overhead_bytes(0)
+            {
+            }
+
+            /**
+             * @return The total number of bytes held by the tree.
+             */
+            size_t total() const
+            {
+                return node_bytes + payload_bytes + separator_bytes
+                       + child_pointer_bytes + filter_bytes + key_page_bytes
+                       + count_bytes + aggregate_bytes + tombstone_bytes
+                       + unused_capacity_bytes + allocator_overhead_bytes;
+            }
+        };
+
+        /**
+         * Cumulative counts of the structural changes made to a BTree since
+         * it was constructed (or since reset_counters()).
+         */
+        struct StructureCounters {
+            size_t splits;
+            size_t merges;
+            size_t borrows;
+            size_t root_grows;
+            size_t root_shrinks;
+            /** Inserts that took the append fast path. */
+            size_t appends;
+
+            StructureCounters()
+                : splits(0), merges(0), borrows(0), root_grows(0),
+                  root_shrinks(0), appends(0)
+            {
+            }
+        };
+
+        /**
+         * A summary of the shape of a BTree. Fill factors are a node's
+         * pair or separator count over the most it can hold (order - 1 for
+         * leaves, inner_order - 1 for inner nodes).
+         */
+        struct TreeStats {
+            /** Number of buckets in the fill factor histograms. */
+            static const size_t FILL_BUCKETS = 10;
+
+            size_t height;
+            /** Node counts per level, root level first. */
+            std::vector<size_t> nodes_per_level;
+            size_t leaf_count;
+            size_t inner_count;
+            /** Live pairs, and lazily removed ones still taking up room. */
+            size_t entry_count;
+            size_t tombstone_count;
+            double avg_leaf_keys;
+            double avg_inner_keys;
+            double avg_leaf_fill;
+            double avg_inner_fill;
+            /** Bucket i counts the nodes with a fill factor in
+             * [i / FILL_BUCKETS, (i + 1) / FILL_BUCKETS); full nodes land in
+             * the last bucket. */
+            std::vector<size_t> leaf_fill_histogram;
+            std::vector<size_t> inner_fill_histogram;
+            StructureCounters counters;
+
+            TreeStats()
+                : height(0), leaf_count(0), inner_count(0), entry_count(0),
+                  tombstone_count(0), avg_leaf_keys(0.0), avg_inner_keys(0.0),
+                  avg_leaf_fill(0.0), avg_inner_fill(0.0),
+                  leaf_fill_histogram(FILL_BUCKETS, 0),
+                  inner_fill_histogram(FILL_BUCKETS, 0)
+            {
+            }
+
+            /**
+             * Printing operator for TreeStats, one fact per line.
+             * @param out The ostream to be written to.
+             * @param stats The stats to be printed.
+             * @return The modified ostream.
+             */
+            inline friend std::ostream& operator<<(std::ostream& out,
+                                                   const TreeStats& stats)
+            {
+                out << "height: " << stats.height << "\nnodes per level:";
+                for (auto count : stats.nodes_per_level) {
+                    out << " " << count;
+                }
+                out << "\nentries: " << stats.entry_count
+                    << " (tombstones " << stats.tombstone_count << ")"
+                    << "\nleaves: " << stats.leaf_count
+                    << " (avg keys " << stats.avg_leaf_keys
+                    << ", avg fill " << stats.avg_leaf_fill << ")"
+                    << "\ninner nodes: " << stats.inner_count
+                    << " (avg keys " << stats.avg_inner_keys
+                    << ", avg fill " << stats.avg_inner_fill << ")"
+                    << "\nleaf fill histogram:";
+                for (auto count : stats.leaf_fill_histogram) {
+                    out << " " << count;
+                }
+                out << "\ninner fill histogram:";
+                for (auto count : stats.inner_fill_histogram) {
+                    out << " " << count;
+                }
+                out << "\nsplits: " << stats.counters.splits
+                    << ", merges: " << stats.counters.merges
+                    << ", borrows: " << stats.counters.borrows
+                    << ", root grows: " << stats.counters.root_grows
+                    << ", root shrinks: " << stats.counters.root_shrinks
+                    << ", appends: " << stats.counters.appends
+                    << "\n";
+                return out;
+            }
+        };
+
+        /**
+         * A cached root-to-leaf path for the hinted insert and find: the
+         * nodes last descended through and the separators bounding each.
+         * Hinted calls start from the lowest node on the path whose bounds
+         * contain their key, so runs of nearby keys skip most of the
+         * descent. A hint remembers the structure version it was taken at
+         * and is dropped by any call after a split, borrow or merge, so a
+         * stale hint is safe to pass; it must not outlive its tree.
+         */
+        struct Hint {
+            struct Step {
+                BTreeNode* node;
+                /** The separators bounding node's keys, nullptr if none. */
+                const K* lo;
+                const K* hi;
+                /** The index of the child taken next, for inner nodes. */
+                size_t child;
+            };
+
+            const BTree* tree;
+            uint64_t version;
+            std::vector<Step> path;
+
+            Hint() : tree(nullptr), version(0)
+            {
+            }
+        };
+
         unsigned int order;
+        /** The order of inner nodes, which hold up to inner_order - 1
+         * separators as leaves hold up to order - 1 pairs. It is larger than
+         * order, since a separator takes no room for a value; see
+         * inner_order_for(). */
+        unsigned int inner_order;
         BTreeNode* root;
+        StructureCounters counters;
+        bool leaf_filters;
+        bool key_pages;
+        bool subtree_counts;
+        /** The aggregate's combine function, empty if none is set. */
+        std::function<V(const V&, const V&)> aggregate_combine;
+        V aggregate_identity;
+        /** Bumped by every change that moves separators or frees nodes. */
+        uint64_t structure_version;
+        bool lazy_remove;
+        double purge_ratio;
+        /** The tombstone count past which remove() runs compaction
+         * slices. */
+        size_t purge_threshold;
+        size_t tombstone_count;
+        /** Where the next compact() slice resumes: the level whose nodes it
+         * packs, leaves being level 0, and a key in the next group to pack,
+         * or no key to start from the left. */
+        size_t compact_level;
+        std::vector<K> compact_cursor;
 
   //public:
     /**
@@ -252,15 +522,44 @@ class BTree
      */
     BTree(const BTree& other);
 
+    /**
+     * Constructs a BTree by taking over another's nodes and settings,
+     * leaving the other one empty.
+     * @param other The BTree to move from.
+     */
+    BTree(BTree&& other);
+
+    /**
+     * Constructs a BTree as a deep copy of another, copying disjoint
+     * subtrees on several threads.
+     * @param other The BTree to copy.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     */
+    BTree(const BTree& other, unsigned int threads);
+
     /**
      * Performs checks to make sure the BTree is valid. Specifically
      * it will check to make sure that an in-order traversal of the tree
      * will result in a sorted sequence of keys. Also verifies that each
-     * BTree node doesn't have more nodes than its order.
+     * BTree node doesn't have more nodes than its order (inner nodes: the
+     * inner order that goes with it), that the leaves are chained in order
+     * and, if subtree counts are on, that they are right.
      * @return true if it satisfies the conditions, false otherwise.
      */
     bool is_valid(unsigned int order = 64) const;
 
+    /**
+     * is_valid() with the subtrees below the top few levels checked on
+     * several threads.
+     * @param order The order the BTree should satisfy.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     * @return true if it satisfies the conditions, false otherwise.
+     */
+    bool is_valid_parallel(unsigned int order = 64,
+                           unsigned int threads = 0) const;
+
     /**
      * Destroys a BTree.
      */
@@ -278,9 +577,27 @@ class BTree
      */
     void clear();
 
+    /**
+     * Clears the BTree of all data, freeing disjoint subtrees on several
+     * threads.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     */
+    void clear_parallel(unsigned int threads = 0);
+
+    /**
+     * Empties the BTree at once and hands its nodes to a new thread to
+     * free. The BTree can be used again right away; the thread touches
+     * nothing but the old nodes, so it may outlive the BTree.
+     * @return The thread freeing the nodes, to be joined or detached.
+     */
+    std::thread clear_in_background();
+
     /**
      * Inserts a key and value into the BTree. If the key is already in the
-     * tree do nothing.
+     * tree do nothing. A key greater than every key in the tree is appended
+     * to the rightmost leaf without searching, and splits it causes leave
+     * the left node full, so ascending inserts build full nodes.
      * @param key The key to insert.
      * @param value The value to insert.
      */
@@ -293,8 +610,363 @@ class BTree
      */
     V find(const K& key) const;
 
-    //remove
-    void remove(K& key);
+    /**
+     * Inserts a key and value, starting from a hint instead of the root.
+     * A key inside the hinted leaf's bounds that fits without a split costs
+     * one node search; anything else falls back to insert(key, value).
+     * @param hint A hint from earlier hinted calls (or a new one), updated
+     * to the path to key.
+     * @param key The key to insert.
+     * @param value The value to insert.
+     */
+    void insert(Hint& hint, const K& key, const V& value);
+
+    /**
+     * Finds the value associated with a key, starting from a hint instead
+     * of the root.
+     * @param hint A hint from earlier hinted calls (or a new one), updated
+     * to the path to key.
+     * @param key The key to look up.
+     * @return The value (if found), the default V if not.
+     */
+    V find(Hint& hint, const K& key) const;
+
+    /**
+     * Replaces the value associated with a key already in the BTree.
+     * @param key The key to look up.
+     * @param value The new value for key.
+     * @return true if key was present (and updated), false otherwise.
+     */
+    bool update(const K& key, const V& value);
+
+    /**
+     * Removes a key and its value from the BTree. If the key is not in the
+     * tree do nothing.
+     * @param key The key to remove.
+     */
+    void remove(const K& key);
+
+    /**
+     * Removes all keys k with lo <= k <= hi and their values. Subtrees that
+     * lie wholly inside the range are freed without visiting their pairs,
+     * only the nodes on the paths to lo and hi are trimmed, and the tree is
+     * rebalanced once along those two paths at the end.
+     * @param lo The smallest key to remove.
+     * @param hi The largest key to remove.
+     * @return The number of pairs removed.
+     */
+    size_t erase_range(const K& lo, const K& hi);
+
+    /**
+     * Moves every pair of another BTree into this one, leaving the other
+     * empty. If the two key ranges do not overlap and the orders match, the
+     * shorter tree is hung off the spine of the taller one in O(log n).
+     * Otherwise both trees are merged in key order and rebuilt with
+     * bulk_load()'s bottom-up build. On a shared key this tree's value is
+     * kept. The other tree's nodes are brought in line with this tree's
+     * filter, key page, count and aggregate settings; if both trees have an
+     * aggregate, they are assumed to be the same one.
+     * @param other The BTree to merge in.
+     */
+    void merge(BTree&& other);
+
+    /**
+     * Cuts the BTree in two along the path to a key in O(log n): every
+     * node on the path is split in two, and the two spines are then
+     * rebalanced. Lazily removed pairs are purged first.
+     * @param key The smallest key to move out.
+     * @return A BTree with the same settings holding all pairs whose keys
+     * are not less than key; this one keeps the rest.
+     */
+    BTree split_at(const K& key);
+
+    /**
+     * Visits, in ascending key order, up to count pairs whose keys are not
+     * less than lo.
+     * @param lo The smallest key to visit.
+     * @param count The maximum number of pairs to visit.
+     * @param visit Callable invoked as visit(key, value) for each pair.
+     * @return The number of pairs visited.
+     */
+    template <class F>
+    size_t scan(const K& lo, size_t count, F visit) const;
+
+    /**
+     * Visits all pairs whose keys k satisfy lo <= k <= hi on several
+     * threads. The range is cut at inner node separators into chunks of
+     * whole subtrees; each chunk is visited in ascending key order, but
+     * chunks run concurrently, so visit must be safe to call from several
+     * threads at once. Use parallel_reduce() when order across chunks
+     * matters.
+     * @param lo The smallest key to visit.
+     * @param hi The largest key to visit.
+     * @param visit Callable invoked as visit(key, value) for each pair.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     */
+    template <class F>
+    void parallel_scan(const K& lo, const K& hi, F visit,
+                       unsigned int threads = 0) const;
+
+    /**
+     * Maps every pair whose key k satisfies lo <= k <= hi and combines the
+     * results in key order, on several threads. Each chunk of the range is
+     * folded left to right, and the chunks' results are then folded in key
+     * order, so combine need only be associative, not commutative.
+     * @param lo The smallest key to include.
+     * @param hi The largest key to include.
+     * @param map Callable invoked as map(key, value), returning an R.
+     * @param combine Callable invoked as combine(a, b) on two Rs, a
+     * covering keys before b.
+     * @param identity The result of no pairs, e.g. 0 for a sum.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     * @return The combined result, or identity if no key is in range.
+     */
+    template <class R, class M, class C>
+    R parallel_reduce(const K& lo, const K& hi, M map, C combine,
+                      const R& identity, unsigned int threads = 0) const;
+
+    /**
+     * Finds the pairs whose keys k satisfy lo <= k <= hi and whose values
+     * v satisfy "v op bound", for arithmetic value types. Each leaf's
+     * values are compared up to 64 at a time into a bit mask, with SSE2
+     * where the pair layout allows it, and only the matches are copied
+     * out. Matches are handed over in key order, in batches.
+     * @param lo The smallest key to include.
+     * @param hi The largest key to include.
+     * @param op How values are compared against bound.
+     * @param bound The value to compare against.
+     * @param emit Callable invoked as emit(keys, values, count) with
+     * pointers to the keys and values of up to batch matches.
+     * @param batch The most matches per call to emit; at least 1.
+     * @return The number of matches.
+     */
+    template <class F>
+    size_t scan_where(const K& lo, const K& hi, ValueCompare op,
+                      const V& bound, F emit, size_t batch = 256) const;
+
+    /**
+     * Builds an immutable, pointer free copy of the BTree's current
+     * contents, laid out for fast lookups and scans and for saving to a
+     * file (see frozen_btree.h). The BTree itself is unchanged. K and V
+     * must be trivially copyable.
+     * @return The frozen copy.
+     */
+    FrozenBTree<K, V> freeze() const;
+
+    /**
+     * Replaces the contents of the BTree with the given pairs, building it
+     * bottom up: full leaves first, then each level of inner nodes above
+     * them. Much faster than inserting the pairs one at a time, and leaves
+     * every node as full as the order allows. Already sorted input is
+     * detected and not sorted again; of several pairs with the same key,
+     * the first one is kept.
+     * @param pairs The key / value pairs, in any order.
+     */
+    void bulk_load(std::vector<std::pair<K, V>> pairs);
+
+    /**
+     * bulk_load() spread over several threads. The input is sorted in
+     * per-thread chunks that are then merged pairwise, duplicates are
+     * dropped and the leaves built by each thread for its own stretch of
+     * keys; only the inner levels, a small fraction of the nodes, are
+     * built by the calling thread. Builds the same tree as bulk_load(),
+     * give or take how pairs are spread over the leaves.
+     * @param pairs The key / value pairs, in any order.
+     * @param threads The number of threads to use, or 0 for every thread
+     * of the shared ThreadPool.
+     */
+    void bulk_load_parallel(std::vector<std::pair<K, V>> pairs,
+                            unsigned int threads = 0);
+
+    /**
+     * Inserts a batch of pairs. The batch is sorted, then merged into the
+     * tree in one walk: each leaf takes its whole run of new keys in a
+     * single merge pass, and a node that overflows is cut into as many
+     * nodes as it needs at once. Keys already in the tree keep their
+     * values; of several pairs in the batch with the same key, the first
+     * one is inserted.
+     * @param first The first std::pair<K, V> of the batch.
+     * @param last One past the last pair of the batch.
+     */
+    template <class Iter>
+    void insert_batch(Iter first, Iter last);
+
+    /**
+     * Writes the BTree's pairs and settings (order, leaf filters, key
+     * pages) to a snapshot file (see snapshot.h). K and V must be
+     * trivially copyable or std::string. The file is written under a
+     * temporary name and renamed into place, so an existing snapshot is
+     * only replaced by a complete one.
+     * @param path The file to write.
+     * @throws std::runtime_error if the file cannot be written.
+     */
+    void save(const std::string& path) const;
+
+    /**
+     * Replaces the contents and settings of the BTree with those of a
+     * snapshot written by save(), using the bulk_load() build rather than
+     * inserting pair by pair. The BTree is unchanged if loading fails.
+     * @param path The file to read.
+     * @throws std::runtime_error if the file cannot be read, is not a
+     * snapshot of a BTree with these key and value types, or is corrupt.
+     */
+    void load(const std::string& path);
+
+    /**
+     * Measures the heap memory held by the BTree by walking every node.
+     * @return A breakdown of the memory in use.
+     */
+    MemoryUsage memory_usage() const;
+
+    /**
+     * Summarizes the shape of the BTree: height, nodes per level, fill
+     * factors of leaves and inner nodes, and the structural change counters.
+     * @return The statistics.
+     */
+    TreeStats stats() const;
+
+    /**
+     * Zeroes the structural change counters reported by stats().
+     */
+    void reset_counters();
+
+    /**
+     * Turns the per-leaf Bloom filters on or off. While on, every leaf keeps
+     * a filter of about eight bits per key slot, so a find for a missing key
+     * usually stops at the leaf without searching its elements. Filters are
+     * kept conservative through splits, borrows and merges; keys removed
+     * from a leaf stay in its filter until the leaf is next rebuilt. Keys
+     * are hashed with std::hash<K>.
+     * @param enabled Whether leaves should carry filters.
+     * @return false if filters were asked for but K has no std::hash, in
+     * which case they stay off.
+     */
+    bool set_leaf_filters(bool enabled);
+
+    /**
+     * Turns per-node key pages on or off. For key types that have a compact
+     * image (see key_page.h; e.g. std::string, whose nodes get a slotted
+     * page of prefix-compressed key bytes), in-node searches then run over
+     * the page instead of the DataPairs. Other key types are unaffected.
+     * Pages are rebuilt whenever a node's elements change, trading insert
+     * and remove time and memory for faster searches.
+     * @param enabled Whether nodes should carry key pages.
+     */
+    void set_key_pages(bool enabled);
+
+    /**
+     * Turns subtree counts on or off. While on, every inner node keeps the
+     * number of pairs under each of its children, which insert, remove and
+     * every split, borrow and merge keep up to date. rank(), select(),
+     * count() and size() then take O(log n) node visits instead of walking
+     * the leaves.
+     * @param enabled Whether inner nodes should carry subtree counts.
+     */
+    void set_subtree_counts(bool enabled);
+
+    /**
+     * Turns lazy removal on or off. While on, remove() only marks a pair as
+     * a tombstone, updating the counts and aggregates above it but never
+     * borrowing or merging. Finds, scans and the order statistics skip
+     * tombstones; re-inserting a tombstoned key revives its slot, and an
+     * insert into a full leaf reclaims the leaf's tombstones before it
+     * splits. By default the rest is left to the caller, who can run
+     * purge() or compact() slices when the tree is idle. Given a
+     * purge_ratio, once there are more tombstones than purge_ratio times the
+     * pairs in the tree at the end of the last pass, each remove() also runs
+     * one small compact() slice. Tombstones are then reclaimed a few nodes
+     * at a time rather than in one pass over the tree. Turning lazy removal
+     * off purges.
+     * @param enabled Whether remove() should leave tombstones.
+     * @param purge_ratio The tombstone ratio past which remove() runs
+     * compaction slices, or 0 to leave purging to the caller.
+     */
+    void set_lazy_remove(bool enabled, double purge_ratio = 0);
+
+    /**
+     * Drops every tombstone and restores the minimum size of the nodes
+     * that leaves underfull, bottom up in a single pass over the tree.
+     * @return The number of tombstones dropped.
+     */
+    size_t purge();
+
+    /**
+     * Repacks sparse nodes to a target fill factor, a bounded slice at a
+     * time. A pass goes up the tree a level at a time, leaves first, and
+     * walks each level left to right in groups of siblings. A group whose
+     * contents fit in fewer nodes is moved into freshly allocated ones,
+     * laid out left to right. The old nodes are freed. Where it stopped
+     * is kept between calls, so slices can be interleaved with other
+     * operations.
+     * @param fill The fraction of a node's capacity (order - 1 pairs for a
+     * leaf, inner_order - 1 separators for an inner node) to fill nodes
+     * to. It is clamped so that no node ends up below the minimum fill.
+     * @param budget Roughly the most nodes to visit in this slice. At least
+     * one group is visited per call.
+     * @return true if this slice finished a pass; the next call then
+     * starts a new one.
+     */
+    bool compact(double fill = 1.0, size_t budget = SIZE_MAX);
+
+    /**
+     * @return The number of pairs in the BTree.
+     */
+    size_t size() const;
+
+    /**
+     * @param key A key, which need not be in the BTree.
+     * @return The number of keys in the BTree less than key.
+     */
+    size_t rank(const K& key) const;
+
+    /**
+     * Finds a pair by its position in key order, e.g. for percentiles or
+     * pagination.
+     * @param idx The number of smaller keys the pair has.
+     * @return The pair with the idx-th smallest key (counting from 0), or a
+     * default pair if idx >= size().
+     */
+    std::pair<K, V> select(size_t idx) const;
+
+    /**
+     * @param lo The smallest key to count.
+     * @param hi The largest key to count.
+     * @return The number of keys k in the BTree with lo <= k <= hi.
+     */
+    size_t count(const K& lo, const K& hi) const;
+
+    /**
+     * Sets the aggregate that aggregate() computes, e.g. a sum, min or max
+     * of the values. While set, every inner node keeps the aggregate of the
+     * values under each of its children, which insert, remove, update and
+     * every split, borrow and merge keep up to date by recombining the
+     * children of the nodes they change.
+     * @param combine An associative function; combine(a, b) aggregates the
+     * values of a key range from those of its left part a and its right
+     * part b. It need not be commutative.
+     * @param identity The aggregate of no values, e.g. 0 for a sum.
+     */
+    void set_aggregate(std::function<V(const V&, const V&)> combine,
+                       const V& identity);
+
+    /**
+     * Drops the aggregate set by set_aggregate(), and the per node
+     * aggregates with it.
+     */
+    void clear_aggregate();
+
+    /**
+     * Combines, in key order, the values of all keys k with lo <= k <= hi.
+     * Whole subtrees inside the range contribute their stored aggregate,
+     * so only the nodes on the paths to lo and hi are visited.
+     * @param lo The smallest key to include.
+     * @param hi The largest key to include.
+     * @return The aggregate, or the identity if no key is in range.
+     * @throws std::logic_error if no aggregate is set.
+     */
+    V aggregate(const K& lo, const K& hi) const;
 
     //print_tree
     void print();
@@ -302,12 +974,55 @@ class BTree
 
 
   public:
+    /**
+     * The order of the inner nodes of a tree of a given order. Leaves and
+     * inner nodes are given the same room: as many key and child pointer
+     * slots as fit in the bytes of order - 1 DataPairs and order child
+     * pointers. Separators have no value and are cut short by
+     * shortest_separator(), so the room a value took buys fan-out instead.
+     * @param order A tree's order.
+     * @return The order of its inner nodes, at least order.
+     */
+    static unsigned int inner_order_for(unsigned int order);
+
+    /**
+     * @param node A node.
+     * @return The number of pairs in node if it is a leaf, or of separators
+     * if it is an inner node.
+     */
+    static size_t node_size(const BTreeNode* node);
+
+    /**
+     * @param node A node.
+     * @return order for a leaf, inner_order for an inner node. A node is
+     * split once its size reaches it.
+     */
+    size_t node_order(const BTreeNode* node) const;
+
+    /**
+     * @param node A node.
+     * @return The fewest pairs or separators node may have unless it is the
+     * root, (node_order(node) - 1) / 2.
+     */
+    size_t min_size(const BTreeNode* node) const;
+
     /**
      * Private recursive version of the insert function.
      * @param subroot A reference of a pointer to the current BTreeNode.
      * @param pair The DataPair to be inserted.
+     * @param past_end Whether pair.key is greater than every key in the
+     * tree; passed on to split_child.
+     * @return true if the pair was inserted, false if its key was present.
+     */
+    bool insert(BTreeNode* subroot, const DataPair& pair,
+                bool past_end = false);
+
+    /**
+     * The insert fast path for a key past the end of the tree.
+     * @param last The rightmost leaf, which must have room for pair.
+     * @param pair The DataPair to append.
      */
-    void insert(BTreeNode* subroot, const DataPair& pair);
+    void append(BTreeNode* last, const DataPair& pair);
 
     /**
      * Private recursive version of the find function.
@@ -318,29 +1033,179 @@ class BTree
     V find(const BTreeNode* subroot, const K& key) const;
 
     /**
-     * Private recursive version of the find function.
-     * @param subroot A reference of a pointer to the current BTreeNode.
+     * Private recursive version of the remove function. Leaves every child
+     * it descended into with at least min_size() elements or separators.
+     * @param subroot A pointer to the current BTreeNode.
+     * @param key The key to remove.
+     * @return true if the key was found and removed.
+     */
+    bool remove(BTreeNode* subroot, const K& key);
+
+    /**
+     * Finds the leaf that holds, or would hold, a key from a hint: walks up
+     * the hinted path to the lowest node whose bounds contain key and
+     * descends from there, or from the root if the hint is stale.
+     * @param hint The hint, updated to the path to key.
      * @param key The key we are looking up.
-     * @return The value (if found), the default V if not.
+     * @return The leaf, or nullptr if the tree is empty.
      */
-    void remove(BTreeNode* subroot, K& key, std::vector<size_t> before_idxs);
+    BTreeNode* seek(Hint& hint, const K& key) const;
+
+    /**
+     * Descends from the root to the leaf that holds, or would hold, a key.
+     * @param key The key we are looking up.
+     * @return The leaf, or nullptr if the tree is empty.
+     */
+    BTreeNode* find_leaf(const K& key) const;
 
     /**
      * Splits a child node of a BTreeNode. Called if the child became too
      * large. Modifies the parent such that children[child_idx] contains
      * half as many elements as before, and similarly for
-     * children[child_idx + 1] (which is a new BTreeNode*).
+     * children[child_idx + 1] (which is a new BTreeNode*). A leaf keeps all
+     * of its pairs and a separator for the two halves is added to parent; an
+     * inner node moves its median separator up into parent.
      * @param parent The parent whose child we are trying to split.
      * @param child_idx The index of the child in its parent's children
      * vector
+     * @param past_end Whether the split was caused by a key past the end
+     * of the tree, in which case the child keeps all but its last pair (or
+     * last two children) instead of half.
+     */
+    void split_child(BTreeNode* parent, size_t child_idx,
+                     bool past_end = false);
+
+    /**
+     * Private recursive version of the insert_batch function. Leaves any
+     * child it inserted into no larger than the order allows; splitting
+     * the node itself is the caller's job.
+     * @param subroot A pointer to the current BTreeNode.
+     * @param first The first pair of the sorted, duplicate free run of
+     * pairs whose keys belong under subroot.
+     * @param last One past the last pair of the run.
+     * @return The number of pairs inserted.
+     */
+    size_t insert_batch(BTreeNode* subroot,
+                        typename std::vector<DataPair>::iterator first,
+                        typename std::vector<DataPair>::iterator last);
+
+    /**
+     * Splits a child node that may be any number of times too large into
+     * as few nodes as hold its elements, filled evenly, and adds them and
+     * their separators to the parent. Leaves cut their pairs into runs;
+     * inner nodes move one separator up between each two pieces.
+     * @param parent The parent whose child we are trying to split.
+     * @param child_idx The index of the child in its parent's children
+     * vector.
+     */
+    void split_child_many(BTreeNode* parent, size_t child_idx);
+
+    /**
+     * Replaces the tree with one built bottom up from pairs.
+     * @param pairs The key / value pairs, sorted by key with no duplicates.
+     */
+    void build_sorted(const std::vector<std::pair<K, V>>& pairs);
+
+    /**
+     * Runs task(0) ... task(count - 1) as tasks on the shared ThreadPool;
+     * task(0) runs on the calling thread. Returns once all are done.
+     * @param count The number of tasks.
+     * @param task Callable invoked as task(i).
      */
-    void split_child(BTreeNode* parent, size_t child_idx);
+    template <class F>
+    static void run_parallel(size_t count, F task);
+
+    /**
+     * Runs body(0) ... body(count - 1) on the shared ThreadPool, split into
+     * at most threads contiguous runs.
+     * @param count The number of items.
+     * @param threads The number of runs to split the items into.
+     * @param body Callable invoked as body(i).
+     */
+    template <class F>
+    static void parallel_for(size_t count, unsigned int threads, F body);
+
+    /**
+     * @param threads A requested number of threads, or 0.
+     * @return threads, or if it is 0 the number of threads of the shared
+     * ThreadPool, counting the calling thread.
+     */
+    static unsigned int thread_count(unsigned int threads);
+
+    /**
+     * Finds the shallowest level of a subtree with at least width nodes,
+     * or its leaves if there is none, to hand out to threads.
+     * @param subroot A pointer to the root of the subtree.
+     * @param width The number of nodes wanted.
+     * @param depth Set to the depth of the level below subroot.
+     * @return The nodes of the level, in key order.
+     */
+    static std::vector<BTreeNode*> frontier(BTreeNode* subroot, size_t width,
+                                            size_t& depth);
+
+    /**
+     * Cuts a key range into chunks of whole subtrees, descending a level
+     * at a time until at least width chunks span the range or the leaves
+     * are reached.
+     * @param lo The smallest key of the range.
+     * @param hi The largest key of the range.
+     * @param width The number of chunks wanted.
+     * @return The separators that start every chunk but the first, in
+     * ascending order; all lie in (lo, hi].
+     */
+    std::vector<K> range_cuts(const K& lo, const K& hi, size_t width) const;
+
+    /**
+     * Visits, in ascending key order, the pairs whose keys k satisfy
+     * from <= k and either k < *to or, if to is nullptr, k <= hi.
+     * @param from The smallest key to visit.
+     * @param to The key to stop before, or nullptr.
+     * @param hi The largest key to visit when to is nullptr.
+     * @param visit Callable invoked as visit(key, value) for each pair.
+     */
+    template <class F>
+    void scan_chunk(const K& from, const K* to, const K& hi, F& visit) const;
+
+    /**
+     * Builds the inner levels above a row of linked leaves.
+     * @param level The leaves, in key order.
+     * @return The root of the tree.
+     */
+    BTreeNode* build_levels(std::vector<BTreeNode*> level);
 
     /**
      * Private recursive version of the clear function.
      * @param subroot A pointer to the current node being cleared.
      */
-    void clear(BTreeNode* subroot);
+    static void clear(BTreeNode* subroot);
+
+    /**
+     * Frees the nodes of a subtree that lie above a given depth; the ones
+     * at that depth are left to the caller.
+     * @param subroot A pointer to the root of the subtree.
+     * @param depth The depth, below subroot, of the nodes to leave.
+     */
+    static void clear_above(BTreeNode* subroot, size_t depth);
+
+    /**
+     * Copies a subtree on several threads.
+     * @param subroot A pointer to the root of the subtree to copy.
+     * @param threads The number of threads to use.
+     * @return The copy, with its leaves chained.
+     */
+    BTreeNode* copy_parallel(const BTreeNode* subroot, unsigned int threads);
+
+    /**
+     * Copies the nodes of a subtree that lie above a given depth, taking
+     * the copies of the nodes at that depth, in order, from copies.
+     * @param subroot A pointer to the root of the subtree.
+     * @param depth The depth, below subroot, of the nodes already copied.
+     * @param copies The copies of the nodes at that depth.
+     * @param next The index of the next copy to take; updated.
+     * @return The copy of subroot.
+     */
+    BTreeNode* copy_above(const BTreeNode* subroot, size_t depth,
+                          const std::vector<BTreeNode*>& copies, size_t& next);
 
     /**
      * Private recursive version of the copy function.
@@ -348,6 +1213,61 @@ class BTree
      */
     BTreeNode* copy(const BTreeNode* subroot);
 
+    /**
+     * Chains the leaves of a subtree in key order, e.g. after copying it.
+     * @param subroot A pointer to the root of the subtree.
+     * @param prev The last leaf linked so far, or nullptr; updated to the
+     * last leaf of the subtree.
+     */
+    void link_leaves(BTreeNode* subroot, BTreeNode*& prev);
+
+    /**
+     * Checks that following next from the leftmost leaf visits exactly the
+     * leaves of the tree, in order.
+     * @return true if the leaf chain is intact, false otherwise.
+     */
+    bool leaves_linked() const;
+
+    /**
+     * Checks that following next from a subtree's leftmost leaf visits
+     * exactly its leaves, in order, and then goes on to a given leaf.
+     * @param subroot A pointer to the root of the subtree.
+     * @param next The leaf that should follow the subtree's last leaf.
+     * @return true if the subtree's leaf chain is intact, false otherwise.
+     */
+    bool leaves_linked(const BTreeNode* subroot, const BTreeNode* next) const;
+
+    /**
+     * What is_valid_parallel() learns about one subtree on its own: whether
+     * it is valid, its size if subtree counts are on, and its keys and
+     * separators in order.
+     */
+    struct SubtreeCheck {
+        bool valid;
+        size_t size;
+        std::vector<DataPair> data;
+    };
+
+    /**
+     * Checks the nodes of a subtree that lie above a given depth, given
+     * checks of the nodes at that depth. Collects the separators and the
+     * first and last key of each checked subtree, in order, so that the
+     * caller can check they are sorted.
+     * @param subroot A pointer to the root of the subtree.
+     * @param depth The depth, below subroot, of the checked nodes.
+     * @param order The order the BTree should satisfy.
+     * @param checks The checks of the nodes at that depth, in order.
+     * @param next The index of the next check to use; updated.
+     * @param outline The separators and subtree bounds; appended to.
+     * @param size Set to the number of pairs under subroot.
+     * @return true if the nodes above the depth are valid and so are the
+     * checked subtrees, false otherwise.
+     */
+    bool is_valid_above(const BTreeNode* subroot, size_t depth,
+                        unsigned int order,
+                        const std::vector<SubtreeCheck>& checks, size_t& next,
+                        std::vector<DataPair>& outline, size_t& size) const;
+
     /**
      * Private recursive version of the is_valid function.
      * @param subroot A pointer to the current node being checked for
@@ -357,24 +1277,320 @@ class BTree
     bool is_valid(const BTreeNode* subroot, std::vector<DataPair>& data,
                   unsigned int order) const;
 
+    /**
+     * Private recursive version of the memory_usage function.
+     * @param subroot A pointer to the current node being measured.
+     * @param usage The totals to add the subtree's memory to.
+     */
+    void memory_usage(const BTreeNode* subroot, MemoryUsage& usage) const;
+
+    /**
+     * Private recursive version of the stats function. Fills in the per
+     * level node counts and the raw sums the averages are computed from.
+     * @param subroot A pointer to the current node.
+     * @param level The depth of subroot, 0 for the root.
+     * @param stats The statistics being collected.
+     * @param leaf_keys The running total of keys held in leaves.
+     * @param inner_keys The running total of keys held in inner nodes.
+     */
+    void stats(const BTreeNode* subroot, size_t level, TreeStats& stats,
+               size_t& leaf_keys, size_t& inner_keys) const;
+
+    /**
+     * Recomputes a node's Bloom filter from its elements, or drops it if
+     * the node is not a leaf or filters are off.
+     * @param node The node whose filter is rebuilt.
+     */
+    void rebuild_filter(BTreeNode* node);
+
+    /**
+     * Recursively rebuilds the filters of every node in a subtree.
+     * @param subroot A pointer to the root of the subtree.
+     */
+    void rebuild_filters(BTreeNode* subroot);
+
+    /**
+     * Adds a key to a leaf's Bloom filter, if it has one.
+     * @param node The leaf.
+     * @param key The key being added to the leaf.
+     */
+    void filter_add(BTreeNode* node, const K& key);
+
+    /**
+     * Checks a leaf's Bloom filter.
+     * @param node The leaf.
+     * @param key The key we are looking up.
+     * @return false if key is definitely not in the leaf, true if it may be
+     * (or if the leaf has no filter).
+     */
+    bool filter_may_contain(const BTreeNode* node, const K& key) const;
+
+    /**
+     * Finds where a key is, or would go, within one node.
+     * @param node The node to search.
+     * @param key The key we are looking up.
+     * @return The index of the first pair or separator whose key is not
+     * less than key, i.e. the same as insertion_idx(node->elements, key) in
+     * a leaf and insertion_idx(node->keys, key) in an inner node.
+     */
+    size_t node_search(const BTreeNode* node, const K& key) const;
+
+    /**
+     * Picks the child of an inner node to descend into for a key.
+     * @param node The inner node.
+     * @param key The key we are looking up.
+     * @return The index of the first separator greater than key.
+     */
+    size_t child_index(const BTreeNode* node, const K& key) const;
+
+    /**
+     * Rebuilds a node's key page after its elements or keys changed, or
+     * drops it if key pages are off.
+     * @param node The node whose elements or keys changed.
+     */
+    void refresh_key_page(BTreeNode* node);
+
+    /**
+     * Recursively refreshes the key pages of every node in a subtree.
+     * @param subroot A pointer to the root of the subtree.
+     */
+    void refresh_key_pages(BTreeNode* subroot);
+
+    /**
+     * @param node A node.
+     * @return The number of pairs under node, from its own counts.
+     */
+    size_t subtree_size(const BTreeNode* node) const;
+
+    /**
+     * Recursively recomputes, or drops if subtree counts are off, the
+     * counts of every node in a subtree.
+     * @param subroot A pointer to the root of the subtree.
+     * @return The number of pairs in the subtree.
+     */
+    size_t rebuild_counts(BTreeNode* subroot);
+
+    /**
+     * Checks the counts of every node in a subtree against its contents.
+     * @param subroot A pointer to the root of the subtree.
+     * @param size Set to the number of pairs in the subtree.
+     * @return true if all counts are right, false otherwise.
+     */
+    bool counts_valid(const BTreeNode* subroot, size_t& size) const;
+
+    /**
+     * @param key A key.
+     * @param inclusive Whether to count keys equal to key as well.
+     * @return The number of keys less than (or equal to) key.
+     */
+    size_t rank(const K& key, bool inclusive) const;
+
+    /**
+     * @param node A node.
+     * @return The aggregate of all values under node, from its own
+     * elements or aggregates.
+     */
+    V summarize(const BTreeNode* node) const;
+
+    /**
+     * Recomputes parent->aggregates[idx] after the values under
+     * parent->children[idx] changed.
+     * @param parent An inner node.
+     * @param idx The index of the changed child.
+     */
+    void refresh_aggregate(BTreeNode* parent, size_t idx);
+
+    /**
+     * Recursively recomputes, or drops if no aggregate is set, the
+     * aggregates of every node in a subtree.
+     * @param subroot A pointer to the root of the subtree.
+     */
+    void rebuild_aggregates(BTreeNode* subroot);
+
+    /**
+     * Private recursive version of the aggregate function.
+     * @param subroot A pointer to the current node.
+     * @param lo The smallest key to include, or nullptr for no bound.
+     * @param hi The largest key to include, or nullptr for no bound.
+     * @return The aggregate of the values in range under subroot.
+     */
+    V aggregate(const BTreeNode* subroot, const K* lo, const K* hi) const;
+
     /**
      * Private reculsize version of the print function
      * @param subroot A reference of a pointer to the current BTreeNode.
     */
     void print(BTreeNode* subroot);
 
-    bool borrow_from_sibilings(BTreeNode* parent, size_t idx, size_t before_idx);
-    bool borrow_from_parent(BTreeNode* parent, size_t idx, size_t before_idx);
-    void remove_and_reconstruct(BTreeNode* parent, size_t idx, std::vector<size_t> before_idxes);
-    void remove_from_leaf(BTreeNode* subroot, size_t idx, std::vector<size_t> before_idxes);
-    void remove_from_inner(BTreeNode* subroot, size_t idx, std::vector<size_t> before_idxes);
+    /**
+     * Restores the minimum size of parent->children[idx] after a removal,
+     * either by borrowing an element through the parent from a sibling that
+     * can spare one, or by merging with a sibling.
+     * @param parent The parent of the underfull child.
+     * @param idx The index of the underfull child in parent->children.
+     */
+    void rebalance_child(BTreeNode* parent, size_t idx);
+
+    /**
+     * Private recursive version of the erase_range function. Leaves the
+     * nodes on the paths to lo and hi as small as they end up, even empty.
+     * @param subroot A pointer to the current node.
+     * @param lo The smallest key to remove, or nullptr for no bound.
+     * @param hi The largest key to remove, or nullptr for no bound.
+     * @return The number of pairs removed.
+     */
+    size_t erase_range(BTreeNode* subroot, const K* lo, const K* hi);
+
+    /**
+     * Frees a subtree.
+     * @param subroot A pointer to the root of the subtree.
+     * @return The number of pairs it held.
+     */
+    size_t erase_subtree(BTreeNode* subroot);
+
+    /**
+     * Walks down the path to a key, borrowing and merging until every
+     * child on it has at least min_size() elements or separators.
+     * @param key The key whose path to fix.
+     * @return true if anything was borrowed or merged.
+     */
+    bool rebalance_path(const K& key);
+
+    /**
+     * Marks the pair with a key as a tombstone.
+     * @param key The key to remove.
+     * @return true if key was present and live.
+     */
+    bool remove_lazily(const K& key);
+
+    /**
+     * @param leaf A leaf.
+     * @param idx An index into leaf->elements.
+     * @return true if leaf->elements[idx] is a tombstone.
+     */
+    bool is_tombstone(const BTreeNode* leaf, size_t idx) const;
+
+    /**
+     * @param leaf A leaf.
+     * @return The number of live pairs in leaf.
+     */
+    size_t live_size(const BTreeNode* leaf) const;
+
+    /**
+     * Erases a leaf's tombstones for good. Leaves the leaf as small as it
+     * ends up, and its subtree counts and aggregates, which only ever
+     * cover live pairs, as they are.
+     * @param leaf A leaf.
+     */
+    void purge_leaf(BTreeNode* leaf);
+
+    /**
+     * Inserts a pair into a leaf that has room for it, reviving the key's
+     * tombstone if it has one. A full leaf is purged first, which may make
+     * room.
+     * @param leaf A leaf.
+     * @param pair The pair to insert.
+     * @return true if the key was not live before.
+     */
+    bool leaf_insert(BTreeNode* leaf, const DataPair& pair);
+
+    /**
+     * Private recursive version of the purge function: purges the leaves,
+     * then rebalances each node's children once theirs are done.
+     * @param subroot A pointer to the current node.
+     */
+    void purge(BTreeNode* subroot);
+
+    /**
+     * Borrows and merges until none of a node's children is below the
+     * minimum fill, or it has a single child left.
+     * @param parent A pointer to an inner node.
+     */
+    void rebalance_children(BTreeNode* parent);
+
+    /**
+     * Rebuilds another tree's per-node data to match this tree's settings.
+     * @param other The BTree whose nodes to bring in line.
+     */
+    void match_settings(BTree& other) const;
+
+    /**
+     * Joins two trees whose key ranges do not overlap into this tree. The
+     * root of the shorter tree becomes a child of the node of the taller
+     * tree's spine one level above it, and that node is then rebalanced or
+     * split.
+     * @param left The root of the tree holding the smaller keys.
+     * @param right The root of the tree holding the larger keys.
+     * @param separator A key between the two trees' keys.
+     * @return The root of the joined tree.
+     */
+    BTreeNode* join(BTreeNode* left, BTreeNode* right, const K& separator);
+
+    /**
+     * Splits a node, and then its ancestors, for as long as they are over
+     * full, growing the tree at the root if need be.
+     * @param node The node to start at.
+     */
+    void split_upward(BTreeNode* node);
+
+    /**
+     * Rebalances the path to a key and shrinks the root until neither
+     * changes anything.
+     * @param key The key whose path to fix.
+     */
+    void rebalance_spine(const K& key);
+
+    /**
+     * Redistributes the contents of a node's children into as few new
+     * nodes as fill allows, if that is fewer than it has now.
+     * @param parent The node whose children to repack.
+     * @param prev The leaf before parent's first child if its children
+     * are leaves, or nullptr.
+     * @param fill The fraction of the children's order - 1 to fill the new
+     * nodes to.
+     * @return true if the children were replaced.
+     */
+    bool repack_children(BTreeNode* parent, BTreeNode* prev, double fill);
+
+    /**
+     * Drops empty roots: an inner root left with a single child is replaced
+     * by that child, and an empty leaf root empties the tree.
+     */
+    void shrink_root();
+
+    /**
+     * Moves the last element of children[idx - 1] to the front of
+     * children[idx]: directly between leaves, or by rotating it through the
+     * separator in parent between inner nodes.
+     * @param parent The parent of both children.
+     * @param idx The index of the child receiving the element.
+     */
+    void borrow_from_left(BTreeNode* parent, size_t idx);
+
+    /**
+     * Moves the first element of children[idx + 1] to the back of
+     * children[idx]: directly between leaves, or by rotating it through the
+     * separator in parent between inner nodes.
+     * @param parent The parent of both children.
+     * @param idx The index of the child receiving the element.
+     */
+    void borrow_from_right(BTreeNode* parent, size_t idx);
+
+    /**
+     * Merges children[idx + 1] into children[idx] and frees
+     * children[idx + 1]. Inner nodes also take in the separator between
+     * them; between leaves it is simply dropped.
+     * @param parent The parent of both children.
+     * @param idx The index of the left child of the pair.
+     */
+    void merge_children(BTreeNode* parent, size_t idx);
 };
 
 template <class T, class C>
 size_t insertion_idx_Helper(const std::vector<T>& elements, int start, int end, const C& val)
 {
   if (start == end - 1 && val > elements[start] && val < elements[end]) return end;
-  T middle = elements[(start + end) / 2];
+  const T& middle = elements[(start + end) / 2];
   if (val == middle) return (start + end) / 2;
   if (val > middle) return insertion_idx_Helper(elements, (start + end)/2, end, val);
   if (val < middle) return insertion_idx_Helper(elements, start, (start + end)/2, val);
@@ -403,6 +1619,40 @@ size_t insertion_idx(const std::vector<T>& elements, const C& val)
     return insertion_idx_Helper(elements, 0, elements.size() - 1, val);
 }
 
+/**
+ * Picks the separator stored in an inner node between two adjacent leaves,
+ * given the largest key of the left leaf and the smallest key of the right.
+ * Any s with left < s <= right routes correctly; the shorter s is, the less
+ * room inner nodes need. The generic version can only use right itself.
+ * Key types with something shorter to offer (e.g. composite keys) can
+ * overload this next to their definition.
+ * @param left The largest key of the left leaf.
+ * @param right The smallest key of the right leaf.
+ * @return A separator for the two leaves.
+ */
+template <class K>
+K shortest_separator(const K& left, const K& right)
+{
+    (void) left;
+    return right;
+}
+
+/**
+ * Suffix truncation for std::string keys: the shortest prefix of right that
+ * still sorts after left, i.e. right cut just past the first byte where the
+ * two differ. E.g. "user/alice/42" and "user/bob/7" are separated by
+ * "user/b".
+ */
+inline std::string shortest_separator(const std::string& left,
+                                      const std::string& right)
+{
+    size_t length = 0;
+    while (length < left.size() && left[length] == right[length]) {
+        length++;
+    }
+    return right.substr(0, length + 1);
+}
+
 #include "btree_given.cpp"
 #include "btree.cpp"
 
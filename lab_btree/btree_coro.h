@@ -0,0 +1,377 @@
+/**
+ * @file btree_coro.h
+ * Coroutine versions of BTree lookups, for hiding memory latency across
+ * many independent lookups. Before touching a node, a lookup prefetches it
+ * and suspends; a LookupScheduler resumes the other lookups in flight in
+ * the meantime, so by the time it comes back around the node is likely in
+ * cache. Each lookup is its own coroutine, so lookups can be submitted one
+ * at a time as requests arrive rather than only as a prepared batch.
+ *
+ * Needs C++20 coroutines; with an older standard this header defines
+ * nothing, and BTREE_CORO is left undefined. BTree itself does not depend
+ * on it, so BTree::find is unchanged.
+ */
+#ifndef BTREE_CORO_H
+#define BTREE_CORO_H
+
+#ifdef __cpp_impl_coroutine
+#if __has_include(<coroutine>)
+#define BTREE_CORO 1
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+
+/**
+ * Awaitable that prefetches a span of memory and suspends, giving the
+ * prefetch time to land while other lookups run.
+ */
+struct Prefetch {
+    const void* address;
+    size_t bytes;
+
+    /** The most cache lines prefetched for one span. */
+    static const size_t MAX_LINES = 16;
+
+    bool await_ready() const noexcept
+    {
+        return address == nullptr;
+    }
+
+    void await_suspend(std::coroutine_handle<>) const noexcept
+    {
+        const char* line = static_cast<const char*>(address);
+        size_t lines = bytes / 64 + 1;
+        for (size_t i = 0; i < lines && i < MAX_LINES; i++) {
+            __builtin_prefetch(line + 64 * i);
+        }
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+};
+
+/**
+ * A lookup in progress, returning a T. Lookups start suspended; resume()
+ * runs one to its next suspension point, and get() runs it to the end.
+ * A Lookup owns its coroutine and is move only.
+ */
+template <class T>
+class Lookup
+{
+  public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+
+        Lookup get_return_object()
+        {
+            return Lookup(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_value(T result)
+        {
+            value.emplace(std::move(result));
+        }
+
+        void unhandled_exception()
+        {
+            error = std::current_exception();
+        }
+    };
+
+    explicit Lookup(std::coroutine_handle<promise_type> handle)
+        : handle(handle)
+    {
+    }
+
+    Lookup(Lookup&& other) noexcept : handle(other.handle)
+    {
+        other.handle = nullptr;
+    }
+
+    Lookup& operator=(Lookup&& other) noexcept
+    {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+
+    ~Lookup()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    Lookup(const Lookup&) = delete;
+    Lookup& operator=(const Lookup&) = delete;
+
+    bool done() const
+    {
+        return handle.done();
+    }
+
+    void resume()
+    {
+        handle.resume();
+    }
+
+    /**
+     * Gives up ownership of the coroutine.
+     * @return Its handle; the caller must destroy it.
+     */
+    std::coroutine_handle<promise_type> release()
+    {
+        return std::exchange(handle, nullptr);
+    }
+
+    /**
+     * Runs the lookup to the end without interleaving.
+     * @return Its result.
+     */
+    T get()
+    {
+        while (!handle.done()) {
+            handle.resume();
+        }
+        return result();
+    }
+
+    /**
+     * @return The result of a finished lookup.
+     * @throws Whatever the lookup threw.
+     */
+    T result()
+    {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+        return std::move(*handle.promise().value);
+    }
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * Looks a key up like BTree::find, prefetching and suspending before each
+ * node and again before each node's keys or elements.
+ * The BTree must outlive the lookup and must not be modified while it is
+ * in flight.
+ * @param tree The BTree to search.
+ * @param key The key to look up; copied into the lookup.
+ * @return A lookup for the value (if found), the default V if not.
+ */
+template <class K, class V>
+Lookup<V> find_async(const BTree<K, V>& tree, K key)
+{
+    typedef typename BTree<K, V>::BTreeNode BTreeNode;
+    typedef typename BTree<K, V>::DataPair DataPair;
+
+    const BTreeNode* node = tree.root;
+    if (node == nullptr) {
+        co_return V();
+    }
+    co_await Prefetch{node, sizeof(BTreeNode)};
+    while (!node->is_leaf) {
+        co_await Prefetch{node->keys.data(), node->keys.size() * sizeof(K)};
+        node = node->children[tree.child_index(node, key)];
+        co_await Prefetch{node, sizeof(BTreeNode)};
+    }
+    co_await Prefetch{node->elements.data(),
+                      node->elements.size() * sizeof(DataPair)};
+
+    if (!tree.filter_may_contain(node, key)) {
+        co_return V();
+    }
+    size_t idx = tree.node_search(node, key);
+    if (idx < node->elements.size() && node->elements[idx].key == key
+        && !tree.is_tombstone(node, idx)) {
+        co_return node->elements[idx].value;
+    }
+    co_return V();
+}
+
+/**
+ * Finds the first pair whose key is not less than a given key, with the
+ * same prefetching and suspending as find_async, following the leaf chain
+ * when the leaf the key routes to has nothing at or after it.
+ * The BTree must outlive the lookup and must not be modified while it is
+ * in flight.
+ * @param tree The BTree to search.
+ * @param key The key to look up; copied into the lookup.
+ * @return A lookup for the pair, or for std::nullopt if every key is less
+ * than key.
+ */
+template <class K, class V>
+Lookup<std::optional<std::pair<K, V>>> lower_bound_async(
+    const BTree<K, V>& tree, K key)
+{
+    typedef typename BTree<K, V>::BTreeNode BTreeNode;
+    typedef typename BTree<K, V>::DataPair DataPair;
+
+    const BTreeNode* node = tree.root;
+    if (node == nullptr) {
+        co_return std::nullopt;
+    }
+    co_await Prefetch{node, sizeof(BTreeNode)};
+    while (!node->is_leaf) {
+        co_await Prefetch{node->keys.data(), node->keys.size() * sizeof(K)};
+        node = node->children[tree.child_index(node, key)];
+        co_await Prefetch{node, sizeof(BTreeNode)};
+    }
+    co_await Prefetch{node->elements.data(),
+                      node->elements.size() * sizeof(DataPair)};
+
+    size_t idx = tree.node_search(node, key);
+    while (true) {
+        for (; idx < node->elements.size(); idx++) {
+            if (!tree.is_tombstone(node, idx)) {
+                const DataPair& found = node->elements[idx];
+                co_return std::make_pair(found.key, found.value);
+            }
+        }
+        node = node->next;
+        if (node == nullptr) {
+            co_return std::nullopt;
+        }
+        idx = 0;
+        co_await Prefetch{node, sizeof(BTreeNode)};
+        co_await Prefetch{node->elements.data(),
+                          node->elements.size() * sizeof(DataPair)};
+    }
+}
+
+/**
+ * Interleaves lookups. Up to width lookups are in flight at once; each
+ * call to poll() resumes every one of them a step, so while one waits for
+ * its prefetch the others run. Lookups submitted while the scheduler is
+ * full wait their turn. Lookups of different result types can share a
+ * scheduler.
+ */
+class LookupScheduler
+{
+  public:
+    /**
+     * @param width The most lookups in flight at once; at least 1.
+     */
+    explicit LookupScheduler(size_t width = 16) : width(width ? width : 1)
+    {
+    }
+
+    /**
+     * Destroys any lookups that have not finished, without calling their
+     * done callables.
+     */
+    ~LookupScheduler()
+    {
+        for (Job& job : active) {
+            job.handle.destroy();
+        }
+        for (Job& job : waiting) {
+            job.handle.destroy();
+        }
+    }
+
+    LookupScheduler(const LookupScheduler&) = delete;
+    LookupScheduler& operator=(const LookupScheduler&) = delete;
+
+    /**
+     * Adds a lookup.
+     * @param lookup The lookup.
+     * @param done Callable invoked as done(result) once it finishes, from
+     * inside poll().
+     */
+    template <class T, class F>
+    void submit(Lookup<T> lookup, F done)
+    {
+        Job job;
+        auto handle = lookup.release();
+        job.handle = handle;
+        job.finish = [handle, done]() mutable {
+            Lookup<T> finished(handle);
+            done(finished.result());
+        };
+        waiting.push_back(std::move(job));
+    }
+
+    /**
+     * Admits waiting lookups into free slots, then resumes every lookup in
+     * flight once, finishing those that complete.
+     * @return The number of lookups still in flight or waiting.
+     */
+    size_t poll()
+    {
+        while (active.size() < width && !waiting.empty()) {
+            active.push_back(std::move(waiting.front()));
+            waiting.pop_front();
+        }
+        for (size_t i = 0; i < active.size();) {
+            active[i].handle.resume();
+            if (active[i].handle.done()) {
+                Job finished = std::move(active[i]);
+                active[i] = std::move(active.back());
+                active.pop_back();
+                finished.finish();
+            } else {
+                i++;
+            }
+        }
+        return pending();
+    }
+
+    /**
+     * Polls until every lookup has finished.
+     */
+    void run()
+    {
+        while (poll() > 0) {
+        }
+    }
+
+    /**
+     * @return The number of lookups in flight or waiting.
+     */
+    size_t pending() const
+    {
+        return active.size() + waiting.size();
+    }
+
+  private:
+    /**
+     * A lookup, resumed through its untyped handle, and how to hand its
+     * result on and destroy it once it has finished.
+     */
+    struct Job {
+        std::coroutine_handle<> handle;
+        std::function<void()> finish;
+    };
+
+    size_t width;
+    std::vector<Job> active;
+    std::deque<Job> waiting;
+};
+
+#endif /* __has_include(<coroutine>) */
+#endif /* __cpp_impl_coroutine */
+
+#endif /* BTREE_CORO_H */
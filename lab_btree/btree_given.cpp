@@ -18,6 +18,16 @@ BTree<K, V>::BTree()
 {
     root = nullptr;
     order = 64;
+    inner_order = inner_order_for(order);
+    leaf_filters = false;
+    key_pages = false;
+    subtree_counts = false;
+    structure_version = 0;
+    lazy_remove = false;
+    purge_ratio = 0;
+    purge_threshold = 0;
+    tombstone_count = 0;
+    compact_level = 0;
 }
 
 /**
@@ -30,6 +40,16 @@ BTree<K, V>::BTree(unsigned int order)
 {
     root = nullptr;
     this->order = order < 3 ? 3 : order;
+    inner_order = inner_order_for(this->order);
+    leaf_filters = false;
+    key_pages = false;
+    subtree_counts = false;
+    structure_version = 0;
+    lazy_remove = false;
+    purge_ratio = 0;
+    purge_threshold = 0;
+    tombstone_count = 0;
+    compact_level = 0;
 }
 
 /**
@@ -38,9 +58,61 @@ BTree<K, V>::BTree(unsigned int order)
  */
 template <class K, class V>
 BTree<K, V>::BTree(const BTree& other)
+    : order(other.order), inner_order(other.inner_order), root(nullptr),
+      leaf_filters(other.leaf_filters),
+      key_pages(other.key_pages), subtree_counts(other.subtree_counts),
+      aggregate_combine(other.aggregate_combine),
+      aggregate_identity(other.aggregate_identity), structure_version(0),
+      lazy_remove(other.lazy_remove), purge_ratio(other.purge_ratio),
+      purge_threshold(other.purge_threshold),
+      tombstone_count(other.tombstone_count), compact_level(0)
 {
-    clear(root);
     root = copy(other.root);
+    BTreeNode* last_leaf = nullptr;
+    if (root != nullptr) {
+        link_leaves(root, last_leaf);
+    }
+}
+
+/**
+ * Constructs a BTree as a deep copy of another, on several threads.
+ * @param other The BTree to copy.
+ * @param threads The number of threads to use, or 0 for every thread of
+ * the shared ThreadPool.
+ */
+template <class K, class V>
+BTree<K, V>::BTree(const BTree& other, unsigned int threads)
+    : order(other.order), inner_order(other.inner_order), root(nullptr),
+      leaf_filters(other.leaf_filters),
+      key_pages(other.key_pages), subtree_counts(other.subtree_counts),
+      aggregate_combine(other.aggregate_combine),
+      aggregate_identity(other.aggregate_identity), structure_version(0),
+      lazy_remove(other.lazy_remove), purge_ratio(other.purge_ratio),
+      purge_threshold(other.purge_threshold),
+      tombstone_count(other.tombstone_count), compact_level(0)
+{
+    root = copy_parallel(other.root, thread_count(threads));
+}
+
+/**
+ * Constructs a BTree by taking over another's nodes and settings.
+ * @param other The BTree to move from.
+ */
+template <class K, class V>
+BTree<K, V>::BTree(BTree&& other)
+    : order(other.order), inner_order(other.inner_order), root(other.root),
+      counters(other.counters),
+      leaf_filters(other.leaf_filters), key_pages(other.key_pages),
+      subtree_counts(other.subtree_counts),
+      aggregate_combine(other.aggregate_combine),
+      aggregate_identity(other.aggregate_identity), structure_version(0),
+      lazy_remove(other.lazy_remove), purge_ratio(other.purge_ratio),
+      purge_threshold(other.purge_threshold),
+      tombstone_count(other.tombstone_count), compact_level(0)
+{
+    other.root = nullptr;
+    other.tombstone_count = 0;
+    other.structure_version++;
 }
 
 /**
@@ -54,9 +126,10 @@ typename BTree<K, V>::BTreeNode* BTree<K, V>::copy(const BTreeNode* subroot)
         return nullptr;
     }
 
-    BTreeNode* new_node = new BTreeNode(subroot);
+    BTreeNode* new_node = new BTreeNode(*subroot);
     for (auto& child : subroot->children) {
         new_node->children.push_back(copy(child));
+        new_node->children.back()->parent = new_node;
     }
     return new_node;
 }
@@ -65,7 +138,10 @@ typename BTree<K, V>::BTreeNode* BTree<K, V>::copy(const BTreeNode* subroot)
  * Performs checks to make sure the BTree is valid. Specifically
  * it will check to make sure that an in-order traversal of the tree
  * will result in a sorted sequence of keys. Also verifies that each
- * BTree node doesn't have more nodes than its order.
+ * BTree node doesn't have more nodes than its order (inner nodes: the
+ * inner order that goes with it), that the leaves are chained in order,
+ * that each leaf has one tombstone bit per element or none and, if subtree
+ * counts are on, that they are right.
  * @return true if it satisfies the conditions, false otherwise.
  */
 template <class K, class V>
@@ -74,8 +150,10 @@ bool BTree<K, V>::is_valid(unsigned int order /* = 64 */) const
     if (root == nullptr)
         return true;
     vector<DataPair> data;
+    size_t size = 0;
     return is_valid(root, data, order)
-           && std::is_sorted(data.begin(), data.end());
+           && std::is_sorted(data.begin(), data.end()) && leaves_linked()
+           && (!subtree_counts || counts_valid(root, size));
 }
 
 /**
@@ -88,25 +166,26 @@ template <class K, class V>
 bool BTree<K, V>::is_valid(const BTreeNode* subroot, vector<DataPair>& data,
                            unsigned int order) const
 {
-    if (subroot->elements.size() >= order) {
-        return false;
+    if (subroot->is_leaf) {
+        data.insert(data.end(), subroot->elements.begin(),
+                    subroot->elements.end());
+        return subroot->elements.size() < order && subroot->keys.empty()
+               && (subroot->tombstones.empty()
+                   || subroot->tombstones.size() == subroot->elements.size());
     }
 
-    auto first = subroot->elements.begin();
-    auto last = subroot->elements.end();
-    bool ret = subroot->children.size() == subroot->elements.size() + 1;
-    if (!subroot->is_leaf) {
-        auto curr_child = subroot->children.begin();
+    auto first = subroot->keys.begin();
+    auto last = subroot->keys.end();
+    bool ret = subroot->keys.size() < inner_order_for(order)
+               && subroot->elements.empty()
+               && subroot->children.size() == subroot->keys.size() + 1;
+    auto curr_child = subroot->children.begin();
+    ret = ret && is_valid(*curr_child, data, order);
+    curr_child++;
+    for (auto key = first; ret && key != last; key++) {
+        data.push_back(DataPair(*key, V()));
         ret &= is_valid(*curr_child, data, order);
         curr_child++;
-        for (auto elem = first; ret && elem != last; elem++) {
-            data.push_back(*elem);
-            ret &= is_valid(*curr_child, data, order);
-            curr_child++;
-        }
-    } else {
-        data.insert(data.end(), first, last);
-        ret = true;
     }
     return ret;
 }
@@ -144,8 +223,25 @@ template <class K, class V>
 const BTree<K, V>& BTree<K, V>::operator=(const BTree& rhs)
 {
     if (this != &rhs) {
-        clear(root);
+        clear();
+        order = rhs.order;
+        inner_order = rhs.inner_order;
+        leaf_filters = rhs.leaf_filters;
+        key_pages = rhs.key_pages;
+        subtree_counts = rhs.subtree_counts;
+        aggregate_combine = rhs.aggregate_combine;
+        aggregate_identity = rhs.aggregate_identity;
+        lazy_remove = rhs.lazy_remove;
+        purge_ratio = rhs.purge_ratio;
+        purge_threshold = rhs.purge_threshold;
+        tombstone_count = rhs.tombstone_count;
+        compact_level = 0;
+        compact_cursor.clear();
         root = copy(rhs.root);
+        BTreeNode* last_leaf = nullptr;
+        if (root != nullptr) {
+            link_leaves(root, last_leaf);
+        }
     }
     return *this;
 }
@@ -159,5 +255,7 @@ void BTree<K, V>::clear()
     if (root != nullptr) {
         clear(root);
         root = nullptr;
+        structure_version++;
     }
+    tombstone_count = 0;
 }
@@ -1,5 +1,6 @@
 #include "btree.h"
 #include "benchmark.h"
+#include "workload.h"
 
 #include <iostream>
 #include <map>
@@ -15,6 +16,59 @@ using namespace std;
 void run_benchmark(unsigned int n, unsigned int step, unsigned int order,
                    bool inserts, bool finds, bool rand);
 
+/**
+ * Optional BTree features to turn on for a workload race.
+ */
+struct TreeOptions {
+    bool leaf_filters;
+    bool subtree_counts;
+
+    TreeOptions() : leaf_filters(false), subtree_counts(false)
+    {
+    }
+
+    /**
+     * Parses a comma separated list of feature names, e.g.
+     * "filters,counts".
+     */
+    static TreeOptions parse(const string& desc)
+    {
+        TreeOptions options;
+        stringstream tokens(desc);
+        string token;
+        while (getline(tokens, token, ',')) {
+            if (token == "filters") {
+                options.leaf_filters = true;
+            } else if (token == "counts") {
+                options.subtree_counts = true;
+            } else if (!token.empty()) {
+                throw invalid_argument("unknown tree option: " + token);
+            }
+        }
+        return options;
+    }
+
+    void apply(BTree<int, int>& bt) const
+    {
+        bt.set_leaf_filters(leaf_filters);
+        bt.set_subtree_counts(subtree_counts);
+    }
+
+    /**
+     * @return The enabled features, each prefixed by a comma, for use in
+     * benchmark names.
+     */
+    string name() const
+    {
+        return string(leaf_filters ? ",filters" : "")
+               + (subtree_counts ? ",counts" : "");
+    }
+};
+
+void run_workload(unsigned int order, unsigned int records, unsigned int ops,
+                  unsigned int step, const WorkloadSpec& spec,
+                  unsigned int seed, const TreeOptions& options);
+
 bool stob(const string& s)
 {
     string temp = s;
@@ -33,13 +87,74 @@ const string USAGE =
 "RANDOM specifies whether the data should be random or sequential.\n"
 "INSERT specifies whether to benchmark the inserts.\n"
 "FINDS specifies whether to benchmark the finds.\n\n"
+"\n"
+"USAGE: dict_racer ycsb ORDER RECORDS OPS STEP WORKLOAD [SEED [OPTIONS]]\n"
+"Loads RECORDS keys into a BTree< int, int > of order ORDER and into an\n"
+"std::map< int, int >, then races them over up to OPS operations of a mixed\n"
+"workload, making a point every STEP operations.\n"
+"WORKLOAD is a YCSB core workload letter (A-F), optionally followed by\n"
+"overrides, or a custom mix, e.g. \"B\", \"A,dist=uniform\" or\n"
+"\"read=90,update=5,insert=3,remove=2,dist=latest\". Weights are read,\n"
+"update, insert, remove, scan and rmw; dist is uniform, zipfian or latest;\n"
+"scanlen bounds scan lengths; keys is hashed or ordered; miss is the\n"
+"fraction of reads that look up absent keys (e.g. \"C,miss=0.7\").\n"
+"SEED makes the operation stream reproducible (default 1).\n"
+"OPTIONS is a comma separated list of BTree features to enable:\n"
+"  filters  per-leaf Bloom filters for fast negative lookups\n"
+"  counts   subtree counts for rank / select / count queries\n\n"
+"Every point also records the peak RSS of the run and, for the BTree, its\n"
+"memory use per entry as reported by BTree::memory_usage().\n"
+"Where the kernel permits it, hardware counters (cycles, instructions, cache,\n"
+"TLB and branch misses) are recorded per operation next to the timings.\n\n"
 "Results can be plotted with the simple python script generate_plot.py, e.g.\n"
 "./generate_plot.py results/*.csv\n";
 
+/**
+ * Records the peak RSS of the process since the point started.
+ */
+void record_memory(Benchmark& bench, size_t point)
+{
+    bench.record(point, "peak_rss (KB)", Benchmark::peak_rss_kb());
+}
+
+/**
+ * Records the peak RSS as well as the tree's own accounting of its memory,
+ * per entry.
+ */
+void record_memory(Benchmark& bench, size_t point, const BTree<int, int>& bt)
+{
+    BTree<int, int>::MemoryUsage usage = bt.memory_usage();
+    record_memory(bench, point);
+    bench.record(point, "bytes/entry",
+                 usage.entry_count == 0
+                     ? 0.0
+                     : static_cast<double>(usage.total()) / usage.entry_count);
+}
 
 int main(int argc, char* argv[])
 {
-    if (argc != 7) {
+    if (argc >= 2 && string(argv[1]) == "ycsb") {
+        if (argc < 7 || argc > 9) {
+            cout << USAGE << endl;
+            return -1;
+        }
+        try {
+            int order = stoi(argv[2]);
+            int records = stoi(argv[3]);
+            int ops = stoi(argv[4]);
+            int step = stoi(argv[5]);
+            WorkloadSpec spec = WorkloadSpec::parse(argv[6]);
+            int seed = argc >= 8 ? stoi(argv[7]) : 1;
+            TreeOptions options = TreeOptions::parse(argc == 9 ? argv[8] : "");
+            run_workload(order, records, ops, step, spec, seed, options);
+        } catch (invalid_argument& e) {
+            cout << e.what() << endl << endl << USAGE << endl;
+            return -1;
+        } catch (out_of_range& e) {
+            cout << "Number too large to take as input." << endl;
+            return -1;
+        }
+    } else if (argc != 7) {
         cout << USAGE << endl;
         return -1;
     } else {
@@ -112,9 +227,12 @@ void run_benchmark(unsigned int n, unsigned int step, unsigned int order,
     Benchmark b("blah");
     Benchmark bt_b(bt_benchmark_name.str());
     Benchmark mp_b(mp_benchmark_name.str());
+    bt_b.enable_perf_counters();
+    mp_b.enable_perf_counters();
 
     for (unsigned int i = 0; i < n; i += step) {
-        size_t curr = bt_b.add_point(i);
+        size_t curr = bt_b.add_point(i, inserts && finds ? 2 * i : i);
+        Benchmark::reset_peak_rss();
         if (inserts) {
             bt_b.start(curr);
         }
@@ -134,12 +252,14 @@ void run_benchmark(unsigned int n, unsigned int step, unsigned int order,
             }
         }
         bt_b.end(curr);
+        record_memory(bt_b, curr, bt);
         bt.clear();
     }
     bt_b.write_to_file();
 
     for (unsigned int i = 0; i < n; i += step) {
-        size_t curr = mp_b.add_point(i);
+        size_t curr = mp_b.add_point(i, inserts && finds ? 2 * i : i);
+        Benchmark::reset_peak_rss();
         if (inserts) {
             mp_b.start(curr);
         }
@@ -159,7 +279,164 @@ void run_benchmark(unsigned int n, unsigned int step, unsigned int order,
             }
         }
         mp_b.end(curr);
+        record_memory(mp_b, curr);
         mp.clear();
     }
     mp_b.write_to_file();
 }
+
+/* Read results end up here so the timed reads cannot be optimized away. */
+volatile long long workload_sink;
+
+/**
+ * Runs the operations of a workload against a dictionary. Dict only needs
+ * to look like a BTree; see the std::map overloads below.
+ * @return A checksum of everything read.
+ */
+template <class Dict>
+long long run_ops(Dict& dict, const vector<Operation>& ops, size_t count)
+{
+    long long checksum = 0;
+    for (size_t i = 0; i < count; i++) {
+        const Operation& op = ops[i];
+        switch (op.type) {
+            case OpType::Read:
+                checksum += dict.find(op.key);
+                break;
+            case OpType::Update:
+                dict.update(op.key, op.key + 1);
+                break;
+            case OpType::Insert:
+                dict.insert(op.key, op.key);
+                break;
+            case OpType::Remove:
+                dict.remove(op.key);
+                break;
+            case OpType::Scan:
+                dict.scan(op.key, op.scan_length,
+                          [&checksum](const int&, const int& value) {
+                              checksum += value;
+                          });
+                break;
+            case OpType::ReadModifyWrite:
+                dict.update(op.key, dict.find(op.key) + 1);
+                break;
+        }
+    }
+    return checksum;
+}
+
+/**
+ * Gives std::map the handful of BTree member functions run_ops uses.
+ */
+class MapDict
+{
+  public:
+    int find(int key) const
+    {
+        auto it = mp.find(key);
+        return it == mp.end() ? 0 : it->second;
+    }
+
+    bool update(int key, int value)
+    {
+        auto it = mp.find(key);
+        if (it == mp.end()) {
+            return false;
+        }
+        it->second = value;
+        return true;
+    }
+
+    void insert(int key, int value)
+    {
+        mp.insert(make_pair(key, value));
+    }
+
+    void remove(int key)
+    {
+        mp.erase(key);
+    }
+
+    template <class F>
+    size_t scan(int lo, size_t count, F visit) const
+    {
+        size_t visited = 0;
+        for (auto it = mp.lower_bound(lo); it != mp.end() && visited < count;
+             ++it, ++visited) {
+            visit(it->first, it->second);
+        }
+        return visited;
+    }
+
+    void clear()
+    {
+        mp.clear();
+    }
+
+    friend void record_memory(Benchmark& bench, size_t point, const MapDict&)
+    {
+        record_memory(bench, point);
+    }
+
+  private:
+    map<int, int> mp;
+};
+
+/**
+ * Loads records keys into a fresh dictionary and times the first i
+ * operations of the workload for every i in step, 2 * step, ... ops.
+ */
+template <class Dict>
+void race_workload(Dict& dict, Benchmark& bench, const Workload& workload,
+                   unsigned int records, const vector<Operation>& ops,
+                   unsigned int step)
+{
+    long long checksum = 0;
+    for (unsigned int i = step; i <= ops.size(); i += step) {
+        dict.clear();
+        Benchmark::reset_peak_rss();
+        for (unsigned int r = 0; r < records; r++) {
+            dict.insert(workload.key_of(r), workload.key_of(r));
+        }
+        size_t curr = bench.add_point(i);
+        bench.start(curr);
+        checksum += run_ops(dict, ops, i);
+        bench.end(curr);
+        record_memory(bench, curr, dict);
+    }
+    dict.clear();
+    workload_sink = checksum;
+    bench.write_to_file();
+}
+
+void run_workload(unsigned int order, unsigned int records, unsigned int ops,
+                  unsigned int step, const WorkloadSpec& spec,
+                  unsigned int seed, const TreeOptions& options)
+{
+    if (step == 0) {
+        throw invalid_argument("STEP must be positive");
+    }
+
+    Workload workload(spec, records, seed);
+    vector<Operation> stream = workload.generate(ops);
+
+    stringstream suffix;
+    suffix << records << "_" << spec.name << "_" << spec.distribution_name();
+    stringstream bt_benchmark_name;
+    stringstream mp_benchmark_name;
+    bt_benchmark_name << "BTree(" << order << options.name() << ")<int,int>_"
+                      << suffix.str();
+    mp_benchmark_name << "std::map<int,int>_" << suffix.str();
+
+    BTree<int, int> bt(order);
+    options.apply(bt);
+    Benchmark bt_b(bt_benchmark_name.str());
+    bt_b.enable_perf_counters();
+    race_workload(bt, bt_b, workload, records, stream, step);
+
+    MapDict mp;
+    Benchmark mp_b(mp_benchmark_name.str());
+    mp_b.enable_perf_counters();
+    race_workload(mp, mp_b, workload, records, stream, step);
+}
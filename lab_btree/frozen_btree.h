@@ -0,0 +1,480 @@
+/**
+ * @file frozen_btree.h
+ * An immutable, read-optimized image of a BTree. All keys sit in one sorted
+ * array, grouped into cache line sized blocks, with a static B+ tree of
+ * block maxima stacked on top of it in level order; values sit in a second
+ * array. There are no pointers anywhere, only offsets into one contiguous
+ * buffer, so the image can be written to a file as-is and later mapped back
+ * in with mmap, ready to serve lookups without any parsing.
+ */
+#ifndef FROZEN_BTREE_H
+#define FROZEN_BTREE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FROZEN_BTREE_MMAP 1
+#endif
+
+/**
+ * FrozenBTree class. Answers find, lower_bound and range scans over a fixed
+ * set of key / value pairs. Keys and values are stored bitwise, so both
+ * must be trivially copyable, and a saved image can only be opened on a
+ * machine with the same type layout and byte order.
+ * <pre>
+ * level 2:  [ 61 | 99 ]                             (max of each block below)
+ * level 1:  [ 7 | 30 | 61 ] [ 80 | 99 ]
+ * level 0:  [ 2 5 7 ] [ 9 20 30 ] [ 40 50 61 ] [ 70 80 ] [ 90 99 ]   (keys)
+ * </pre>
+ * A search reads one block per level: the number of entries in the block
+ * below the key is the index of the block to read on the next level down.
+ * Blocks have a fixed size and short blocks are padded with their last
+ * entry, so that count is a branch free loop the compiler can vectorize.
+ */
+template <class K, class V>
+class FrozenBTree
+{
+    static_assert(std::is_trivially_copyable<K>::value
+                      && std::is_trivially_copyable<V>::value,
+                  "FrozenBTree stores keys and values bitwise");
+
+  public:
+    /** Bytes per block; blocks start on cache line boundaries. */
+    static const size_t BLOCK_BYTES = 64;
+
+    /** Keys (or block maxima) per block. */
+    static const size_t BLOCK_KEYS
+        = sizeof(K) * 2 <= BLOCK_BYTES ? BLOCK_BYTES / sizeof(K) : 2;
+
+    /**
+     * Constructs an empty FrozenBTree.
+     */
+    FrozenBTree() : base(nullptr), mapping(nullptr), mapping_length(0)
+    {
+        build(std::vector<K>(), std::vector<V>());
+    }
+
+    /**
+     * Constructs a FrozenBTree from sorted pairs.
+     * @param keys The keys, sorted and without duplicates.
+     * @param values values[i] is the value associated with keys[i].
+     */
+    FrozenBTree(const std::vector<K>& keys, const std::vector<V>& values)
+        : base(nullptr), mapping(nullptr), mapping_length(0)
+    {
+        build(keys, values);
+    }
+
+    FrozenBTree(FrozenBTree&& other)
+        : base(nullptr), mapping(nullptr), mapping_length(0)
+    {
+        *this = std::move(other);
+    }
+
+    FrozenBTree& operator=(FrozenBTree&& other)
+    {
+        if (this != &other) {
+            unmap();
+            storage = std::move(other.storage);
+            base = other.base;
+            mapping = other.mapping;
+            mapping_length = other.mapping_length;
+            other.base = nullptr;
+            other.mapping = nullptr;
+            other.mapping_length = 0;
+            other.build(std::vector<K>(), std::vector<V>());
+        }
+        return *this;
+    }
+
+    FrozenBTree(const FrozenBTree&) = delete;
+    FrozenBTree& operator=(const FrozenBTree&) = delete;
+
+    ~FrozenBTree()
+    {
+        unmap();
+    }
+
+    /**
+     * @return The number of key / value pairs.
+     */
+    size_t size() const
+    {
+        return header()->count;
+    }
+
+    /**
+     * @return The size of the image in bytes, which is also the size of
+     * the file save() writes.
+     */
+    size_t bytes() const
+    {
+        return header()->total_bytes;
+    }
+
+    /**
+     * Finds the value associated with a given key.
+     * @param key The key to look up.
+     * @return The value (if found), the default V if not.
+     */
+    V find(const K& key) const
+    {
+        size_t idx = lower_bound(key);
+        if (idx < size() && !(key < key_at(idx))) {
+            return value_at(idx);
+        }
+        return V();
+    }
+
+    /**
+     * @param key The key to look for.
+     * @return The index of the first key not less than key, or size() if
+     * there is none.
+     */
+    size_t lower_bound(const K& key) const
+    {
+        const Header* head = header();
+        if (head->count == 0) {
+            return 0;
+        }
+
+        size_t level = head->level_count - 1;
+        size_t idx = count_below(level_keys(level), key);
+        if (idx >= head->level_sizes[level]) {
+            return head->count;
+        }
+        while (level-- > 0) {
+            idx = idx * BLOCK_KEYS
+                  + count_below(level_keys(level) + idx * BLOCK_KEYS, key);
+        }
+        return idx;
+    }
+
+    /**
+     * @param idx An index less than size().
+     * @return The idx-th smallest key.
+     */
+    const K& key_at(size_t idx) const
+    {
+        return level_keys(0)[idx];
+    }
+
+    /**
+     * @param idx An index less than size().
+     * @return The value associated with key_at(idx).
+     */
+    const V& value_at(size_t idx) const
+    {
+        return reinterpret_cast<const V*>(base + header()->values_offset)[idx];
+    }
+
+    /**
+     * Visits, in ascending key order, up to count pairs whose keys are not
+     * less than lo.
+     * @param lo The smallest key to visit.
+     * @param count The maximum number of pairs to visit.
+     * @param visit Callable invoked as visit(key, value) for each pair.
+     * @return The number of pairs visited.
+     */
+    template <class F>
+    size_t scan(const K& lo, size_t count, F visit) const
+    {
+        size_t first = lower_bound(lo);
+        size_t last = size() - first < count ? size() : first + count;
+        for (size_t idx = first; idx < last; idx++) {
+            visit(key_at(idx), value_at(idx));
+        }
+        return last - first;
+    }
+
+    /**
+     * Writes the image to a file, which open() can map back in.
+     * @param path The file to write.
+     * @throws std::runtime_error if the file cannot be written.
+     */
+    void save(const std::string& path) const
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error("cannot create " + path);
+        }
+        bool written = fwrite(base, 1, bytes(), file) == bytes();
+        if (fclose(file) != 0 || !written) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    /**
+     * Opens an image written by save(). Where mmap is available the file
+     * is mapped read-only rather than read, so opening is immediate and
+     * pages are only loaded as lookups touch them.
+     * @param path The file to open.
+     * @return The FrozenBTree stored in the file.
+     * @throws std::runtime_error if the file cannot be read or does not
+     * hold an image for these key and value types.
+     */
+    static FrozenBTree open(const std::string& path)
+    {
+        FrozenBTree frozen;
+        frozen.storage.clear();
+        frozen.base = nullptr;
+        size_t length = 0;
+
+#ifdef FROZEN_BTREE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("cannot open " + path);
+        }
+        length = static_cast<size_t>(info.st_size);
+        void* addr = length == 0 ? MAP_FAILED
+                                 : mmap(nullptr, length, PROT_READ,
+                                        MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path);
+        }
+        frozen.mapping = addr;
+        frozen.mapping_length = length;
+        frozen.base = static_cast<const char*>(addr);
+#else
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        std::vector<char> contents;
+        char chunk[65536];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            contents.insert(contents.end(), chunk, chunk + got);
+        }
+        fclose(file);
+        length = contents.size();
+        frozen.base = frozen.allocate(length);
+        memcpy(const_cast<char*>(frozen.base), contents.data(), length);
+#endif
+
+        if (!frozen.valid_image(length)) {
+            throw std::runtime_error(path + " is not a compatible image");
+        }
+        return frozen;
+    }
+
+  private:
+    static const size_t MAX_LEVELS = 64;
+    static const uint32_t VERSION = 1;
+
+    /**
+     * The start of every image. Offsets are relative to the start of the
+     * image; level 0 holds the keys themselves.
+     */
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t key_size;
+        uint32_t value_size;
+        uint32_t block_keys;
+        uint64_t count;
+        uint64_t level_count;
+        uint64_t total_bytes;
+        uint64_t values_offset;
+        uint64_t level_offsets[MAX_LEVELS];
+        uint64_t level_sizes[MAX_LEVELS];
+    };
+
+    static size_t round_up(size_t bytes)
+    {
+        return (bytes + BLOCK_BYTES - 1) / BLOCK_BYTES * BLOCK_BYTES;
+    }
+
+    static size_t blocks_for(size_t entries)
+    {
+        return (entries + BLOCK_KEYS - 1) / BLOCK_KEYS;
+    }
+
+    /**
+     * @return The number of entries in a block that are less than key.
+     */
+    static size_t count_below(const K* block, const K& key)
+    {
+        size_t below = 0;
+        for (size_t i = 0; i < BLOCK_KEYS; i++) {
+            below += block[i] < key;
+        }
+        return below;
+    }
+
+    const Header* header() const
+    {
+        return reinterpret_cast<const Header*>(base);
+    }
+
+    const K* level_keys(size_t level) const
+    {
+        return reinterpret_cast<const K*>(base
+                                          + header()->level_offsets[level]);
+    }
+
+    /**
+     * Allocates storage for an image of the given size, aligned to a block.
+     * @return The start of the image.
+     */
+    char* allocate(size_t length)
+    {
+        storage.assign(length + BLOCK_BYTES, 0);
+        uintptr_t start = reinterpret_cast<uintptr_t>(storage.data());
+        start = (start + BLOCK_BYTES - 1) / BLOCK_BYTES * BLOCK_BYTES;
+        return reinterpret_cast<char*>(start);
+    }
+
+    /**
+     * Lays out the image for the given pairs in fresh storage.
+     */
+    void build(const std::vector<K>& keys, const std::vector<V>& values)
+    {
+        Header head;
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, "BTFROZEN", 8);
+        head.version = VERSION;
+        head.key_size = sizeof(K);
+        head.value_size = sizeof(V);
+        head.block_keys = BLOCK_KEYS;
+        head.count = keys.size();
+
+        /* Every level has one entry per block of the level below, until a
+         * level fits in a single block. */
+        size_t offset = round_up(sizeof(Header));
+        size_t entries = keys.size();
+        do {
+            head.level_offsets[head.level_count] = offset;
+            head.level_sizes[head.level_count] = entries;
+            head.level_count++;
+            offset += round_up(blocks_for(entries) * BLOCK_KEYS * sizeof(K));
+            entries = blocks_for(entries);
+        } while (head.level_sizes[head.level_count - 1] > BLOCK_KEYS);
+        head.values_offset = offset;
+        head.total_bytes = round_up(offset + keys.size() * sizeof(V));
+
+        char* image = allocate(head.total_bytes);
+        base = image;
+        memcpy(image, &head, sizeof(head));
+        if (keys.empty()) {
+            return;
+        }
+
+        for (size_t level = 0; level < head.level_count; level++) {
+            K* out = reinterpret_cast<K*>(image + head.level_offsets[level]);
+            size_t size = head.level_sizes[level];
+            for (size_t i = 0; i < size; i++) {
+                if (level == 0) {
+                    out[i] = keys[i];
+                } else {
+                    /* The maximum of block i of the level below. */
+                    const K* below = reinterpret_cast<const K*>(
+                        image + head.level_offsets[level - 1]);
+                    size_t last = (i + 1) * BLOCK_KEYS - 1;
+                    out[i] = below[last];
+                }
+            }
+            for (size_t i = size; i < blocks_for(size) * BLOCK_KEYS; i++) {
+                out[i] = out[size - 1];
+            }
+        }
+        memcpy(image + head.values_offset, values.data(),
+               values.size() * sizeof(V));
+    }
+
+    /**
+     * Checks that the image at base was made for these types, that its
+     * levels have the shape build() gives them, and that every level and
+     * the values fit in the given number of bytes.
+     */
+    bool valid_image(size_t length) const
+    {
+        if (length < sizeof(Header)) {
+            return false;
+        }
+        const Header* head = header();
+        if (memcmp(head->magic, "BTFROZEN", 8) != 0
+            || head->version != VERSION || head->key_size != sizeof(K)
+            || head->value_size != sizeof(V)
+            || head->block_keys != BLOCK_KEYS
+            || head->total_bytes > length || head->level_count == 0
+            || head->level_count > MAX_LEVELS
+            || head->values_offset > head->total_bytes
+            || head->values_offset % BLOCK_BYTES != 0) {
+            return false;
+        }
+        /* Sizes are bounded by the bytes they occupy before blocks_for is
+         * applied to them, so none of the arithmetic below can overflow. */
+        if (head->count > (head->total_bytes - head->values_offset)
+                              / sizeof(V)
+            || head->level_sizes[0] != head->count) {
+            return false;
+        }
+        for (size_t level = 0; level < head->level_count; level++) {
+            uint64_t offset = head->level_offsets[level];
+            uint64_t size = head->level_sizes[level];
+            if (offset < round_up(sizeof(Header)) || offset % BLOCK_BYTES != 0
+                || offset > head->values_offset) {
+                return false;
+            }
+            uint64_t room = head->values_offset - offset;
+            if (size > room / sizeof(K)
+                || blocks_for(size) * BLOCK_KEYS * sizeof(K) > room) {
+                return false;
+            }
+            if (level + 1 < head->level_count
+                && head->level_sizes[level + 1] != blocks_for(size)) {
+                return false;
+            }
+        }
+        return head->level_sizes[head->level_count - 1] <= BLOCK_KEYS;
+    }
+
+    void unmap()
+    {
+#ifdef FROZEN_BTREE_MMAP
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_length);
+        }
+#endif
+        mapping = nullptr;
+        mapping_length = 0;
+    }
+
+    /** Owns the image when it was built or read into memory. */
+    std::vector<char> storage;
+    /** The start of the image, in storage or in the mapping. */
+    const char* base;
+    /** The mapped file, if the image was opened with mmap. */
+    void* mapping;
+    size_t mapping_length;
+};
+
+template <class K, class V>
+const size_t FrozenBTree<K, V>::BLOCK_BYTES;
+
+template <class K, class V>
+const size_t FrozenBTree<K, V>::BLOCK_KEYS;
+
+template <class K, class V>
+const size_t FrozenBTree<K, V>::MAX_LEVELS;
+
+template <class K, class V>
+const uint32_t FrozenBTree<K, V>::VERSION;
+
+#endif /* FROZEN_BTREE_H */
@@ -18,10 +18,12 @@ if __name__ == '__main__':
             ops = info[2]
             type = info[3]
             reader = csv.reader(data)
-            xlabel, ylabel = next(reader)
+            # Only the first two columns (n, elapsed time) are plotted; any
+            # further columns hold per-op hardware counters.
+            xlabel, ylabel = next(reader)[:2]
             plt.xlabel('%s %s (%s)' % (xlabel, ops, type))
             plt.ylabel(ylabel)
-            n, et = zip(*reader)
+            n, et = zip(*[row[:2] for row in reader])
             n = [int(x) for x in n]
             et = [int(y) for y in et]
             plt.plot(n, et, 'o', label=struct_name,)
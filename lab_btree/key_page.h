@@ -0,0 +1,277 @@
+/**
+ * @file key_page.h
+ * Compact, search-friendly images of the keys of one BTreeNode. A node's
+ * elements (an inner node's keys) stay the source of truth; a KeyPage is
+ * rebuilt from them whenever they change and is what in-node searches
+ * consult, so that searching does not have to walk a vector of full
+ * DataPairs or std::strings.
+ */
+#ifndef KEY_PAGE_H
+#define KEY_PAGE_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Generic KeyPage: key types without a compact image get no page, and
+ * searches fall back to the elements themselves.
+ */
+template <class K, class Enable = void>
+class KeyPage
+{
+  public:
+    /** Whether pages exist for this key type at all. */
+    static const bool supported = false;
+
+    /**
+     * Rebuilds the page from a node's sorted elements.
+     * @param elements The elements; each has a key member or is a key.
+     */
+    template <class E>
+    void build(const std::vector<E>&)
+    {
+    }
+
+    /**
+     * Drops the page.
+     */
+    void clear()
+    {
+    }
+
+    /**
+     * @return true if the page has been built and can answer searches.
+     */
+    bool active() const
+    {
+        return false;
+    }
+
+    /**
+     * @param key The key to look for.
+     * @return The index of the first key not less than key.
+     */
+    size_t lower_bound(const K&) const
+    {
+        return 0;
+    }
+
+    /**
+     * @param key The key to look for.
+     * @return The index of the first key greater than key.
+     */
+    size_t upper_bound(const K&) const
+    {
+        return 0;
+    }
+
+    /**
+     * @return Heap bytes held by the page.
+     */
+    size_t bytes() const
+    {
+        return 0;
+    }
+};
+
+/**
+ * Slotted page for std::string keys. The bytes of all keys live inline in
+ * one buffer: first the prefix every key in the node shares, stored once,
+ * then each key's remaining suffix. A sorted slot array points into the
+ * buffer and caches the first four suffix bytes of every key as a big
+ * endian integer, so most comparisons during a binary search are integer
+ * compares on the slot array and never touch the key bytes, let alone the
+ * heap buffers of the std::strings in the node.
+ * <pre>
+ * slots:  [head|off|len] [head|off|len] [head|off|len]
+ * bytes:  http://example.com/ | a/1 | a/2 | b
+ *         (shared prefix)       (suffixes)
+ * </pre>
+ */
+template <>
+class KeyPage<std::string, void>
+{
+  public:
+    static const bool supported = true;
+
+    KeyPage() : prefix_length(0), built(false)
+    {
+    }
+
+    template <class E>
+    void build(const std::vector<E>& elements)
+    {
+        slots.clear();
+        key_bytes.clear();
+        prefix_length = 0;
+        built = true;
+        if (elements.empty()) {
+            return;
+        }
+
+        /* The elements are sorted, so the prefix shared by the first and
+         * last key is shared by all of them. */
+        const std::string& first = key_of(elements.front());
+        const std::string& last = key_of(elements.back());
+        while (prefix_length < first.size() && prefix_length < last.size()
+               && first[prefix_length] == last[prefix_length]) {
+            prefix_length++;
+        }
+
+        size_t total = prefix_length;
+        for (auto& elem : elements) {
+            total += key_of(elem).size() - prefix_length;
+        }
+        key_bytes.reserve(total);
+        key_bytes.append(first, 0, prefix_length);
+        slots.reserve(elements.size());
+        for (auto& elem : elements) {
+            const std::string& key = key_of(elem);
+            Slot slot;
+            slot.offset = static_cast<uint32_t>(key_bytes.size());
+            slot.length = static_cast<uint32_t>(key.size() - prefix_length);
+            slot.head = head_of(key.data() + prefix_length, slot.length);
+            key_bytes.append(key, prefix_length, std::string::npos);
+            slots.push_back(slot);
+        }
+    }
+
+    void clear()
+    {
+        slots.clear();
+        slots.shrink_to_fit();
+        key_bytes.clear();
+        key_bytes.shrink_to_fit();
+        prefix_length = 0;
+        built = false;
+    }
+
+    bool active() const
+    {
+        return built;
+    }
+
+    size_t lower_bound(const std::string& key) const
+    {
+        return search(key, false);
+    }
+
+    size_t upper_bound(const std::string& key) const
+    {
+        return search(key, true);
+    }
+
+    size_t bytes() const
+    {
+        if (!built) {
+            return 0;
+        }
+        return slots.capacity() * sizeof(Slot) + key_bytes.capacity();
+    }
+
+  private:
+    struct Slot {
+        uint32_t head;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    /**
+     * @return The key of a leaf's DataPair, or an inner node's separator
+     * itself.
+     */
+    template <class E>
+    static const std::string& key_of(const E& elem)
+    {
+        return elem.key;
+    }
+
+    static const std::string& key_of(const std::string& key)
+    {
+        return key;
+    }
+
+    /**
+     * @return The first four bytes of a suffix as a big endian integer,
+     * zero padded, so that integer order matches memcmp order.
+     */
+    static uint32_t head_of(const char* suffix, size_t length)
+    {
+        uint32_t head = 0;
+        for (size_t i = 0; i < 4; i++) {
+            head <<= 8;
+            if (i < length) {
+                head |= static_cast<unsigned char>(suffix[i]);
+            }
+        }
+        return head;
+    }
+
+    /**
+     * Binary search over the slots.
+     * @param key The key to look for.
+     * @param upper Whether to skip over a slot equal to key.
+     * @return The index of the first key not less than (or, if upper, the
+     * first key greater than) key.
+     */
+    size_t search(const std::string& key, bool upper) const
+    {
+        size_t shared = key.size() < prefix_length ? key.size()
+                                                   : prefix_length;
+        int cmp = memcmp(key.data(), key_bytes.data(), shared);
+        if (cmp < 0 || (cmp == 0 && key.size() < prefix_length)) {
+            return 0;
+        }
+        if (cmp > 0) {
+            return slots.size();
+        }
+
+        const char* suffix = key.data() + prefix_length;
+        size_t suffix_length = key.size() - prefix_length;
+        uint32_t head = head_of(suffix, suffix_length);
+
+        size_t lo = 0;
+        size_t hi = slots.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int order = compare(slots[mid], head, suffix, suffix_length);
+            if (order < 0 || (upper && order == 0)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    /**
+     * @return Less than, equal to or greater than zero as the key in slot
+     * sorts before, equal to or after the given key suffix.
+     */
+    int compare(const Slot& slot, uint32_t head, const char* suffix,
+                size_t suffix_length) const
+    {
+        if (slot.head != head) {
+            return slot.head < head ? -1 : 1;
+        }
+        size_t shared = slot.length < suffix_length ? slot.length
+                                                    : suffix_length;
+        int cmp = memcmp(key_bytes.data() + slot.offset, suffix, shared);
+        if (cmp != 0) {
+            return cmp;
+        }
+        if (slot.length == suffix_length) {
+            return 0;
+        }
+        return slot.length < suffix_length ? -1 : 1;
+    }
+
+    std::vector<Slot> slots;
+    std::string key_bytes;
+    size_t prefix_length;
+    bool built;
+};
+
+#endif /* KEY_PAGE_H */
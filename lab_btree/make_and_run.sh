@@ -3,3 +3,4 @@
 make clean
 make
 ./test_btree
+./test_btree20
@@ -0,0 +1,139 @@
+/**
+ * @file perf_counters.h
+ * Thin wrapper around Linux hardware performance counters (perf_event_open)
+ * for use by Benchmark. On other platforms, or when the kernel refuses to
+ * open a counter (e.g. because of kernel.perf_event_paranoid or because the
+ * machine is virtualized), the affected counters are simply reported as
+ * unavailable.
+ */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+/**
+ * A set of hardware counters, counting user-space events of the calling
+ * thread. Each counter is opened on its own rather than as a group so that
+ * one unsupported event does not take the others down with it; if the PMU
+ * has to multiplex them, readings are scaled by time enabled / time running.
+ */
+class PerfCounters
+{
+  public:
+    /**
+     * Opens every counter the kernel lets us open.
+     */
+    PerfCounters()
+    {
+#ifdef __linux__
+        add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        add("L1d_misses", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        add("LLC_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        add("dTLB_misses", PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        add("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (auto& counter : counters) {
+            close(counter.fd);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /**
+     * @return true if at least one counter could be opened.
+     */
+    bool available() const
+    {
+        return !counters.empty();
+    }
+
+    /**
+     * @return The names of the counters that could be opened, in the order
+     * used by read().
+     */
+    std::vector<std::string> names() const
+    {
+        std::vector<std::string> ret;
+        for (auto& counter : counters) {
+            ret.push_back(counter.name);
+        }
+        return ret;
+    }
+
+    /**
+     * Reads the current (scaled) value of every open counter. Subtract two
+     * readings to count the events in between.
+     * @return One value per name in names().
+     */
+    std::vector<uint64_t> read() const
+    {
+        std::vector<uint64_t> values;
+        values.reserve(counters.size());
+#ifdef __linux__
+        for (auto& counter : counters) {
+            uint64_t buf[3] = {0, 0, 0};
+            if (::read(counter.fd, buf, sizeof(buf)) != sizeof(buf)
+                || buf[2] == 0) {
+                values.push_back(0);
+                continue;
+            }
+            /* value * time_enabled / time_running */
+            double scaled = static_cast<double>(buf[0]) * buf[1] / buf[2];
+            values.push_back(static_cast<uint64_t>(scaled));
+        }
+#endif
+        return values;
+    }
+
+  private:
+    struct Counter {
+        std::string name;
+        int fd;
+    };
+
+#ifdef __linux__
+    void add(const std::string& name, uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                           | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = static_cast<int>(
+            syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd >= 0) {
+            counters.push_back(Counter{name, fd});
+        }
+    }
+#endif
+
+    std::vector<Counter> counters;
+};
+
+#endif /* PERF_COUNTERS_H */
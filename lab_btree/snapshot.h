@@ -0,0 +1,255 @@
+/**
+ * @file snapshot.h
+ * Streaming reader and writer for BTree snapshot files, and the codecs that
+ * encode keys and values in them. A snapshot is a header, the key / value
+ * pairs in ascending key order, and a checksum over everything before it:
+ * <pre>
+ * "BTSNAPSH" version key_codec value_codec order flags count   (header)
+ * key value key value ...                                      (records)
+ * checksum                                                     (trailer)
+ * </pre>
+ * Integers are stored in the byte order of the machine that wrote the file.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/** The snapshot format version written by, and accepted by, BTree. */
+const uint32_t SNAPSHOT_VERSION = 1;
+
+/**
+ * Writes a snapshot file front to back, keeping a running FNV-1a checksum of
+ * every byte written.
+ */
+class SnapshotWriter
+{
+  public:
+    /**
+     * Creates (or truncates) a file.
+     * @param path The file to write.
+     * @throws std::runtime_error if the file cannot be created.
+     */
+    explicit SnapshotWriter(const std::string& path)
+        : path(path), file(fopen(path.c_str(), "wb")),
+          checksum(FNV_OFFSET)
+    {
+        if (file == nullptr) {
+            throw std::runtime_error("cannot create " + path);
+        }
+    }
+
+    ~SnapshotWriter()
+    {
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    void write(const void* data, size_t length)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; i++) {
+            checksum = (checksum ^ bytes[i]) * FNV_PRIME;
+        }
+        if (fwrite(data, 1, length, file) != length) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    template <class T>
+    void write_int(T value)
+    {
+        write(&value, sizeof(value));
+    }
+
+    /**
+     * Appends the checksum of everything written so far and closes the
+     * file.
+     * @throws std::runtime_error if the file cannot be written.
+     */
+    void finish()
+    {
+        uint64_t sum = checksum;
+        write_int(sum);
+        FILE* done = file;
+        file = nullptr;
+        if (fclose(done) != 0) {
+            throw std::runtime_error("cannot write " + path);
+        }
+    }
+
+    static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+  private:
+    std::string path;
+    FILE* file;
+    uint64_t checksum;
+};
+
+/**
+ * Reads a snapshot file front to back, checksumming what it reads the same
+ * way SnapshotWriter does. Every read is bounds checked against the file
+ * size, so a truncated or corrupt file throws rather than over-reading.
+ */
+class SnapshotReader
+{
+  public:
+    /**
+     * Opens a file.
+     * @param path The file to read.
+     * @throws std::runtime_error if the file cannot be opened.
+     */
+    explicit SnapshotReader(const std::string& path)
+        : path(path), file(fopen(path.c_str(), "rb")), remaining(0),
+          checksum(SnapshotWriter::FNV_OFFSET)
+    {
+        if (file == nullptr) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        if (fseek(file, 0, SEEK_END) == 0) {
+            long size = ftell(file);
+            remaining = size < 0 ? 0 : static_cast<uint64_t>(size);
+        }
+        rewind(file);
+    }
+
+    ~SnapshotReader()
+    {
+        fclose(file);
+    }
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    void read(void* data, size_t length)
+    {
+        if (length > remaining || fread(data, 1, length, file) != length) {
+            fail("is truncated");
+        }
+        remaining -= length;
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; i++) {
+            checksum = (checksum ^ bytes[i]) * SnapshotWriter::FNV_PRIME;
+        }
+    }
+
+    template <class T>
+    T read_int()
+    {
+        T value;
+        read(&value, sizeof(value));
+        return value;
+    }
+
+    /**
+     * @return The number of unread bytes in the file.
+     */
+    uint64_t bytes_left() const
+    {
+        return remaining;
+    }
+
+    /**
+     * Reads the trailing checksum and checks it, and that nothing follows.
+     * @throws std::runtime_error if they do not match.
+     */
+    void finish()
+    {
+        uint64_t expected = checksum;
+        if (read_int<uint64_t>() != expected) {
+            fail("has a bad checksum");
+        }
+        if (remaining != 0) {
+            fail("has trailing data");
+        }
+    }
+
+    /**
+     * @throws std::runtime_error naming the file and the problem.
+     */
+    void fail(const std::string& problem) const
+    {
+        throw std::runtime_error(path + " " + problem);
+    }
+
+  private:
+    std::string path;
+    FILE* file;
+    uint64_t remaining;
+    uint64_t checksum;
+};
+
+/**
+ * Encodes one key or value type in snapshots. Trivially copyable types are
+ * stored as their bytes; the codec id, stored in the header, is their size
+ * in the low 24 bits and their kind above it, so that e.g. int, unsigned int
+ * and float, which share a size, are told apart. Other types need a
+ * specialization.
+ */
+template <class T, class Enable = void>
+struct SnapshotCodec;
+
+template <class T>
+struct SnapshotCodec<
+    T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    static uint32_t id()
+    {
+        /* 0: neither integral nor floating point, 1: signed integral,
+         * 2: unsigned integral, 3: floating point. */
+        uint32_t kind = std::is_floating_point<T>::value ? 3
+                        : !std::is_integral<T>::value    ? 0
+                        : std::is_signed<T>::value       ? 1
+                                                         : 2;
+        return kind << 24 | sizeof(T);
+    }
+
+    static void write(SnapshotWriter& out, const T& value)
+    {
+        out.write(&value, sizeof(value));
+    }
+
+    static void read(SnapshotReader& in, T& value)
+    {
+        in.read(&value, sizeof(value));
+    }
+};
+
+/**
+ * std::strings are stored as a 64 bit length followed by their bytes.
+ */
+template <>
+struct SnapshotCodec<std::string, void> {
+    static uint32_t id()
+    {
+        return 0x80000000U;
+    }
+
+    static void write(SnapshotWriter& out, const std::string& value)
+    {
+        out.write_int<uint64_t>(value.size());
+        out.write(value.data(), value.size());
+    }
+
+    static void read(SnapshotReader& in, std::string& value)
+    {
+        uint64_t length = in.read_int<uint64_t>();
+        if (length > in.bytes_left()) {
+            in.fail("is truncated");
+        }
+        value.resize(length);
+        if (length > 0) {
+            in.read(&value[0], length);
+        }
+    }
+};
+
+#endif /* SNAPSHOT_H */
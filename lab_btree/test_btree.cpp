@@ -2,6 +2,7 @@
 #include <stdexcept>
 
 #include "btree.h"
+#include "btree_coro.h"
 
 using namespace std;
 
@@ -168,6 +169,37 @@ void generic_test(int order, int n)
 }
 
 
+#ifdef BTREE_CORO
+void coroutine_lookup_test()
+{
+    cout << __func__ << endl;
+    BTree<int, int> b(16);
+    auto data = make_int_data(200000, true);
+    do_inserts(data, b);
+
+    LookupScheduler scheduler(16);
+    size_t wrong = 0;
+    for (auto& key_val : data) {
+        int expected = b.find(key_val.first);
+        scheduler.submit(find_async(b, key_val.first),
+                         [&wrong, expected](int found) {
+                             wrong += found != expected;
+                         });
+        scheduler.submit(lower_bound_async(b, key_val.first + 1),
+                         [&wrong](optional<pair<int, int>> found) {
+                             wrong += found && found->first != found->second;
+                         });
+    }
+    scheduler.run();
+    if (wrong != 0) {
+        cout << "ERROR: " << wrong << " coroutine lookups disagree" << endl;
+    }
+    cout << "Coroutine lookups agree with find? " << (wrong == 0) << endl
+         << endl;
+}
+#endif
+
+
 const string USAGE =
 "USAGE: test_btree ORDER N\n"
 "Tests N inserts and N finds on a BTree< int, int > of order ORDER.\n";
@@ -181,6 +213,9 @@ int main(int argc, char* argv[])
         large_btree_small_order();
         huge_btree_large_order();
         sequential_remove_test();
+#ifdef BTREE_CORO
+        coroutine_lookup_test();
+#endif
     } else if (argc != 3) {
         cout << USAGE << endl;
         return -1;
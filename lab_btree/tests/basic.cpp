@@ -11,7 +11,12 @@
  #include <string>
  #include <unordered_map>
  #include <numeric>
+ #include <map>
+ #include <fstream>
+ #include <iterator>
  #include "../btree.h"
+ #include "../btree_coro.h"
+ #include "../workload.h"
 
 
  using namespace std;
@@ -191,6 +196,1125 @@ TEST_CASE("test_btree12_strings", "[weight=5]")
     REQUIRE(b.is_valid(5));
 }
 
+TEST_CASE("test_btree_remove_rand", "[weight=5][valgrind]")
+{
+    srand(225);
+    for (unsigned int order : {3, 4, 5, 64}) {
+        BTree< int, int > b(order);
+        map< int, int > ref;
+        for (int i = 0; i < 3000; i++) {
+            int key = rand() % 2000;
+            if (rand() % 3 == 0) {
+                b.remove(key);
+                ref.erase(key);
+            } else {
+                b.insert(key, key + 1);
+                ref.insert(make_pair(key, key + 1));
+            }
+        }
+        REQUIRE(b.is_valid(order));
+        for (int key = 0; key < 2000; key++) {
+            REQUIRE((ref.count(key) ? key + 1 : 0) == b.find(key));
+        }
+        for (int key = 0; key < 2000; key++) {
+            b.remove(key);
+        }
+        REQUIRE(b.is_valid(order));
+        REQUIRE(0 == b.find(ref.begin()->first));
+    }
+}
+
+TEST_CASE("test_btree_update_scan", "[weight=5]")
+{
+    auto data = make_int_data(1000, false);
+    BTree< int, int > b(5);
+    do_inserts(data, b);
+    REQUIRE(b.update(10, 99));
+    REQUIRE(!b.update(5000, 1));
+    REQUIRE(99 == b.find(10));
+
+    vector< int > keys;
+    size_t visited = b.scan(8, 5, [&keys](const int& key, const int&) {
+        keys.push_back(key);
+    });
+    REQUIRE(5 == visited);
+    REQUIRE((vector< int >{ 8, 9, 10, 11, 12 }) == keys);
+    REQUIRE(3 == b.scan(997, 10, [](const int&, const int&) {}));
+}
+
+TEST_CASE("test_workload_deterministic", "[weight=5]")
+{
+    WorkloadSpec spec = WorkloadSpec::parse("read=50,insert=25,scan=25");
+    Workload first(spec, 1000, 7);
+    Workload second(spec, 1000, 7);
+    size_t inserts = 0;
+    for (int i = 0; i < 1000; i++) {
+        Operation a = first.next();
+        Operation b = second.next();
+        REQUIRE(a.type == b.type);
+        REQUIRE(a.key == b.key);
+        REQUIRE(a.scan_length == b.scan_length);
+        inserts += a.type == OpType::Insert;
+    }
+    REQUIRE(inserts > 150);
+    REQUIRE(inserts < 350);
+    REQUIRE(WorkloadSpec::parse("D").distribution == KeyDistribution::Latest);
+    REQUIRE_THROWS(WorkloadSpec::parse("read=1,bogus=2"));
+    REQUIRE_THROWS(WorkloadSpec::parse("E,scanlen=0"));
+    REQUIRE_THROWS(WorkloadSpec::parse("E,scanlen=-5"));
+}
+
+TEST_CASE("test_btree_memory_usage", "[weight=5]")
+{
+    BTree< int, int > empty(8);
+    REQUIRE(0 == empty.memory_usage().total());
+
+    auto data = make_int_data(5000, false);
+    BTree< int, int > b(8);
+    do_inserts(data, b);
+    BTree< int, int >::MemoryUsage usage = b.memory_usage();
+    REQUIRE(5000 == usage.entry_count);
+    REQUIRE(usage.payload_bytes == 5000 * sizeof(BTree< int, int >::DataPair));
+    REQUIRE(usage.child_pointer_bytes
+            == (usage.node_count - 1) * sizeof(BTree< int, int >::BTreeNode*));
+    REQUIRE(usage.total() > usage.payload_bytes + usage.unused_capacity_bytes);
+
+    BTree< string, string > strings(8);
+    strings.insert("short", "x");
+    strings.insert(string(100, 'k'), string(200, 'v'));
+    BTree< string, string >::MemoryUsage string_usage = strings.memory_usage();
+    REQUIRE(string_usage.payload_bytes
+            >= 2 * sizeof(BTree< string, string >::DataPair) + 302);
+}
+
+TEST_CASE("test_btree_stats", "[weight=5]")
+{
+    BTree< int, int > b(5);
+    REQUIRE(0 == b.stats().height);
+
+    auto data = make_int_data(1000, false);
+    do_inserts(data, b);
+    auto stats = b.stats();
+    REQUIRE(1000 == stats.entry_count);
+    REQUIRE(stats.height == stats.nodes_per_level.size());
+    REQUIRE(1 == stats.nodes_per_level[0]);
+    REQUIRE(stats.leaf_count == stats.nodes_per_level.back());
+    REQUIRE(stats.leaf_count + stats.inner_count
+            == accumulate(stats.nodes_per_level.begin(),
+                          stats.nodes_per_level.end(), size_t(0)));
+    REQUIRE(stats.leaf_count
+            == accumulate(stats.leaf_fill_histogram.begin(),
+                          stats.leaf_fill_histogram.end(), size_t(0)));
+    REQUIRE(stats.counters.splits + stats.counters.root_grows + 1
+            == stats.leaf_count + stats.inner_count);
+    REQUIRE(stats.counters.root_grows == stats.height - 1);
+    REQUIRE(0 == stats.counters.merges);
+
+    for (int key = 0; key < 900; key++) {
+        b.remove(key);
+    }
+    stats = b.stats();
+    REQUIRE(100 == stats.entry_count);
+    REQUIRE(stats.counters.merges > 0);
+    REQUIRE(stats.counters.root_shrinks > 0);
+    REQUIRE(stats.counters.root_grows - stats.counters.root_shrinks
+            == stats.height - 1);
+
+    b.reset_counters();
+    REQUIRE(0 == b.stats().counters.splits);
+}
+
+TEST_CASE("test_btree_leaf_filters", "[weight=5][valgrind]")
+{
+    srand(225);
+    BTree< int, int > b(8);
+    map< int, int > ref;
+    for (int i = 0; i < 1000; i++) {
+        int key = rand() % 4000;
+        b.insert(key, key + 1);
+        ref.insert(make_pair(key, key + 1));
+    }
+    b.set_leaf_filters(true);
+    for (int i = 0; i < 4000; i++) {
+        int key = rand() % 4000;
+        if (rand() % 2 == 0) {
+            b.remove(key);
+            ref.erase(key);
+        } else {
+            b.insert(key, key + 1);
+            ref.insert(make_pair(key, key + 1));
+        }
+    }
+    REQUIRE(b.is_valid(8));
+    for (int key = 0; key < 4000; key++) {
+        REQUIRE((ref.count(key) ? key + 1 : 0) == b.find(key));
+    }
+    REQUIRE(b.memory_usage().filter_bytes > 0);
+
+    BTree< int, int > copy(b);
+    REQUIRE(copy.is_valid(8));
+    for (auto& key_val : ref) {
+        REQUIRE(key_val.second == copy.find(key_val.first));
+    }
+
+    b.set_leaf_filters(false);
+    REQUIRE(0 == b.memory_usage().filter_bytes);
+    for (auto& key_val : ref) {
+        REQUIRE(key_val.second == b.find(key_val.first));
+    }
+
+    /* Keys without a std::hash still work, just without filters. */
+    struct GridPoint {
+        int x;
+        int y;
+        bool operator<(const GridPoint& rhs) const
+        {
+            return x < rhs.x || (x == rhs.x && y < rhs.y);
+        }
+        bool operator>(const GridPoint& rhs) const
+        {
+            return rhs < *this;
+        }
+        bool operator==(const GridPoint& rhs) const
+        {
+            return x == rhs.x && y == rhs.y;
+        }
+    };
+    BTree< GridPoint, int > grid(4);
+    REQUIRE_FALSE(grid.set_leaf_filters(true));
+    REQUIRE(grid.set_leaf_filters(false));
+    for (int i = 0; i < 100; i++) {
+        grid.insert(GridPoint{ i % 10, i / 10 }, i);
+    }
+    REQUIRE(grid.is_valid(4));
+    REQUIRE(37 == grid.find(GridPoint{ 7, 3 }));
+    REQUIRE(0 == grid.memory_usage().filter_bytes);
+}
+
+TEST_CASE("test_key_page_strings", "[weight=5]")
+{
+    struct Elem {
+        string key;
+    };
+    vector< string > keys = { "", "a", string("a\0", 2), "ab", "abc",
+                              "abcd", "abcde", "abd", "b", "\xff", "\xff\xff" };
+    vector< Elem > elems;
+    for (auto& key : keys) {
+        elems.push_back(Elem{ key });
+    }
+    KeyPage< string > page;
+    page.build(elems);
+    vector< string > probes = keys;
+    probes.push_back("aa");
+    probes.push_back("abcdd");
+    probes.push_back("\xfe");
+    probes.push_back("zzz");
+    for (auto& probe : probes) {
+        size_t expected = lower_bound(keys.begin(), keys.end(), probe)
+                          - keys.begin();
+        REQUIRE(expected == page.lower_bound(probe));
+    }
+
+    vector< Elem > shared = { { "http://x/a1" }, { "http://x/a2" },
+                              { "http://x/b" } };
+    page.build(shared);
+    REQUIRE(0 == page.lower_bound("http://"));
+    REQUIRE(1 == page.lower_bound("http://x/a2"));
+    REQUIRE(3 == page.lower_bound("http://y"));
+}
+
+TEST_CASE("test_btree_key_pages", "[weight=5][valgrind]")
+{
+    srand(225);
+    BTree< string, int > b(6);
+    b.set_key_pages(true);
+    map< string, int > ref;
+    for (int i = 0; i < 3000; i++) {
+        string key = "https://example.com/items/" + to_string(rand() % 1500);
+        if (rand() % 3 == 0) {
+            b.remove(key);
+            ref.erase(key);
+        } else {
+            b.insert(key, i + 1);
+            ref.insert(make_pair(key, i + 1));
+        }
+    }
+    REQUIRE(b.is_valid(6));
+    REQUIRE(b.memory_usage().key_page_bytes > 0);
+    for (int i = 0; i < 1500; i++) {
+        string key = "https://example.com/items/" + to_string(i);
+        REQUIRE((ref.count(key) ? ref[key] : 0) == b.find(key));
+    }
+    b.set_key_pages(false);
+    REQUIRE(0 == b.memory_usage().key_page_bytes);
+    for (auto& key_val : ref) {
+        REQUIRE(key_val.second == b.find(key_val.first));
+    }
+}
+
+TEST_CASE("test_btree_separators", "[weight=5]")
+{
+    REQUIRE("user/b" == shortest_separator(string("user/alice/42"),
+                                           string("user/bob/7")));
+    REQUIRE("abc" == shortest_separator(string("ab"), string("abcdef")));
+    REQUIRE(7 == shortest_separator(3, 7));
+
+    BTree< string, int > b(8);
+    map< string, int > ref;
+    for (int i = 0; i < 2000; i++) {
+        string key = "customers/europe/accounts/" + to_string(i * 7919 % 2000);
+        b.insert(key, i);
+        ref.insert(make_pair(key, i));
+    }
+    for (int i = 0; i < 2000; i += 3) {
+        string key = "customers/europe/accounts/" + to_string(i);
+        b.remove(key);
+        ref.erase(key);
+    }
+    REQUIRE(b.is_valid(8));
+    REQUIRE(ref.size() == b.memory_usage().entry_count);
+
+    /* Every separator is a prefix of the key it was cut from, so it is no
+     * longer than the keys and shares their common prefix. */
+    vector< const BTree< string, int >::BTreeNode* > inner(1, b.root);
+    while (!inner.empty()) {
+        auto node = inner.back();
+        inner.pop_back();
+        REQUIRE(node->elements.empty());
+        for (auto& sep : node->keys) {
+            REQUIRE(sep.compare(0, 26, "customers/europe/accounts/") == 0);
+            REQUIRE(sep.size() <= 30);
+        }
+        for (auto child : node->children) {
+            if (!child->is_leaf) {
+                inner.push_back(child);
+            }
+        }
+    }
+
+    vector< string > keys;
+    b.scan("", ref.size() + 1,
+           [&](const string& key, const int&) { keys.push_back(key); });
+    REQUIRE(ref.size() == keys.size());
+    REQUIRE(equal(keys.begin(), keys.end(), ref.begin(),
+                  [](const string& key, const pair< const string, int >& kv) {
+                      return key == kv.first;
+                  }));
+
+    /* Separators carry no value, so inner nodes take more of them than
+     * leaves take pairs: 300 full leaves fit under a root and one level of
+     * inner nodes, where 16 children per node would need another level. */
+    REQUIRE((BTree< string, int >::inner_order_for(16) > 16));
+    vector< pair< string, int > > pairs;
+    for (int i = 0; i < 4500; i++) {
+        pairs.push_back(make_pair(
+            "customers/europe/accounts/" + to_string(100000 + i), i));
+    }
+    BTree< string, int > wide(16);
+    wide.bulk_load(pairs);
+    REQUIRE(wide.is_valid(16));
+    REQUIRE(300 == wide.stats().leaf_count);
+    REQUIRE(3 == wide.stats().height);
+    REQUIRE(wide.root->children.front()->children.size() > 16);
+    REQUIRE(4499 == wide.find("customers/europe/accounts/104499"));
+}
+
+TEST_CASE("test_frozen_btree", "[weight=5][valgrind]")
+{
+    typedef BTree< int, int > IntTree;
+    typedef FrozenBTree< int, int > IntFrozen;
+    REQUIRE(0 == IntTree(8).freeze().size());
+    REQUIRE(0 == IntTree(8).freeze().find(3));
+
+    for (int n : { 1, 16, 17, 300, 5000 }) {
+        BTree< int, int > b(8);
+        for (int i = 0; i < n; i++) {
+            b.insert(i * 2, i + 1);
+        }
+        FrozenBTree< int, int > frozen = b.freeze();
+        REQUIRE(size_t(n) == frozen.size());
+        for (int i = -1; i <= n * 2; i++) {
+            REQUIRE(b.find(i) == frozen.find(i));
+            REQUIRE(size_t(i < 0 ? 0 : (i + 1) / 2) == frozen.lower_bound(i));
+        }
+
+        frozen.save("frozen_btree_test.bin");
+        IntFrozen opened = IntFrozen::open("frozen_btree_test.bin");
+        remove("frozen_btree_test.bin");
+        REQUIRE(frozen.bytes() == opened.bytes());
+        vector< int > expected;
+        vector< int > scanned;
+        b.scan(n / 2, 40, [&](const int& key, const int&) {
+            expected.push_back(key);
+        });
+        opened.scan(n / 2, 40, [&](const int& key, const int& value) {
+            scanned.push_back(key);
+            REQUIRE(key / 2 + 1 == value);
+        });
+        REQUIRE(expected == scanned);
+    }
+
+    /* A truncated image, and one whose level 1 claims more entries than
+     * level 0 has blocks. Level sizes follow the 56 byte header prefix and
+     * the 64 level offsets. */
+    BTree< int, int > big(8);
+    for (int i = 0; i < 5000; i++) {
+        big.insert(i, i);
+    }
+    big.freeze().save("frozen_btree_test.bin");
+    std::string image;
+    {
+        std::ifstream in("frozen_btree_test.bin", std::ios::binary);
+        image.assign(std::istreambuf_iterator< char >(in),
+                     std::istreambuf_iterator< char >());
+    }
+    std::string truncated = image.substr(0, image.size() / 2);
+    std::ofstream("frozen_btree_test.bin", std::ios::binary) << truncated;
+    REQUIRE_THROWS_AS(IntFrozen::open("frozen_btree_test.bin"),
+                      std::runtime_error);
+    std::string corrupted = image;
+    uint64_t level_size = 10000;
+    memcpy(&corrupted[56 + 64 * 8 + 8], &level_size, sizeof(level_size));
+    std::ofstream("frozen_btree_test.bin", std::ios::binary) << corrupted;
+    REQUIRE_THROWS_AS(IntFrozen::open("frozen_btree_test.bin"),
+                      std::runtime_error);
+    std::ofstream("frozen_btree_test.bin", std::ios::binary) << image;
+    REQUIRE(5000 == IntFrozen::open("frozen_btree_test.bin").size());
+
+    BTree< int, long long >(8).freeze().save("frozen_btree_test.bin");
+    REQUIRE_THROWS_AS(IntFrozen::open("frozen_btree_test.bin"),
+                      std::runtime_error);
+    remove("frozen_btree_test.bin");
+    REQUIRE_THROWS_AS(IntFrozen::open("no/such/file"), std::runtime_error);
+}
+
+TEST_CASE("test_btree_bulk_load", "[weight=5]")
+{
+    for (size_t n : { 0, 1, 4, 5, 100, 10000 }) {
+        for (unsigned int order : { 3, 4, 5, 64 }) {
+            vector< pair< int, int > > pairs;
+            for (size_t i = 0; i < n; i++) {
+                pairs.emplace_back(int(i * 7919 % n), int(i));
+            }
+            pairs.insert(pairs.end(), pairs.begin(),
+                         pairs.begin() + pairs.size() / 2);
+            BTree< int, int > b(order);
+            b.insert(-1, -1);
+            b.bulk_load(pairs);
+            REQUIRE(b.is_valid(order));
+            REQUIRE(n == b.stats().entry_count);
+            REQUIRE(0 == b.find(-1));
+            for (size_t i = 0; i < n; i++) {
+                REQUIRE(int(i) == b.find(int(i * 7919 % n)));
+            }
+            b.insert(int(n), 1);
+            b.remove(0);
+            REQUIRE(b.is_valid(order));
+        }
+    }
+}
+
+TEST_CASE("test_btree_snapshot", "[weight=5][valgrind]")
+{
+    BTree< string, string > b(5);
+    b.set_key_pages(true);
+    for (int i = 0; i < 2000; i++) {
+        b.insert("key/" + to_string(i), string(i % 40, 'v'));
+    }
+    b.save("btree_snapshot_test.bin");
+
+    BTree< string, string > loaded;
+    loaded.insert("stale", "x");
+    loaded.load("btree_snapshot_test.bin");
+    REQUIRE(5 == loaded.order);
+    REQUIRE(loaded.key_pages);
+    REQUIRE(loaded.is_valid(5));
+    REQUIRE(2000 == loaded.stats().entry_count);
+    REQUIRE("" == loaded.find("stale"));
+    for (int i = 0; i < 2000; i++) {
+        REQUIRE(string(i % 40, 'v') == loaded.find("key/" + to_string(i)));
+    }
+
+    /* Wrong types, a flipped byte and a truncated file are all rejected,
+     * leaving the tree as it was. */
+    BTree< string, int > other_types;
+    REQUIRE_THROWS_AS(other_types.load("btree_snapshot_test.bin"),
+                      std::runtime_error);
+    string contents;
+    {
+        ifstream in("btree_snapshot_test.bin", ios::binary);
+        contents.assign(istreambuf_iterator< char >(in),
+                        istreambuf_iterator< char >());
+    }
+    string corrupt = contents;
+    corrupt[contents.size() / 2] ^= 1;
+    ofstream("btree_snapshot_test.bin", ios::binary) << corrupt;
+    REQUIRE_THROWS_AS(loaded.load("btree_snapshot_test.bin"),
+                      std::runtime_error);
+    ofstream("btree_snapshot_test.bin", ios::binary)
+        << contents.substr(0, contents.size() - 20);
+    REQUIRE_THROWS_AS(loaded.load("btree_snapshot_test.bin"),
+                      std::runtime_error);
+    REQUIRE(loaded.is_valid(5));
+    REQUIRE(string(7, 'v') == loaded.find("key/7"));
+    remove("btree_snapshot_test.bin");
+
+    BTree< int, double > numbers(16);
+    for (int i = 0; i < 1000; i++) {
+        numbers.insert(i, i / 4.0);
+    }
+    numbers.save("btree_snapshot_test.bin");
+    BTree< int, double > numbers_loaded;
+    numbers_loaded.load("btree_snapshot_test.bin");
+
+    /* Types of the same size but a different kind are rejected too. */
+    BTree< int, int > ints(8);
+    ints.insert(1, 2);
+    ints.save("btree_snapshot_test.bin");
+    BTree< float, int > floats;
+    REQUIRE_THROWS_AS(floats.load("btree_snapshot_test.bin"),
+                      std::runtime_error);
+    BTree< unsigned int, int > unsigneds;
+    REQUIRE_THROWS_AS(unsigneds.load("btree_snapshot_test.bin"),
+                      std::runtime_error);
+    remove("btree_snapshot_test.bin");
+    REQUIRE(numbers_loaded.is_valid(16));
+    REQUIRE(2.5 == numbers_loaded.find(10));
+}
+
+TEST_CASE("test_btree_order_statistics", "[weight=5][valgrind]")
+{
+    srand(36);
+    BTree< int, int > b(5);
+    b.set_subtree_counts(true);
+    map< int, int > ref;
+    for (int i = 0; i < 4000; i++) {
+        int key = rand() % 3000;
+        if (rand() % 3 == 0) {
+            b.remove(key);
+            ref.erase(key);
+        } else {
+            b.insert(key, i);
+            ref.insert(make_pair(key, i));
+        }
+    }
+    REQUIRE(b.is_valid(5));
+
+    /* Counts on, counts off, and after a copy and a bulk load. */
+    BTree< int, int > copied(b);
+    BTree< int, int > loaded(5);
+    loaded.set_subtree_counts(true);
+    loaded.bulk_load(vector< pair< int, int > >(ref.begin(), ref.end()));
+    REQUIRE(loaded.is_valid(5));
+    BTree< int, int > walked(b);
+    walked.set_subtree_counts(false);
+    for (auto tree : { &b, &copied, &loaded, &walked }) {
+        REQUIRE(ref.size() == tree->size());
+        auto it = ref.begin();
+        for (size_t i = 0; i < ref.size(); i += 7, advance(it, 7)) {
+            REQUIRE(it->first == tree->select(i).first);
+            REQUIRE(it->second == tree->select(i).second);
+            REQUIRE(i == tree->rank(it->first));
+        }
+        REQUIRE(0 == tree->select(ref.size()).first);
+        for (int lo = -5; lo < 3005; lo += 97) {
+            size_t expected = distance(ref.lower_bound(lo),
+                                       ref.upper_bound(lo + 250));
+            REQUIRE(expected == tree->count(lo, lo + 250));
+        }
+        REQUIRE(0 == tree->count(10, 9));
+    }
+    REQUIRE(b.memory_usage().count_bytes > 0);
+    REQUIRE(0 == walked.memory_usage().count_bytes);
+}
+
+TEST_CASE("test_btree_aggregate", "[weight=5][valgrind]")
+{
+    srand(37);
+    BTree< int, int > b(5);
+    b.set_aggregate([](const int& x, const int& y) { return x + y; }, 0);
+    map< int, int > ref;
+    for (int i = 0; i < 4000; i++) {
+        int key = rand() % 3000;
+        int op = rand() % 4;
+        if (op == 0) {
+            b.remove(key);
+            ref.erase(key);
+        } else if (op == 1) {
+            b.update(key, i);
+            if (ref.count(key)) {
+                ref[key] = i;
+            }
+        } else {
+            b.insert(key, i);
+            ref.insert(make_pair(key, i));
+        }
+    }
+    REQUIRE(b.is_valid(5));
+
+    BTree< int, int > copied(b);
+    BTree< int, int > loaded(5);
+    loaded.set_aggregate([](const int& x, const int& y) { return x + y; }, 0);
+    loaded.bulk_load(vector< pair< int, int > >(ref.begin(), ref.end()));
+    for (auto tree : { &b, &copied, &loaded }) {
+        for (int lo = -5; lo < 3005; lo += 97) {
+            long expected = 0;
+            auto last = ref.upper_bound(lo + 400);
+            for (auto it = ref.lower_bound(lo); it != last; ++it) {
+                expected += it->second;
+            }
+            REQUIRE(expected == tree->aggregate(lo, lo + 400));
+        }
+        REQUIRE(0 == tree->aggregate(10, 9));
+    }
+
+    /* Concatenation is not commutative, so this checks the order too. */
+    BTree< int, string > words(4);
+    words.set_aggregate(
+        [](const string& x, const string& y) { return x + y; }, "");
+    for (int i = 25; i >= 0; i--) {
+        words.insert(i, string(1, 'a' + i));
+    }
+    REQUIRE("defghijklmnopqrstuvw" == words.aggregate(3, 22));
+    words.remove(10);
+    words.update(11, "L");
+    REQUIRE("defghijLmnopqrstuvw" == words.aggregate(3, 22));
+    REQUIRE("abcdefghijLmnopqrstuvwxyz" == words.aggregate(-1, 100));
+    REQUIRE(words.memory_usage().aggregate_bytes > 0);
+
+    words.clear_aggregate();
+    REQUIRE(0 == words.memory_usage().aggregate_bytes);
+    REQUIRE_THROWS_AS(words.aggregate(3, 22), std::logic_error);
+}
+
+TEST_CASE("test_btree_append", "[weight=5][valgrind]")
+{
+    BTree< int, int > b(8);
+    b.set_subtree_counts(true);
+    b.set_aggregate([](const int& x, const int& y) { return x + y; }, 0);
+    for (int i = 0; i < 5000; i++) {
+        b.insert(2 * i, i);
+    }
+    REQUIRE(b.is_valid(8));
+    auto stats = b.stats();
+    REQUIRE(stats.avg_leaf_fill > 0.95);
+    REQUIRE(stats.avg_inner_fill > 0.75);
+    REQUIRE(stats.counters.appends > 4000);
+    REQUIRE(5000 == b.size());
+    REQUIRE(2500 == b.count(5000, 9999));
+    REQUIRE(4999 * 5000 / 2 == b.aggregate(0, 10000));
+
+    /* Keys between the appended ones take the ordinary path. */
+    for (int i = 0; i < 5000; i += 3) {
+        b.insert(2 * i + 1, 1);
+        b.remove(2 * i);
+    }
+    REQUIRE(b.is_valid(8));
+    for (int i = 0; i < 5000; i++) {
+        REQUIRE((i % 3 ? i : 0) == b.find(2 * i));
+        REQUIRE((i % 3 ? 0 : 1) == b.find(2 * i + 1));
+    }
+    for (int i = 0; i < 10000; i++) {
+        b.remove(i);
+    }
+    REQUIRE(0 == b.size());
+}
+
+TEST_CASE("test_btree_hints", "[weight=5][valgrind]")
+{
+    srand(39);
+    typedef BTree< int, int > IntTree;
+    IntTree b(5);
+    b.set_subtree_counts(true);
+    map< int, int > ref;
+    IntTree::Hint insert_hint, find_hint;
+    int key = 1000;
+    for (int i = 0; i < 6000; i++) {
+        key += rand() % 15 - 7;
+        if (i % 4 == 3) {
+            b.remove(key);
+            ref.erase(key);
+        } else {
+            b.insert(insert_hint, key, i);
+            ref.insert(make_pair(key, i));
+        }
+        REQUIRE((ref.count(key) ? ref[key] : 0) == b.find(find_hint, key));
+    }
+    REQUIRE(b.is_valid(5));
+    REQUIRE(ref.size() == b.size());
+    for (auto& pair : ref) {
+        REQUIRE(pair.second == b.find(find_hint, pair.first));
+    }
+
+    /* Hints go stale, not dangling, across a clear and on another tree. */
+    IntTree copied(b);
+    REQUIRE(b.find(key) == copied.find(find_hint, key));
+    b.clear();
+    REQUIRE(0 == b.find(find_hint, key));
+    b.insert(insert_hint, 5, 6);
+    REQUIRE(6 == b.find(find_hint, 5));
+    REQUIRE(1 == b.size());
+}
+
+TEST_CASE("test_btree_insert_batch", "[weight=5][valgrind]")
+{
+    srand(40);
+    BTree< int, int > b(5);
+    b.set_subtree_counts(true);
+    map< int, int > ref;
+    for (int round = 0; round < 20; round++) {
+        vector< pair< int, int > > batch;
+        int size = round == 0 ? 3000 : rand() % 500;
+        for (int i = 0; i < size; i++) {
+            int key = round % 2 ? rand() % 20000 : 1000 * round + rand() % 800;
+            batch.push_back(make_pair(key, round));
+        }
+        b.insert_batch(batch.begin(), batch.end());
+        ref.insert(batch.begin(), batch.end());
+        for (int i = 0; i < 100; i++) {
+            int key = rand() % 20000;
+            b.remove(key);
+            ref.erase(key);
+        }
+        REQUIRE(b.is_valid(5));
+        REQUIRE(ref.size() == b.size());
+    }
+    for (auto& pair : ref) {
+        REQUIRE(pair.second == b.find(pair.first));
+    }
+
+    /* Existing keys keep their values; the first of equal batch keys wins. */
+    vector< pair< int, int > > again(ref.begin(), ref.end());
+    again.push_back(make_pair(-1, 1));
+    again.push_back(make_pair(-1, 2));
+    for (auto& pair : again) {
+        pair.second = -pair.second;
+    }
+    b.insert_batch(again.begin(), again.end());
+    REQUIRE(ref.size() + 1 == b.size());
+    REQUIRE(-1 == b.find(-1));
+    REQUIRE(ref.begin()->second == b.find(ref.begin()->first));
+}
+
+TEST_CASE("test_btree_erase_range", "[weight=5][valgrind]")
+{
+    srand(41);
+    BTree< int, int > b(5);
+    b.set_subtree_counts(true);
+    map< int, int > ref;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 100; i++) {
+            int key = rand() % 20000;
+            b.insert(key, key);
+            ref.insert(make_pair(key, key));
+        }
+        int lo = rand() % 20000;
+        int hi = lo + (round % 10 == 0 ? rand() % 20000 : rand() % 300);
+        size_t expected = 0;
+        auto it = ref.lower_bound(lo);
+        while (it != ref.end() && it->first <= hi) {
+            it = ref.erase(it);
+            expected++;
+        }
+        REQUIRE(expected == b.erase_range(lo, hi));
+        REQUIRE(b.is_valid(5));
+        REQUIRE(ref.size() == b.size());
+    }
+    for (int key = 0; key < 20000; key++) {
+        REQUIRE((ref.count(key) ? key : 0) == b.find(key));
+    }
+
+    REQUIRE(0 == b.erase_range(10, 9));
+    REQUIRE(ref.size() == b.erase_range(-1, 20000 * 2));
+    REQUIRE(0 == b.size());
+    b.insert(1, 2);
+    REQUIRE(2 == b.find(1));
+}
+
+TEST_CASE("test_btree_lazy_remove", "[weight=5][valgrind]")
+{
+    srand(42);
+    BTree< int, int > b(5);
+    b.set_subtree_counts(true);
+    b.set_aggregate([](const int& x, const int& y) { return x + y; }, 0);
+    b.set_lazy_remove(true);
+    map< int, int > ref;
+    for (int i = 0; i < 20000; i++) {
+        int key = rand() % 2000;
+        if (rand() % 2) {
+            b.insert(key, key);
+            ref.insert(make_pair(key, key));
+        } else {
+            b.remove(key);
+            ref.erase(key);
+        }
+    }
+    REQUIRE(b.tombstone_count > 0);
+    REQUIRE(b.is_valid(5));
+    REQUIRE(ref.size() == b.size());
+    long sum = 0;
+    for (auto& pair : ref) {
+        sum += pair.second;
+    }
+    REQUIRE(sum == b.aggregate(0, 2000));
+    for (int key = 0; key < 2000; key++) {
+        REQUIRE((ref.count(key) ? key : 0) == b.find(key));
+        REQUIRE(std::distance(ref.begin(), ref.lower_bound(key))
+                == (long) b.rank(key));
+    }
+
+    size_t tombstones = b.tombstone_count;
+    REQUIRE(tombstones == b.purge());
+    REQUIRE(0 == b.tombstone_count);
+    REQUIRE(b.is_valid(5));
+    REQUIRE(ref.size() == b.size());
+
+    /* Past the ratio, removes reclaim tombstones a slice at a time, so they
+     * stay near the threshold instead of piling up to the size of the tree
+     * or being purged all at once. */
+    b.set_lazy_remove(true, 0.25);
+    size_t bound = b.purge_threshold;
+    for (int key = 0; key < 2000; key++) {
+        b.remove(key);
+        REQUIRE(b.tombstone_count <= 2 * bound);
+    }
+    REQUIRE(b.is_valid(5));
+    REQUIRE(0 == b.size());
+    b.insert(1, 2);
+    REQUIRE(2 == b.find(1));
+}
+
+TEST_CASE("test_btree_compact", "[weight=5][valgrind]")
+{
+    BTree< int, int > b(8);
+    b.set_subtree_counts(true);
+    b.set_aggregate([](const int& x, const int& y) { return x + y; }, 0);
+    for (int i = 0; i < 5000; i++) {
+        int key = i * 7 % 5000;
+        b.insert(key, key + 1);
+    }
+    for (int key = 0; key < 5000; key++) {
+        if (key % 4 != 0) {
+            b.remove(key);
+        }
+    }
+    size_t leaves = b.stats().leaf_count;
+
+    int slices = 1;
+    while (!b.compact(1.0, 16)) {
+        REQUIRE(b.is_valid(8));
+        b.insert(10000 + slices, 0);
+        b.remove(10000 + slices);
+        slices++;
+    }
+    REQUIRE(slices > 1);
+    REQUIRE(b.is_valid(8));
+    REQUIRE(1250 == b.size());
+    REQUIRE(b.stats().leaf_count < leaves);
+    REQUIRE(b.stats().avg_leaf_fill > 0.85);
+    for (int key = 0; key < 5000; key++) {
+        REQUIRE((key % 4 == 0 ? key + 1 : 0) == b.find(key));
+    }
+    long sum = 0;
+    b.scan(0, 5000, [&](const int& key, const int& value) {
+        REQUIRE(key % 4 == 0);
+        sum += value;
+    });
+    REQUIRE(sum == b.aggregate(0, 5000));
+}
+
+TEST_CASE("test_btree_merge_split", "[weight=5][valgrind]")
+{
+    BTree< int, int > low(5);
+    BTree< int, int > high(5);
+    low.set_subtree_counts(true);
+    for (int key = 0; key < 3000; key++) {
+        low.insert(key, key);
+    }
+    for (int key = 3000; key < 3100; key++) {
+        high.insert(key, key);
+    }
+    low.merge(std::move(high));
+    REQUIRE(0 == high.size());
+    REQUIRE(low.is_valid(5));
+    REQUIRE(3100 == low.size());
+    REQUIRE(3050 == low.find(3050));
+    REQUIRE(3000 == low.rank(3000));
+
+    BTree< int, int > upper = low.split_at(1234);
+    REQUIRE(low.is_valid(5));
+    REQUIRE(upper.is_valid(5));
+    REQUIRE(1234 == low.size());
+    REQUIRE(1866 == upper.size());
+    REQUIRE(0 == low.find(1234));
+    REQUIRE(1234 == upper.find(1234));
+    REQUIRE(0 == upper.rank(1234));
+
+    BTree< int, int > odd(5);
+    for (int key = 1; key < 4000; key += 2) {
+        odd.insert(key, -key);
+    }
+    upper.merge(std::move(low));
+    upper.merge(std::move(odd));
+    REQUIRE(upper.is_valid(5));
+    REQUIRE(3100 + 450 == upper.size());
+    for (int key = 0; key < 4000; key++) {
+        int expected = key < 3100 ? key : (key % 2 ? -key : 0);
+        REQUIRE(expected == upper.find(key));
+    }
+
+    /* A revived tombstone leaves its leaf with tombstone bits, none set. */
+    BTree< int, int > revived(8);
+    for (int key = 0; key < 100; key++) {
+        revived.insert(key, key);
+    }
+    revived.set_lazy_remove(true);
+    revived.remove(50);
+    revived.insert(50, 50);
+    BTree< int, int > revived_upper = revived.split_at(53);
+    REQUIRE(revived.is_valid(8));
+    REQUIRE(revived_upper.is_valid(8));
+    revived.insert(-1, -1);
+    revived_upper.insert(1000, 1000);
+    REQUIRE(54 == revived.size());
+    REQUIRE(50 == revived.find(50));
+    REQUIRE(48 == revived_upper.size());
+}
+
+TEST_CASE("test_btree_bulk_load_parallel", "[weight=5]")
+{
+    srand(45);
+    vector< pair< int, int > > data;
+    for (int i = 0; i < 50000; i++) {
+        int key = rand() % 30000;
+        data.push_back(make_pair(key, i));
+    }
+    map< int, int > ref(data.begin(), data.end());
+
+    for (unsigned int threads : {1, 3, 4}) {
+        BTree< int, int > b(16);
+        b.set_subtree_counts(true);
+        b.bulk_load_parallel(data, threads);
+        REQUIRE(b.is_valid(16));
+        REQUIRE(ref.size() == b.size());
+        for (auto& pair : ref) {
+            REQUIRE(pair.second == b.find(pair.first));
+        }
+    }
+}
+
+TEST_CASE("test_btree_parallel_copy_clear", "[weight=5]")
+{
+    srand(46);
+    BTree< int, int > b(8);
+    b.set_subtree_counts(true);
+    map< int, int > ref;
+    for (int i = 0; i < 20000; i++) {
+        int key = rand() % 50000;
+        b.insert(key, i);
+        ref.insert(make_pair(key, i));
+    }
+    REQUIRE(b.is_valid_parallel(8, 3));
+
+    for (unsigned int threads : {1, 3, 4}) {
+        BTree< int, int > copy(b, threads);
+        REQUIRE(copy.is_valid(8));
+        REQUIRE(copy.is_valid_parallel(8, threads));
+        REQUIRE(ref.size() == copy.size());
+        for (auto& pair : ref) {
+            REQUIRE(pair.second == copy.find(pair.first));
+        }
+        copy.clear_parallel(threads);
+        REQUIRE(copy.size() == 0);
+    }
+
+    BTree< int, int > doomed(b, 2);
+    std::thread teardown = doomed.clear_in_background();
+    REQUIRE(doomed.size() == 0);
+    doomed.insert(1, 1);
+    REQUIRE(doomed.find(1) == 1);
+    teardown.join();
+    REQUIRE(b.size() == ref.size());
+}
+
+TEST_CASE("test_thread_pool", "[weight=5]")
+{
+    for (int workers : {0, 1, 3}) {
+        ThreadPool pool(workers);
+        REQUIRE(pool.size() == (unsigned int) workers);
+
+        vector< int > hits(1000, 0);
+        pool.parallel_for(0, hits.size(), 16, [&](size_t i) {
+            ThreadPool::TaskGroup inner(pool);
+            inner.run([&hits, i] { hits[i]++; });
+            inner.wait();
+        });
+        for (int hit : hits) {
+            REQUIRE(hit == 1);
+        }
+
+        REQUIRE_THROWS_AS(pool.parallel_for(0, 100, 1,
+                                            [](size_t i) {
+                                                if (i == 42) {
+                                                    throw std::logic_error("");
+                                                }
+                                            }),
+                          std::logic_error);
+    }
+
+    /* A waiter outside the pool sleeps through a long task and wakes
+     * once it is done. */
+    ThreadPool slow(1);
+    std::atomic< bool > finished(false);
+    {
+        ThreadPool::TaskGroup group(slow);
+        group.run([&finished] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            finished = true;
+        });
+        group.wait();
+        REQUIRE(finished);
+    }
+
+    ThreadPool pinned(1);
+    REQUIRE_FALSE(pinned.set_affinity({ 1U << 30 }));
+
+    ThreadPool::shared().resize(2);
+    srand(47);
+    vector< pair< int, int > > data;
+    for (int i = 0; i < 20000; i++) {
+        data.push_back(make_pair(rand() % 100000, i));
+    }
+    BTree< int, int > b(16);
+    b.bulk_load_parallel(data, 3);
+    BTree< int, int > copy(b, 3);
+    REQUIRE(copy.is_valid_parallel(16, 3));
+    REQUIRE(copy.size() == b.size());
+    ThreadPool::shared().resize(-1);
+}
+
+TEST_CASE("test_btree_parallel_scan_reduce", "[weight=5]")
+{
+    BTree< int, int > b(8);
+    for (int i = 0; i < 10000; i++) {
+        b.insert(2 * i, i);
+    }
+
+    for (unsigned int threads : {1, 3, 4}) {
+        std::atomic< long > sum(0);
+        std::atomic< int > visited(0);
+        std::atomic< int > mismatched(0);
+        b.parallel_scan(101, 15000, [&](const int& key, const int& value) {
+            sum += value;
+            visited++;
+            mismatched += key != 2 * value;
+        }, threads);
+        REQUIRE(visited == 7450);
+        REQUIRE(mismatched == 0);
+        REQUIRE(sum == 7450L * (51 + 7500) / 2);
+
+        vector< int > keys = b.parallel_reduce(
+            101, 15000,
+            [](const int& key, const int&) { return vector< int >(1, key); },
+            [](vector< int > lhs, const vector< int >& rhs) {
+                lhs.insert(lhs.end(), rhs.begin(), rhs.end());
+                return lhs;
+            },
+            vector< int >(), threads);
+        REQUIRE(keys.size() == 7450);
+        REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+        REQUIRE(keys.front() == 102);
+        REQUIRE(keys.back() == 15000);
+
+        REQUIRE(b.parallel_reduce(
+                    5, 4, [](const int&, const int& value) { return value; },
+                    [](int lhs, int rhs) { return lhs + rhs; }, -1, threads)
+                == -1);
+
+        auto any = [](bool lhs, bool rhs) { return lhs || rhs; };
+        REQUIRE(b.parallel_reduce(
+            0, 20000,
+            [](const int&, const int& value) { return value == 9999; }, any,
+            false, threads));
+        REQUIRE_FALSE(b.parallel_reduce(
+            0, 20000, [](const int& key, const int&) { return key % 2 == 1; },
+            any, false, threads));
+    }
+}
+
+TEST_CASE("test_btree_scan_where", "[weight=5]")
+{
+    BTree< int, int > b(8);
+    BTree< int, double > d(8);
+    for (int i = 0; i < 5000; i++) {
+        b.insert(i, i % 100);
+        d.insert(i, (i % 100) / 4.0);
+    }
+    b.set_lazy_remove(true);
+    b.remove(1099);
+
+    vector< int > keys;
+    size_t calls = 0;
+    size_t matched = b.scan_where(1000, 2999, ValueCompare::GreaterEqual, 95,
+                                  [&](const int* batch_keys,
+                                      const int* batch_values, size_t count) {
+                                      calls++;
+                                      REQUIRE(count <= 7);
+                                      for (size_t i = 0; i < count; i++) {
+                                          REQUIRE(batch_values[i] >= 95);
+                                          keys.push_back(batch_keys[i]);
+                                      }
+                                  },
+                                  7);
+    REQUIRE(matched == 99);
+    REQUIRE(keys.size() == 99);
+    REQUIRE(calls == 15);
+    REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+    REQUIRE(keys.front() == 1095);
+    REQUIRE(keys.back() == 2999);
+
+    REQUIRE(d.scan_where(0, 4999, ValueCompare::Equal, 2.5,
+                         [](const int*, const double*, size_t) {})
+            == 50);
+    REQUIRE(d.scan_where(10, 5, ValueCompare::NotEqual, 0.0,
+                         [](const int*, const double*, size_t) {})
+            == 0);
+}
+
+#ifdef BTREE_CORO
+TEST_CASE("test_btree_coroutine_lookups", "[weight=5]")
+{
+    BTree< int, int > b(8);
+    for (int i = 0; i < 5000; i++) {
+        b.insert(3 * i, i);
+    }
+    REQUIRE(find_async(b, 300).get() == 100);
+    REQUIRE(find_async(b, 301).get() == 0);
+    REQUIRE(lower_bound_async(b, 301).get() == make_pair(303, 101));
+    REQUIRE(!lower_bound_async(b, 15000).get());
+
+    LookupScheduler scheduler(4);
+    vector< int > found(1000, -1);
+    size_t bounds = 0;
+    for (int i = 0; i < 1000; i++) {
+        scheduler.submit(find_async(b, 2 * i),
+                         [&found, i](int value) { found[i] = value; });
+        scheduler.submit(lower_bound_async(b, 2 * i),
+                         [&bounds, i](optional< pair< int, int > > pair) {
+                             bounds += pair && pair->first == (2 * i + 2) / 3 * 3;
+                         });
+        if (i % 10 == 0) {
+            scheduler.poll();
+        }
+    }
+    scheduler.run();
+    REQUIRE(scheduler.pending() == 0);
+    REQUIRE(bounds == 1000);
+    for (int i = 0; i < 1000; i++) {
+        REQUIRE(found[i] == (2 * i % 3 == 0 ? 2 * i / 3 : 0));
+    }
+}
+#endif
 
  int main(int argc, char* argv[])
  {
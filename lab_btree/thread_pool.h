@@ -0,0 +1,434 @@
+/**
+ * @file thread_pool.h
+ * A small work-stealing thread pool for fork / join parallelism. Each
+ * worker owns a deque of tasks: it pushes and pops at the back, so a
+ * worker keeps running the most recently forked (and most cache-warm)
+ * work, while idle workers steal from the front of other deques, where
+ * the oldest and usually largest tasks sit. A thread that waits for its
+ * tasks runs queued tasks while it waits instead of blocking, so nested
+ * fork / join never deadlocks and never needs more threads than the pool
+ * has.
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#define THREAD_POOL_AFFINITY 1
+#endif
+
+/**
+ * ThreadPool class. One process-wide pool, ThreadPool::shared(), is what
+ * BTree's parallel algorithms run on, so several trees working at once
+ * share its threads rather than each starting their own.
+ */
+class ThreadPool
+{
+  public:
+    class TaskGroup;
+
+    /**
+     * Starts a pool.
+     * @param threads The number of worker threads, or -1 for one fewer
+     * than the number of hardware threads, since the thread that forks
+     * work helps run it while it waits. A pool with no workers runs every
+     * task on the thread that forks it.
+     */
+    explicit ThreadPool(int threads = -1)
+        : next_target(0), queued(0), stopping(false)
+    {
+        start(threads < 0 ? default_size() : threads);
+    }
+
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * @return The pool that BTree's parallel algorithms run on.
+     */
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    /**
+     * @return The number of worker threads.
+     */
+    unsigned int size() const
+    {
+        return workers.size();
+    }
+
+    /**
+     * Replaces the workers with a new set. Must not be called while tasks
+     * are queued or running, nor from inside a task.
+     * @param threads The number of worker threads, or -1 for the default.
+     */
+    void resize(int threads)
+    {
+        stop();
+        start(threads < 0 ? default_size() : threads);
+    }
+
+    /**
+     * Pins the workers to CPUs: worker i runs only on cpus[i % cpus.size()].
+     * The pinning outlives resize(). An empty list unpins them.
+     * @param cpus The CPU numbers to use.
+     * @return false if pinning is not supported here or a CPU was refused;
+     * a CPU number too large for the platform's CPU sets leaves the
+     * workers as they were.
+     */
+    bool set_affinity(const std::vector<unsigned int>& cpus)
+    {
+#ifdef THREAD_POOL_AFFINITY
+        for (unsigned int cpu : cpus) {
+            if (cpu >= CPU_SETSIZE) {
+                return false;
+            }
+        }
+#endif
+        affinity = cpus;
+        bool pinned = true;
+        for (size_t i = 0; i < workers.size(); i++) {
+            pinned &= pin(i);
+        }
+        return pinned;
+    }
+
+    /**
+     * Runs body(i) for every i in [begin, end). The range is halved
+     * recursively, forking the upper half each time, until pieces are at
+     * most grain long, so idle workers steal the biggest pieces first.
+     * @param begin The first index.
+     * @param end One past the last index.
+     * @param grain The longest piece run as one task; at least 1.
+     * @param body Callable invoked as body(i).
+     */
+    template <class F>
+    void parallel_for(size_t begin, size_t end, size_t grain, const F& body);
+
+  private:
+    struct Task {
+        std::function<void()> run;
+        TaskGroup* group;
+    };
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    /** The pool and worker the calling thread belongs to, if any. */
+    struct Membership {
+        ThreadPool* pool;
+        size_t index;
+    };
+
+    static Membership& membership()
+    {
+        static thread_local Membership current = {nullptr, 0};
+        return current;
+    }
+
+    static int default_size()
+    {
+        unsigned int hardware = std::thread::hardware_concurrency();
+        return hardware > 1 ? hardware - 1 : 0;
+    }
+
+    void start(size_t threads)
+    {
+        stopping = false;
+        for (size_t i = 0; i < threads; i++) {
+            workers.push_back(std::unique_ptr<Worker>(new Worker));
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers[i]->thread = std::thread(&ThreadPool::work, this, i);
+            if (!affinity.empty()) {
+                pin(i);
+            }
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> hold(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+        workers.clear();
+    }
+
+    bool pin(size_t i)
+    {
+#ifdef THREAD_POOL_AFFINITY
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (affinity.empty()) {
+            for (unsigned int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+        } else {
+            CPU_SET(affinity[i % affinity.size()], &set);
+        }
+        return pthread_setaffinity_np(workers[i]->thread.native_handle(),
+                                      sizeof(set), &set) == 0;
+#else
+        (void) i;
+        return affinity.empty();
+#endif
+    }
+
+    /**
+     * Queues a task: on the calling worker's own deque, or round robin
+     * across the workers for threads outside the pool.
+     */
+    void push(Task task)
+    {
+        Membership& current = membership();
+        size_t target = current.pool == this
+                            ? current.index
+                            : next_target++ % workers.size();
+        /* Counted before it is visible, so a thief never takes queued
+         * below zero. */
+        {
+            std::lock_guard<std::mutex> hold(sleep_lock);
+            queued++;
+        }
+        {
+            std::lock_guard<std::mutex> hold(workers[target]->lock);
+            workers[target]->tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    /**
+     * Takes a task: the newest on the calling worker's own deque, else the
+     * oldest on another's.
+     * @return false if every deque is empty.
+     */
+    bool take(Task& task)
+    {
+        Membership& current = membership();
+        size_t self = current.pool == this ? current.index : workers.size();
+        if (self < workers.size()) {
+            Worker& own = *workers[self];
+            std::lock_guard<std::mutex> hold(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i <= workers.size(); i++) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> hold(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(Task& task);
+
+    void work(size_t index)
+    {
+        membership().pool = this;
+        membership().index = index;
+        Task task;
+        while (true) {
+            if (take(task)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> hold(sleep_lock);
+            wake.wait(hold, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+    template <class F>
+    void split(TaskGroup& group, size_t begin, size_t end, size_t grain,
+               const F& body);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<unsigned int> affinity;
+    std::atomic<size_t> next_target;
+    std::atomic<size_t> queued;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+/**
+ * A set of forked tasks to join. Tasks may fork more tasks into the same
+ * or other groups. If a task throws, wait() rethrows the first exception
+ * once every task of the group has finished. A waiter with nothing left
+ * to run spins briefly, then sleeps until the group's last task finishes.
+ */
+class ThreadPool::TaskGroup
+{
+  public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool), pending(0)
+    {
+    }
+
+    ~TaskGroup()
+    {
+        try {
+            wait();
+        } catch (...) {
+        }
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /**
+     * Forks a task. With no workers in the pool it runs right away.
+     * @param task Callable invoked as task().
+     */
+    template <class F>
+    void run(F task)
+    {
+        pending++;
+        Task forked = {std::move(task), this};
+        if (pool.workers.empty()) {
+            pool.execute(forked);
+        } else {
+            pool.push(std::move(forked));
+        }
+    }
+
+    /**
+     * Joins the forked tasks, running queued tasks in the meantime.
+     * @throws The first exception any of the tasks threw.
+     */
+    void wait()
+    {
+        Task task;
+        unsigned int idle = 0;
+        while (pending > 0) {
+            if (pool.take(task)) {
+                pool.execute(task);
+                idle = 0;
+            } else if (++idle < SPINS) {
+                std::this_thread::yield();
+            } else {
+                /* The timeout only matters if more tasks get queued while
+                 * asleep; waking now and then lets this thread help. */
+                std::unique_lock<std::mutex> hold(done_lock);
+                done.wait_for(hold, std::chrono::milliseconds(1),
+                              [this] { return pending == 0; });
+            }
+        }
+        /* The last task may still hold done_lock while notifying; the
+         * group must outlive that. */
+        std::lock_guard<std::mutex> hold(done_lock);
+        if (error) {
+            std::exception_ptr thrown = error;
+            error = nullptr;
+            std::rethrow_exception(thrown);
+        }
+    }
+
+  private:
+    friend class ThreadPool;
+
+    void fail(std::exception_ptr thrown)
+    {
+        std::lock_guard<std::mutex> hold(error_lock);
+        if (!error) {
+            error = thrown;
+        }
+    }
+
+    /** Times wait() finds nothing to run before it sleeps. */
+    static const unsigned int SPINS = 64;
+
+    ThreadPool& pool;
+    std::atomic<size_t> pending;
+    std::mutex done_lock;
+    std::condition_variable done;
+    std::mutex error_lock;
+    std::exception_ptr error;
+};
+
+/**
+ * Runs a task and marks it done in its group, waking the group's waiter
+ * if it was the last. The waiter takes done_lock before it returns, so
+ * the group outlives this, the last access to it.
+ */
+inline void ThreadPool::execute(Task& task)
+{
+    TaskGroup* group = task.group;
+    try {
+        task.run();
+    } catch (...) {
+        group->fail(std::current_exception());
+    }
+    task.run = nullptr;
+    std::lock_guard<std::mutex> hold(group->done_lock);
+    if (--group->pending == 0) {
+        group->done.notify_all();
+    }
+}
+
+template <class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain,
+                              const F& body)
+{
+    TaskGroup group(*this);
+    split(group, begin, end, std::max<size_t>(grain, 1), body);
+    group.wait();
+}
+
+template <class F>
+void ThreadPool::split(TaskGroup& group, size_t begin, size_t end,
+                       size_t grain, const F& body)
+{
+    while (end - begin > grain) {
+        size_t mid = begin + (end - begin) / 2;
+        group.run([this, &group, mid, end, grain, &body] {
+            split(group, mid, end, grain, body);
+        });
+        end = mid;
+    }
+    for (size_t i = begin; i < end; i++) {
+        body(i);
+    }
+}
+
+#endif /* THREAD_POOL_H */
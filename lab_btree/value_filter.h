@@ -0,0 +1,204 @@
+/**
+ * @file value_filter.h
+ * Comparison predicates on arithmetic values, evaluated a run of leaf
+ * elements at a time. Leaves store key / value pairs side by side, so the
+ * values of a run are not contiguous; where the layout allows it, SSE2
+ * loads whole pairs and shuffles the values out of them, comparing four
+ * (or two) values per instruction.
+ */
+#ifndef VALUE_FILTER_H
+#define VALUE_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** How a value is compared against a ValueFilter's bound. */
+enum class ValueCompare {
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Equal,
+    NotEqual
+};
+
+/**
+ * Matches values v for which "v op bound" holds.
+ */
+template <class V>
+class ValueFilter
+{
+    static_assert(std::is_arithmetic<V>::value,
+                  "ValueFilter needs an arithmetic value type");
+
+  public:
+    ValueFilter(ValueCompare op, V bound) : op(op), bound(bound)
+    {
+    }
+
+    bool matches(V value) const
+    {
+        switch (op) {
+            case ValueCompare::Less:
+                return value < bound;
+            case ValueCompare::LessEqual:
+                return value <= bound;
+            case ValueCompare::Greater:
+                return value > bound;
+            case ValueCompare::GreaterEqual:
+                return value >= bound;
+            case ValueCompare::Equal:
+                return value == bound;
+            default:
+                return value != bound;
+        }
+    }
+
+    /**
+     * @param pairs A run of elements, each with a value member.
+     * @param count The length of the run; at most 64.
+     * @return A mask with bit i set if pairs[i].value matches.
+     */
+    template <class P>
+    uint64_t match_mask(const P* pairs, size_t count) const
+    {
+        uint64_t mask = 0;
+        size_t i = count == 0 ? 0 : match_prefix(pairs, count, mask);
+        for (; i < count; i++) {
+            mask |= static_cast<uint64_t>(matches(pairs[i].value)) << i;
+        }
+        return mask;
+    }
+
+  private:
+    /**
+     * Matches as much of a run as SSE2 can: 4 byte values in 8 byte pairs
+     * and doubles in 16 byte pairs, each stored in the upper half of its
+     * pair.
+     * @return The number of pairs matched; the rest are left to scalar
+     * code.
+     */
+    template <class P>
+    size_t match_prefix(const P* pairs, size_t count, uint64_t& mask) const
+    {
+#ifdef __SSE2__
+        size_t offset = reinterpret_cast<const char*>(&pairs[0].value)
+                        - reinterpret_cast<const char*>(pairs);
+        const __m128i* lanes = reinterpret_cast<const __m128i*>(pairs);
+        size_t i = 0;
+        if (sizeof(V) == 4 && sizeof(P) == 8 && offset == 4) {
+            for (; i + 4 <= count; i += 4) {
+                __m128 lo = _mm_castsi128_ps(_mm_loadu_si128(lanes + i / 2));
+                __m128 hi =
+                    _mm_castsi128_ps(_mm_loadu_si128(lanes + i / 2 + 1));
+                __m128 values = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+                mask |= static_cast<uint64_t>(compare4(values)) << i;
+            }
+        } else if (std::is_same<V, double>::value && sizeof(P) == 16
+                   && offset == 8) {
+            for (; i + 2 <= count; i += 2) {
+                __m128d values =
+                    _mm_unpackhi_pd(_mm_castsi128_pd(_mm_loadu_si128(lanes + i)),
+                                    _mm_castsi128_pd(
+                                        _mm_loadu_si128(lanes + i + 1)));
+                mask |= static_cast<uint64_t>(compare2(values)) << i;
+            }
+        }
+        return i;
+#else
+        (void) pairs;
+        (void) count;
+        (void) mask;
+        return 0;
+#endif
+    }
+
+#ifdef __SSE2__
+    /**
+     * @param values Four 4 byte values.
+     * @return One bit per matching value.
+     */
+    int compare4(__m128 values) const
+    {
+        if (std::is_floating_point<V>::value) {
+            __m128 target = _mm_set1_ps(static_cast<float>(bound));
+            switch (op) {
+                case ValueCompare::Less:
+                    return _mm_movemask_ps(_mm_cmplt_ps(values, target));
+                case ValueCompare::LessEqual:
+                    return _mm_movemask_ps(_mm_cmple_ps(values, target));
+                case ValueCompare::Greater:
+                    return _mm_movemask_ps(_mm_cmpgt_ps(values, target));
+                case ValueCompare::GreaterEqual:
+                    return _mm_movemask_ps(_mm_cmpge_ps(values, target));
+                case ValueCompare::Equal:
+                    return _mm_movemask_ps(_mm_cmpeq_ps(values, target));
+                default:
+                    return _mm_movemask_ps(_mm_cmpneq_ps(values, target));
+            }
+        }
+
+        /* SSE2 only compares signed lanes, so unsigned values and the
+         * bound are biased by flipping their sign bits. */
+        __m128i target = _mm_set1_epi32(static_cast<int>(bound));
+        __m128i lanes = _mm_castps_si128(values);
+        if (std::is_unsigned<V>::value) {
+            __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000U));
+            target = _mm_xor_si128(target, bias);
+            lanes = _mm_xor_si128(lanes, bias);
+        }
+        switch (op) {
+            case ValueCompare::Less:
+                return lane_mask(_mm_cmplt_epi32(lanes, target));
+            case ValueCompare::LessEqual:
+                return ~lane_mask(_mm_cmpgt_epi32(lanes, target)) & 0xf;
+            case ValueCompare::Greater:
+                return lane_mask(_mm_cmpgt_epi32(lanes, target));
+            case ValueCompare::GreaterEqual:
+                return ~lane_mask(_mm_cmplt_epi32(lanes, target)) & 0xf;
+            case ValueCompare::Equal:
+                return lane_mask(_mm_cmpeq_epi32(lanes, target));
+            default:
+                return ~lane_mask(_mm_cmpeq_epi32(lanes, target)) & 0xf;
+        }
+    }
+
+    static int lane_mask(__m128i lanes)
+    {
+        return _mm_movemask_ps(_mm_castsi128_ps(lanes));
+    }
+
+    /**
+     * @param values Two doubles.
+     * @return One bit per matching value.
+     */
+    int compare2(__m128d values) const
+    {
+        __m128d target = _mm_set1_pd(static_cast<double>(bound));
+        switch (op) {
+            case ValueCompare::Less:
+                return _mm_movemask_pd(_mm_cmplt_pd(values, target));
+            case ValueCompare::LessEqual:
+                return _mm_movemask_pd(_mm_cmple_pd(values, target));
+            case ValueCompare::Greater:
+                return _mm_movemask_pd(_mm_cmpgt_pd(values, target));
+            case ValueCompare::GreaterEqual:
+                return _mm_movemask_pd(_mm_cmpge_pd(values, target));
+            case ValueCompare::Equal:
+                return _mm_movemask_pd(_mm_cmpeq_pd(values, target));
+            default:
+                return _mm_movemask_pd(_mm_cmpneq_pd(values, target));
+        }
+    }
+#endif
+
+    ValueCompare op;
+    V bound;
+};
+
+#endif /* VALUE_FILTER_H */
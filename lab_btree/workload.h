@@ -0,0 +1,469 @@
+/**
+ * @file workload.h
+ * YCSB-style workload generation for the dictionary benchmarks. A Workload
+ * turns a WorkloadSpec (an operation mix plus a key distribution) into a
+ * deterministic stream of Operations over a numbered set of records.
+ */
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * The kinds of operation a workload can issue.
+ */
+enum class OpType { Read, Update, Insert, Remove, Scan, ReadModifyWrite };
+
+/**
+ * How the record targeted by an operation is chosen.
+ * - Uniform: every existing record is equally likely.
+ * - Zipfian: a few hot records receive most requests; hot records are
+ *   scattered over the key space rather than clustered at its start.
+ * - Latest: like Zipfian, but the most recently inserted records are hot.
+ */
+enum class KeyDistribution { Uniform, Zipfian, Latest };
+
+/**
+ * A single generated operation.
+ */
+struct Operation {
+    OpType type;
+    int key;
+    unsigned int scan_length;
+
+    Operation(OpType type, int key, unsigned int scan_length = 0)
+        : type(type), key(key), scan_length(scan_length)
+    {
+    }
+};
+
+/**
+ * Describes a workload: the proportion of each operation type, how keys are
+ * chosen and how records are numbered into keys. Proportions need not sum
+ * to one; they are normalized when the workload is built.
+ */
+struct WorkloadSpec {
+    std::string name;
+    double read;
+    double update;
+    double insert;
+    double remove;
+    double scan;
+    double read_modify_write;
+    KeyDistribution distribution;
+    unsigned int max_scan_length;
+    bool hashed_keys;
+    /** The fraction of reads that look up keys never inserted. */
+    double read_miss;
+
+    WorkloadSpec()
+        : name("custom"), read(1.0), update(0.0), insert(0.0), remove(0.0),
+          scan(0.0), read_modify_write(0.0),
+          distribution(KeyDistribution::Uniform), max_scan_length(100),
+          hashed_keys(true), read_miss(0.0)
+    {
+    }
+
+    /**
+     * Returns one of the standard YCSB core workloads.
+     * - A: 50% reads, 50% updates, zipfian.
+     * - B: 95% reads, 5% updates, zipfian.
+     * - C: 100% reads, zipfian.
+     * - D: 95% reads, 5% inserts, latest.
+     * - E: 95% short scans, 5% inserts, zipfian.
+     * - F: 50% reads, 50% read-modify-writes, zipfian.
+     * @param letter The workload letter, A through F.
+     */
+    static WorkloadSpec preset(char letter)
+    {
+        WorkloadSpec spec;
+        spec.name = std::string("ycsb-") + letter;
+        spec.distribution = KeyDistribution::Zipfian;
+        switch (letter) {
+            case 'A':
+                spec.read = 0.5;
+                spec.update = 0.5;
+                break;
+            case 'B':
+                spec.read = 0.95;
+                spec.update = 0.05;
+                break;
+            case 'C':
+                break;
+            case 'D':
+                spec.read = 0.95;
+                spec.insert = 0.05;
+                spec.distribution = KeyDistribution::Latest;
+                break;
+            case 'E':
+                spec.read = 0.0;
+                spec.scan = 0.95;
+                spec.insert = 0.05;
+                break;
+            case 'F':
+                spec.read = 0.5;
+                spec.read_modify_write = 0.5;
+                break;
+            default:
+                throw std::invalid_argument("unknown YCSB workload");
+        }
+        return spec;
+    }
+
+    /**
+     * Parses a workload description: a comma separated list whose first
+     * entry may be a preset letter (A-F), followed by name=value overrides.
+     * Recognized names are read, update, insert, remove, scan, rmw (weights),
+     * dist (uniform, zipfian or latest), scanlen (maximum scan length),
+     * keys (hashed or ordered) and miss (the fraction of reads that miss).
+     * E.g. "B,dist=uniform", "C,miss=0.7" or
+     * "read=90,update=10,dist=zipfian".
+     * @param desc The description to parse.
+     */
+    static WorkloadSpec parse(const std::string& desc)
+    {
+        WorkloadSpec spec;
+        std::stringstream tokens(desc);
+        std::string token;
+        bool first = true;
+        bool custom_mix = false;
+        while (std::getline(tokens, token, ',')) {
+            size_t eq = token.find('=');
+            if (first && eq == std::string::npos && token.size() == 1) {
+                spec = preset(static_cast<char>(::toupper(token[0])));
+                first = false;
+                continue;
+            }
+            first = false;
+            if (eq == std::string::npos) {
+                throw std::invalid_argument("expected name=value: " + token);
+            }
+            std::string field = token.substr(0, eq);
+            std::string value = token.substr(eq + 1);
+            if (field == "dist") {
+                spec.distribution = parse_distribution(value);
+            } else if (field == "scanlen") {
+                int length = std::stoi(value);
+                if (length < 1) {
+                    throw std::invalid_argument("scanlen must be at least 1");
+                }
+                spec.max_scan_length = length;
+            } else if (field == "miss") {
+                spec.read_miss = std::stod(value);
+                if (spec.read_miss < 0.0 || spec.read_miss > 1.0) {
+                    throw std::invalid_argument("miss must be in [0, 1]");
+                }
+            } else if (field == "keys") {
+                if (value != "hashed" && value != "ordered") {
+                    throw std::invalid_argument("unknown key order: " + value);
+                }
+                spec.hashed_keys = value == "hashed";
+            } else {
+                if (!custom_mix) {
+                    /* The first explicit weight replaces the whole mix. */
+                    spec.read = spec.update = spec.insert = 0.0;
+                    spec.remove = spec.scan = spec.read_modify_write = 0.0;
+                    custom_mix = true;
+                }
+                weight(spec, field) = std::stod(value);
+            }
+        }
+        if (custom_mix || spec.name == "custom") {
+            spec.name = custom_name(spec);
+        }
+        if (spec.read_miss > 0.0) {
+            std::stringstream name;
+            name << spec.name << "-miss" << spec.read_miss;
+            spec.name = name.str();
+        }
+        return spec;
+    }
+
+    /**
+     * @return The name of the key distribution, e.g. "zipfian".
+     */
+    std::string distribution_name() const
+    {
+        switch (distribution) {
+            case KeyDistribution::Zipfian:
+                return "zipfian";
+            case KeyDistribution::Latest:
+                return "latest";
+            default:
+                return "uniform";
+        }
+    }
+
+  private:
+    static KeyDistribution parse_distribution(const std::string& value)
+    {
+        if (value == "uniform") {
+            return KeyDistribution::Uniform;
+        } else if (value == "zipfian") {
+            return KeyDistribution::Zipfian;
+        } else if (value == "latest") {
+            return KeyDistribution::Latest;
+        }
+        throw std::invalid_argument("unknown distribution: " + value);
+    }
+
+    static double& weight(WorkloadSpec& spec, const std::string& field)
+    {
+        if (field == "read") {
+            return spec.read;
+        } else if (field == "update") {
+            return spec.update;
+        } else if (field == "insert") {
+            return spec.insert;
+        } else if (field == "remove") {
+            return spec.remove;
+        } else if (field == "scan") {
+            return spec.scan;
+        } else if (field == "rmw") {
+            return spec.read_modify_write;
+        }
+        throw std::invalid_argument("unknown workload field: " + field);
+    }
+
+    static std::string custom_name(const WorkloadSpec& spec)
+    {
+        std::stringstream name;
+        name << "mix-r" << spec.read << "-u" << spec.update << "-i"
+             << spec.insert << "-d" << spec.remove << "-s" << spec.scan
+             << "-m" << spec.read_modify_write;
+        return name.str();
+    }
+};
+
+/**
+ * Zipfian generator over [0, items), following Gray et al., "Quickly
+ * Generating Billion-Record Synthetic Databases" (the same construction
+ * YCSB uses). Item 0 is the most popular. The item count may grow; the zeta
+ * constant is then extended incrementally instead of being recomputed.
+ */
+class ZipfianGenerator
+{
+  public:
+    static constexpr double DEFAULT_THETA = 0.99;
+
+    ZipfianGenerator(uint64_t items, double theta = DEFAULT_THETA)
+        : items(0), theta(theta), zetan(0.0)
+    {
+        zeta2 = 1.0 + std::pow(0.5, theta);
+        alpha = 1.0 / (1.0 - theta);
+        grow(items);
+    }
+
+    /**
+     * Extends the generator to cover [0, new_items).
+     * @param new_items The new item count; ignored if not larger.
+     */
+    void grow(uint64_t new_items)
+    {
+        if (new_items <= items) {
+            return;
+        }
+        for (uint64_t i = items + 1; i <= new_items; i++) {
+            zetan += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        items = new_items;
+        eta = (1.0 - std::pow(2.0 / items, 1.0 - theta))
+              / (1.0 - zeta2 / zetan);
+    }
+
+    template <class RNG>
+    uint64_t next(RNG& rng)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < zeta2) {
+            return 1;
+        }
+        uint64_t ret = static_cast<uint64_t>(
+            items * std::pow(eta * u - eta + 1.0, alpha));
+        return ret < items ? ret : items - 1;
+    }
+
+  private:
+    uint64_t items;
+    double theta;
+    double zetan;
+    double zeta2;
+    double alpha;
+    double eta;
+};
+
+/**
+ * Produces a deterministic (for a given seed) stream of operations over
+ * records numbered from 0. The first record_count records are assumed to
+ * have been loaded already; see key_of for the key of each record.
+ */
+class Workload
+{
+  public:
+    /**
+     * @param spec The operation mix and key distribution.
+     * @param record_count The number of records loaded before the run.
+     * @param seed Seed for every random choice the workload makes.
+     */
+    Workload(const WorkloadSpec& spec, uint64_t record_count, uint64_t seed)
+        : spec(spec), rng(seed), next_record(record_count),
+          zipf(record_count == 0 ? 1 : record_count)
+    {
+        double weights[] = {spec.read, spec.update, spec.insert,
+                            spec.remove, spec.scan, spec.read_modify_write};
+        double total = 0.0;
+        for (double w : weights) {
+            if (w < 0.0) {
+                throw std::invalid_argument("negative workload weight");
+            }
+            total += w;
+        }
+        if (total <= 0.0) {
+            throw std::invalid_argument("workload has no operations");
+        }
+        if (spec.scan > 0.0 && spec.max_scan_length < 1) {
+            throw std::invalid_argument("scan length must be at least 1");
+        }
+        double sum = 0.0;
+        for (double w : weights) {
+            sum += w / total;
+            cumulative.push_back(sum);
+        }
+    }
+
+    /**
+     * Maps a record number to its key. Ordered workloads use the record
+     * number itself; hashed ones scramble it with a bijection on the
+     * non-negative ints so that new records land all over the key space.
+     * @param record The record number.
+     * @return The key of that record.
+     */
+    int key_of(uint64_t record) const
+    {
+        if (!spec.hashed_keys) {
+            return static_cast<int>(record & 0x7fffffff);
+        }
+        uint32_t x = static_cast<uint32_t>(record) & 0x7fffffff;
+        x = (x * 0x2545f491u) & 0x7fffffff;
+        x ^= x >> 15;
+        x = (x * 0x6b43a9b5u) & 0x7fffffff;
+        x ^= x >> 13;
+        return static_cast<int>(x);
+    }
+
+    /**
+     * @return The next operation of the stream.
+     */
+    Operation next()
+    {
+        double pick = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t type = 0;
+        while (type + 1 < cumulative.size() && pick >= cumulative[type]) {
+            type++;
+        }
+
+        switch (static_cast<OpType>(type)) {
+            case OpType::Insert:
+                return Operation(OpType::Insert, key_of(next_record++));
+            case OpType::Read:
+                if (spec.read_miss > 0.0
+                    && std::uniform_real_distribution<double>(0.0, 1.0)(rng)
+                           < spec.read_miss) {
+                    return Operation(OpType::Read, key_of(choose_missing()));
+                }
+                return Operation(OpType::Read, key_of(choose_record()));
+            case OpType::Scan: {
+                std::uniform_int_distribution<unsigned int> len(
+                    1, spec.max_scan_length);
+                return Operation(OpType::Scan, key_of(choose_record()),
+                                 len(rng));
+            }
+            default:
+                return Operation(static_cast<OpType>(type),
+                                 key_of(choose_record()));
+        }
+    }
+
+    /**
+     * Generates the next count operations.
+     * @param count How many operations to generate.
+     */
+    std::vector<Operation> generate(size_t count)
+    {
+        std::vector<Operation> ops;
+        ops.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            ops.push_back(next());
+        }
+        return ops;
+    }
+
+  private:
+    /** Records from here on are never inserted by a workload. */
+    static const uint64_t MISSING_RECORDS = uint64_t(1) << 30;
+
+    /**
+     * Chooses a record that is never inserted, so its key misses. Records
+     * are numbered upwards from 0 and key_of is a bijection on 31 bits, so
+     * keys of records in [2^30, 2^31) are absent as long as fewer than 2^30
+     * records are ever inserted.
+     */
+    uint64_t choose_missing()
+    {
+        return MISSING_RECORDS
+               + std::uniform_int_distribution<uint64_t>(
+                     0, MISSING_RECORDS - 1)(rng);
+    }
+
+    uint64_t choose_record()
+    {
+        if (next_record == 0) {
+            return 0;
+        }
+        switch (spec.distribution) {
+            case KeyDistribution::Zipfian:
+                /* Scramble the popularity rank so that hot records are not
+                 * neighbours in the key space. */
+                return scramble(zipf.next(rng)) % next_record;
+            case KeyDistribution::Latest:
+                zipf.grow(next_record);
+                return next_record - 1 - zipf.next(rng);
+            default:
+                return std::uniform_int_distribution<uint64_t>(
+                    0, next_record - 1)(rng);
+        }
+    }
+
+    /**
+     * 64 bit FNV-1a hash of a rank.
+     */
+    static uint64_t scramble(uint64_t rank)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; i++) {
+            hash ^= rank & 0xff;
+            hash *= 0x100000001b3ULL;
+            rank >>= 8;
+        }
+        return hash;
+    }
+
+    WorkloadSpec spec;
+    std::mt19937_64 rng;
+    uint64_t next_record;
+    ZipfianGenerator zipf;
+    std::vector<double> cumulative;
+};
+
+#endif /* WORKLOAD_H */